@@ -14,8 +14,52 @@ uniform vec4 u_light_color;
 uniform float u_light_intensity;
 uniform float u_light_shininess;
 
+//Shadows of the volumes, read from their deep opacity maps for this light (see deep_opacity.fs)
+#define MAX_SHADOW_VOLUMES 4
+uniform int u_num_shadow_volumes;
+uniform sampler2D u_shadow_opacity_maps[MAX_SHADOW_VOLUMES];
+uniform mat4 u_shadow_inverse_models[MAX_SHADOW_VOLUMES]; //world to the local space of each volume
+uniform mat4 u_shadow_viewprojections[MAX_SHADOW_VOLUMES]; //that local space to the clip space of its map
+uniform vec3 u_shadow_light_positions[MAX_SHADOW_VOLUMES]; //the light in that local space
+
 out vec4 FragColor;
 
+bool intersections(vec3 ray_origin, vec3 ray_direction, vec3 box_min, vec3 box_max, out float t_near, out float t_far) {
+	vec3 t_min = (box_min - ray_origin) / ray_direction;
+	vec3 t_max = (box_max - ray_origin) / ray_direction;
+	vec3 t1 = min(t_min, t_max);
+	vec3 t2 = max(t_min, t_max);
+	t_near = max(max(t1.x, t1.y), t1.z);
+	t_far = min(min(t2.x, t2.y), t2.z);
+	return t_near <= t_far && t_far > 0.0;
+}
+
+// Optical depth of a volume between the light and pos (local to the volume), interpolated between the
+// slabs of its deep opacity map. Zero where the map does not reach
+float opacityMapDepth(sampler2D map, mat4 map_viewprojection, vec3 light_position, vec3 pos) {
+	vec4 clip = map_viewprojection * vec4(pos, 1.0);
+	if (clip.w <= 0.0) {
+		return 0.0;
+	}
+	vec2 uv = clip.xy / clip.w * 0.5 + vec2(0.5);
+	if (any(lessThan(uv, vec2(0.0))) || any(greaterThan(uv, vec2(1.0)))) {
+		return 0.0;
+	}
+
+	vec3 ray_direction = normalize(pos - light_position);
+	float t_near, t_far;
+	if (!intersections(light_position, ray_direction, vec3(-1.0), vec3(1.0), t_near, t_far)) {
+		return 0.0;
+	}
+	t_near = max(t_near, 0.0);
+	float layer = clamp((length(pos - light_position) - t_near) / max(t_far - t_near, 1e-6), 0.0, 1.0) * 4.0;
+
+	vec4 depths = texture(map, uv);
+	float slabs[5] = float[5](0.0, depths.r, depths.g, depths.b, depths.a);
+	int i = min(int(layer), 3);
+	return mix(slabs[i], slabs[i + 1], layer - float(i));
+}
+
 void main()
 {
 	vec3 N = normalize(v_normal);
@@ -30,6 +74,13 @@ void main()
 	float spec = pow(max(dot(V, R), 0.0), u_light_shininess);
 	vec4 specular = spec * u_light_color;
 
-	vec4 phong_color = (u_ambient_light + diffuse + specular) * u_color;
+	// only the light is shadowed, the ambient term is not
+	float shadow = 1.0;
+	for (int i = 0; i < u_num_shadow_volumes; i++) {
+		vec3 local_pos = (u_shadow_inverse_models[i] * vec4(v_world_position, 1.0)).xyz;
+		shadow *= exp(-opacityMapDepth(u_shadow_opacity_maps[i], u_shadow_viewprojections[i], u_shadow_light_positions[i], local_pos));
+	}
+
+	vec4 phong_color = (u_ambient_light + (diffuse + specular) * shadow) * u_color;
 	FragColor = phong_color * u_light_intensity;
 }
@@ -0,0 +1,38 @@
+#version 450 core
+
+in vec3 a_vertex;
+in vec3 a_normal;
+in vec2 a_uv;
+in vec4 a_color;
+
+//per instance, from the buffer of Mesh::renderInstanced
+in mat4 u_model;
+in mat4 u_inverse_model;
+
+uniform mat4 u_viewprojection;
+uniform vec3 u_camera_position; //world space, the material uploads it with an identity model
+uniform mat4 u_inverse_mvp; //clip to world space, the same
+
+out vec3 v_position;
+out vec3 v_world_position;
+out vec3 v_normal;
+out vec2 v_uv;
+out vec4 v_color;
+
+//what basic.vs gets as uniforms for a single node, in the local space of this instance
+flat out vec3 v_camera_position;
+flat out mat4 v_inverse_mvp;
+
+void main()
+{
+	v_normal = (u_model * vec4( a_normal, 0.0) ).xyz;
+	v_position = a_vertex;
+	v_world_position = (u_model * vec4( v_position, 1.0) ).xyz;
+	v_color = a_color;
+	v_uv = a_uv;
+
+	v_camera_position = (u_inverse_model * vec4( u_camera_position, 1.0) ).xyz;
+	v_inverse_mvp = u_inverse_model * u_inverse_mvp;
+
+	gl_Position = u_viewprojection * vec4( v_world_position, 1.0 );
+}
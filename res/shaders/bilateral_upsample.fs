@@ -0,0 +1,47 @@
+#version 450 core
+
+in vec2 v_uv;
+
+//volume rendered at reduced resolution, cleared to alpha 0 so the color is premultiplied
+uniform sampler2D u_texture;
+//depth the reduced volume was tested against (nearest downsample of u_depth)
+uniform sampler2D u_low_depth;
+//full resolution depth of the scene
+uniform sampler2D u_depth;
+
+uniform vec2 u_low_size;
+uniform vec2 u_camera_nearfar;
+
+out vec4 FragColor;
+
+float linearDepth(float depth) {
+    float n = u_camera_nearfar.x;
+    float f = u_camera_nearfar.y;
+    float z = depth * 2.0 - 1.0;
+    return (2.0 * n * f) / (f + n - z * (f - n));
+}
+
+// Bilinear weights of the 4 closest low resolution texels, scaled down when their depth differs from the one
+// of this pixel so the volume does not bleed over the edges of the geometry in front of it
+void main() {
+    float depth = linearDepth(texture(u_depth, v_uv).x);
+
+    vec2 pos = v_uv * u_low_size - vec2(0.5);
+    vec2 base = floor(pos);
+    vec2 f = pos - base;
+
+    vec4 color = vec4(0.0);
+    float total_weight = 0.0;
+    for (int j = 0; j < 2; j++) {
+        for (int i = 0; i < 2; i++) {
+            vec2 uv = (base + vec2(i, j) + vec2(0.5)) / u_low_size;
+            float bilinear = (i == 0 ? 1.0 - f.x : f.x) * (j == 0 ? 1.0 - f.y : f.y);
+            float depth_difference = abs(linearDepth(texture(u_low_depth, uv).x) - depth) / depth;
+            float weight = (bilinear + 1e-3) / (1e-3 + depth_difference * 100.0);
+            color += texture(u_texture, uv) * weight;
+            total_weight += weight;
+        }
+    }
+
+    FragColor = color / total_weight;
+}
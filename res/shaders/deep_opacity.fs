@@ -0,0 +1,84 @@
+#version 450 core
+
+in vec2 v_uv;
+
+//Deep opacity map of a volume for one light: each texel is a ray from the light, split in 4 slabs of the same
+//length between its entry and exit of the volume. rgba is the optical depth at the far end of every slab
+//Everything is in the local space of the volume, like the marchers
+
+uniform mat4 u_inverse_viewprojection; //clip space of the map to the local space of the volume
+uniform vec3 u_light_position;
+
+uniform float u_step_length;
+uniform float u_absorption_coefficient;
+
+//VDB or baked 3D noise
+uniform sampler3D u_texture;
+
+//Transfer function, only its opacity (the diagonal of the pre-integrated table)
+uniform bool u_use_transfer_function;
+uniform sampler2D u_transfer_table;
+
+uniform int u_density_type;
+#define CONSTANT 0
+
+#define LAYERS 4
+#define MAX_STEPS_PER_LAYER 128
+
+out vec4 FragColor;
+
+#include "include/window.glsl"
+
+// Absorption coefficient at a local position, what the light rays of the marchers accumulate
+float absorptionAt(vec3 pos) {
+    float density = 1.0;
+    if (u_density_type != CONSTANT) {
+        density = applyWindow(textureLod(u_texture, (pos + vec3(1.0)) / 2.0, 0.0).r);
+    }
+    if (u_use_transfer_function) {
+        float size = float(textureSize(u_transfer_table, 0).x);
+        vec2 uv = (vec2(density) * (size - 1.0) + 0.5) / size;
+        density = textureLod(u_transfer_table, uv, 0.0).a;
+    }
+    return density * u_absorption_coefficient;
+}
+
+bool intersections(vec3 ray_origin, vec3 ray_direction, vec3 box_min, vec3 box_max, out float t_near, out float t_far) {
+    vec3 t_min = (box_min - ray_origin) / ray_direction;
+    vec3 t_max = (box_max - ray_origin) / ray_direction;
+    vec3 t1 = min(t_min, t_max);
+    vec3 t2 = max(t_min, t_max);
+    t_near = max(max(t1.x, t1.y), t1.z);
+    t_far = min(min(t2.x, t2.y), t2.z);
+    return t_near <= t_far && t_far > 0.0;
+}
+
+void main() {
+    vec4 far_pos = u_inverse_viewprojection * vec4(v_uv * 2.0 - 1.0, 1.0, 1.0);
+    vec3 ray_direction = normalize(far_pos.xyz / far_pos.w - u_light_position);
+
+    float t_near, t_far;
+    if (!intersections(u_light_position, ray_direction, vec3(-1.0), vec3(1.0), t_near, t_far)) {
+        FragColor = vec4(0.0);
+        return;
+    }
+    t_near = max(t_near, 0.0);
+
+    // midpoint rule inside every slab, so the slab ends fall exactly on the stored depths
+    float layer_length = (t_far - t_near) / float(LAYERS);
+    int steps = clamp(int(ceil(layer_length / u_step_length)), 1, MAX_STEPS_PER_LAYER);
+    float step_length = layer_length / float(steps);
+
+    float optical_depth = 0.0;
+    vec4 depths;
+    for (int layer = 0; layer < LAYERS; layer++) {
+        float t = t_near + float(layer) * layer_length + 0.5 * step_length;
+        for (int i = 0; i < steps; i++) {
+            optical_depth += absorptionAt(u_light_position + t * ray_direction) * step_length;
+            t += step_length;
+        }
+        depths[layer] = optical_depth;
+    }
+
+    FragColor = depths;
+}
@@ -6,102 +6,176 @@ in vec3 v_normal;
 
 uniform vec3 u_camera_position;
 
-uniform vec4 u_background_color;
 
 uniform float u_step_length;
 uniform float u_absorption_coefficient;
 
-//Noise
-uniform float u_noise_detail;
-uniform float u_noise_scale;
-
 //Emissive
 uniform vec4 u_emitted_color;
 uniform int u_emitted_intensity;
 
-//VDB
+//VDB or baked 3D noise
 uniform sampler3D u_texture;
 
-//Jittering filter
-uniform bool u_use_jittering;
-
+//Pixel to the local space of the volume, for the depth of the opaque nodes
+uniform mat4 u_inverse_mvp; //clip space to the local space of the volume
+uniform vec4 u_viewport;
+
+//Instanced nodes (basic_instanced.vs) get the local camera and the clip to local matrix of their instance
+#ifdef INSTANCED
+flat in vec3 v_camera_position;
+flat in mat4 v_inverse_mvp;
+#define u_camera_position v_camera_position
+#define u_inverse_mvp v_inverse_mvp
+#endif
+
+#include "include/jitter.glsl"
+
+//Delta/ratio tracking, the majorant grid bounds the density of each block of voxels (before the window)
+uniform int u_frame; //advances every frame, also without the progressive or temporal rendering, seeds the tracking
+#ifndef USE_TRACKING
+uniform bool u_use_tracking;
+#define USE_TRACKING u_use_tracking
+#endif
+uniform sampler3D u_majorant_grid;
+uniform int u_tracking_samples;
+
+//Transfer function, pre-integrated per pair of densities on the CPU (see preintegrateTransferFunction)
+#ifndef USE_TRANSFER_FUNCTION
+uniform bool u_use_transfer_function;
+#define USE_TRANSFER_FUNCTION u_use_transfer_function
+#endif
+uniform sampler2D u_transfer_table;
+
+// Specialized variants get DENSITY_TYPE, USE_JITTERING... as macros from the material so the
+// branches below fold at compile time, the generic shader reads them from uniforms
+#ifndef DENSITY_TYPE
 uniform int u_density_type;
+#define DENSITY_TYPE u_density_type
+#endif
 #define CONSTANT 0
 #define NOISE_3D 1
 #define VDB 2
 
 out vec4 FragColor;
 
-//Random function for the offset
-float random(vec2 st) {
-    return fract(sin(dot(st.xy,
-                         vec2(12.9898,78.233)))*
-        43758.5453123);
+#include "include/virtual_texture.glsl"
+
+#include "include/window.glsl"
+
+// Density at a local position, the same the marching loops sample
+float sampleDensity(vec3 pos, float lod) {
+    if (DENSITY_TYPE == CONSTANT) {
+        return 1.0;
+    }
+    return applyWindow(volumeLod((pos + vec3(1.0)) / 2.0, lod));
 }
 
-// Noise functions
-float hash1( float n )
-{
-    return fract( n*17.0*fract( n*0.3183099 ) );
+// Average of color * opacity (rgb) and opacity (a) along a segment whose density goes linearly from front to back,
+// one lookup integrates the transfer function over the whole step whatever its length
+vec4 transferSegment(float front_density, float back_density) {
+    float size = float(textureSize(u_transfer_table, 0).x);
+    vec2 uv = (vec2(front_density, back_density) * (size - 1.0) + 0.5) / size;
+    return textureLod(u_transfer_table, uv, 0.0);
 }
 
-float noise( vec3 x )
-{
-    vec3 p = floor(x);
-    vec3 w = fract(x);
-    
-    vec3 u = w*w*w*(w*(w*6.0-15.0)+10.0);
-    
-    float n = p.x + 317.0*p.y + 157.0*p.z;
-    
-    float a = hash1(n+0.0);
-    float b = hash1(n+1.0);
-    float c = hash1(n+317.0);
-    float d = hash1(n+318.0);
-    float e = hash1(n+157.0);
-    float f = hash1(n+158.0);
-    float g = hash1(n+474.0);
-    float h = hash1(n+475.0);
-
-    float k0 =   a;
-    float k1 =   b - a;
-    float k2 =   c - a;
-    float k3 =   e - a;
-    float k4 =   a - b - c + d;
-    float k5 =   a - c - e + g;
-    float k6 =   a - b - e + f;
-    float k7 = - a + b + c - d + e - f - g + h;
-
-    return -1.0+2.0*(k0 + k1*u.x + k2*u.y + k3*u.z + k4*u.x*u.y + k5*u.y*u.z + k6*u.z*u.x + k7*u.x*u.y*u.z);
+#include "include/lod.glsl"
+
+#include "include/adaptive_step.glsl"
+
+// PCG hash, the random numbers of the tracking
+uint pcgHash(uint v) {
+    uint state = v * 747796405u + 2891336453u;
+    uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
 }
 
-#define MAX_OCTAVES 16
+float randomFloat(inout uint seed) {
+    seed = pcgHash(seed);
+    return float(seed >> 8) / 16777216.0;
+}
 
-float fractal_noise( vec3 P, float detail )
-{
-    float fscale = 1.0;
-    float amp = 1.0;
-    float sum = 0.0;
-    float octaves = clamp(detail, 0.0, 16.0);
-    int n = int(octaves);
-
-    for (int i = 0; i <= MAX_OCTAVES; i++) {
-        if (i > n) continue;
-        float t = noise(fscale * P);
-        sum += t * amp;
-        amp *= 0.5;
-        fscale *= 2.0;
+// Density at full resolution, the majorants only bound the finest level
+float trackingDensity(vec3 pos) {
+    if (DENSITY_TYPE == CONSTANT) {
+        return 1.0;
     }
-
-    return sum;
+    return applyWindow(volumeLod((pos + vec3(1.0)) / 2.0, 0.0));
 }
 
-float cnoise( vec3 P, float scale, float detail )
-{
-    P *= scale;
-    return clamp(fractal_noise(P, detail), 0.0, 1.0);
+float cellMajorant(ivec3 cell) {
+    if (DENSITY_TYPE == CONSTANT) {
+        return 1.0;
+    }
+    return applyWindow(texelFetch(u_majorant_grid, cell, 0).r);
 }
 
+// Tracks the ray between t_near and t_far through the majorant grid, crossed with a DDA. The free flights
+// are sampled with the majorant of each cell, so the cost follows the optical depth and an empty cell costs
+// a single iteration. Delta tracking stops at the first real collision (returns 0 and its distance in t_hit),
+// ratio tracking goes on weighting the transmittance by the probability of a null collision at each one
+float trackMajorants(vec3 ray_origin, vec3 ray_direction, float t_near, float t_far, bool ratio_tracking, inout uint seed, out float t_hit) {
+    ivec3 grid_size = DENSITY_TYPE == CONSTANT ? ivec3(1) : textureSize(u_majorant_grid, 0);
+    vec3 cell_size = 2.0 / vec3(grid_size);
+
+    float t = max(t_near, 0.0);
+    vec3 grid_pos = (ray_origin + t * ray_direction + vec3(1.0)) / cell_size;
+    ivec3 cell = clamp(ivec3(floor(grid_pos)), ivec3(0), grid_size - 1);
+    ivec3 cell_step = ivec3(sign(ray_direction));
+    vec3 t_delta = abs(cell_size / ray_direction);
+    vec3 t_next = ((vec3(cell + max(cell_step, ivec3(0))) * cell_size - vec3(1.0)) - ray_origin) / ray_direction;
+
+    float transmittance = 1.0;
+    float optical_depth = -log(1.0 - randomFloat(seed));
+    t_hit = t_far;
+
+    while (t < t_far) {
+        float majorant = cellMajorant(cell) * u_absorption_coefficient;
+        float t_exit = min(min(min(t_next.x, t_next.y), t_next.z), t_far);
+
+        // tentative collisions inside this cell
+        while (majorant * (t_exit - t) > optical_depth) {
+            t += optical_depth / majorant;
+            float null_probability = 1.0 - trackingDensity(ray_origin + t * ray_direction) * u_absorption_coefficient / majorant;
+            if (ratio_tracking) {
+                transmittance *= null_probability;
+                // russian roulette keeps it unbiased once the ray barely contributes
+                if (transmittance < 0.1) {
+                    if (transmittance <= 0.0 || randomFloat(seed) < 0.5) {
+                        return 0.0;
+                    }
+                    transmittance *= 2.0;
+                }
+            }
+            else if (randomFloat(seed) >= null_probability) {
+                t_hit = t;
+                return 0.0;
+            }
+            optical_depth = -log(1.0 - randomFloat(seed));
+        }
+
+        optical_depth -= majorant * (t_exit - t);
+        t = t_exit;
+
+        // next cell along the axis with the closest boundary
+        if (t_next.x <= t_next.y && t_next.x <= t_next.z) {
+            cell.x += cell_step.x;
+            t_next.x += t_delta.x;
+        }
+        else if (t_next.y <= t_next.z) {
+            cell.y += cell_step.y;
+            t_next.y += t_delta.y;
+        }
+        else {
+            cell.z += cell_step.z;
+            t_next.z += t_delta.z;
+        }
+        if (any(lessThan(cell, ivec3(0))) || any(greaterThanEqual(cell, grid_size))) {
+            break;
+        }
+    }
+    return transmittance;
+}
 
 void initializeRay(out vec3 ray_origin, out vec3 ray_direction)
 {
@@ -119,14 +193,16 @@ bool intersections(vec3 ray_origin, vec3 ray_direction, vec3 box_min, vec3 box_m
     return t_near <= t_far && t_far > 0.0;
 }
 
+#include "include/scene_depth.glsl"
+
 //With step_length
-void rayMarching(vec3 ray_origin, vec3 ray_direction, float t_near, float t_far, out vec3 radiance) {
+void rayMarching(vec3 ray_origin, vec3 ray_direction, float t_near, float t_far, out vec4 radiance) {
 
     // Initialize parameters
-    float step_length = u_step_length;           
+    float step_length = u_step_length * exp2(computeLod(t_far));
     float t = t_far; 
-    if (u_use_jittering){
-        float offset = random(gl_FragCoord.xy) * step_length;
+    if (USE_JITTERING){
+        float offset = jitterNoise(ivec2(gl_FragCoord.xy)) * step_length;
         if((t - offset) > t_near){
             t -= offset;
         }
@@ -136,24 +212,45 @@ void rayMarching(vec3 ray_origin, vec3 ray_direction, float t_near, float t_far,
     float emissive_transmittance = 0.0;
     vec3 accumulatedRadiance = vec3(0.0);
     float particle_density;
+    float previous_density = 0.0;
+    float next_density = -1.0;
     float absorption_coefficient;
 
     // Compute the transmittance
     while (t > t_near){
-        if (u_density_type == CONSTANT){
+        float lod = computeLod(t);
+        step_length = u_step_length * exp2(lod);
+
+        if (DENSITY_TYPE == CONSTANT){
             particle_density = 1.0;
-        } else if (u_density_type == VDB) { // VDB file
-            particle_density = texture(u_texture, (current_pos + vec3(1.0)) / 2.0).r; //Remap the current pos since u_texture goes from 0 to 1
-        } else if (u_density_type == NOISE_3D) { // 3D Noise
-            particle_density = cnoise(current_pos, u_noise_scale, u_noise_detail);
+        } else if (USE_TRANSFER_FUNCTION && next_density >= 0.0) {
+            particle_density = next_density; // the end of the previous segment
+        } else if (DENSITY_TYPE == VDB || DENSITY_TYPE == NOISE_3D) { // VDB file or baked 3D noise
+            particle_density = applyWindow(volumeLod((current_pos + vec3(1.0)) / 2.0, lod)); //Remap the current pos since u_texture goes from 0 to 1
+        }
+
+        if (USE_ADAPTIVE_STEPPING) {
+            step_length = adaptiveStepLength(step_length, particle_density, previous_density, current_pos, lod, t - t_near);
+            previous_density = particle_density;
+        }
+
+        float medium_density = particle_density;
+        vec3 emitted_color = u_emitted_color.xyz;
+        if (USE_TRANSFER_FUNCTION) {
+            // the segment to the next sample (towards the camera), whose density the next step reuses
+            next_density = sampleDensity(current_pos - step_length * ray_direction, lod);
+            vec4 segment = transferSegment(particle_density, next_density);
+            medium_density = segment.a;
+            emitted_color = segment.a > 0.0 ? segment.rgb / segment.a : vec3(0.0);
         }
-        absorption_coefficient = particle_density * u_absorption_coefficient;
+
+        absorption_coefficient = medium_density * u_absorption_coefficient;
 
         optical_thickness += absorption_coefficient * step_length;
 
         //Emission
         emissive_transmittance = exp(-optical_thickness);
-        accumulatedRadiance += emissive_transmittance * absorption_coefficient * u_emitted_color.xyz * u_emitted_intensity * step_length;
+        accumulatedRadiance += emissive_transmittance * absorption_coefficient * emitted_color * u_emitted_intensity * step_length;
 
         if(optical_thickness > 7){
             break;
@@ -163,7 +260,7 @@ void rayMarching(vec3 ray_origin, vec3 ray_direction, float t_near, float t_far,
     }
     float transmittance = exp(-optical_thickness);
 
-    radiance = accumulatedRadiance + transmittance * u_background_color.xyz;
+    radiance = vec4(accumulatedRadiance, 1.0 - transmittance);
 
 }
 
@@ -176,15 +273,34 @@ void main() {
     vec3 box_max = vec3(1.0, 1.0, 1.0);     // Define your volume's max bounds
     float t_near, t_far;
     
-    // If ray intersects the volume, we perform ray marching
-    if (intersections(ray_origin, ray_direction, box_min, box_max, t_near, t_far)) {
-        vec3 radiance;
+    // If ray intersects the volume in front of the opaque nodes, we perform ray marching
+    bool hit = intersections(ray_origin, ray_direction, box_min, box_max, t_near, t_far);
+    if (hit) {
+        t_far = clipToSceneDepth((gl_FragCoord.xy - u_viewport.xy) / u_viewport.zw, ray_origin, ray_direction, t_far);
+    }
+    if (hit && t_far > t_near) {
+        if (USE_TRACKING) {
+            // delta tracking: the emission of the first real collision, nothing (alpha 0) if there is none
+            vec4 radiance = vec4(0.0);
+            // a different sequence per pixel and per frame of the progressive/temporal rendering
+            uint seed = pcgHash(uint(gl_FragCoord.x) + pcgHash(uint(gl_FragCoord.y) + pcgHash(uint(u_frame))));
+            for (int i = 0; i < u_tracking_samples; i++) {
+                float t_hit;
+                if (trackMajorants(ray_origin, ray_direction, t_near, t_far, false, seed, t_hit) == 0.0) {
+                    radiance += vec4(u_emitted_color.xyz * u_emitted_intensity, 1.0);
+                }
+            }
+            FragColor = radiance / float(u_tracking_samples);
+            return;
+        }
+
+        vec4 radiance;
         rayMarching(ray_origin, ray_direction, t_near, t_far, radiance);
         
-        FragColor = vec4(radiance, 1.0);
+        FragColor = radiance;
     } 
     else {
-        // If no intersection, output the background color
-        FragColor = u_background_color;
+        // If no intersection (or it is hidden), leave what is behind
+        FragColor = vec4(0.0);
     }
 }
\ No newline at end of file
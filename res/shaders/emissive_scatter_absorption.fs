@@ -6,112 +6,114 @@ in vec3 v_normal;
 
 uniform vec3 u_camera_position;
 
-uniform vec4 u_background_color;
 
 uniform float u_step_length;
 uniform float u_absorption_coefficient;
 
-//Noise
-uniform float u_noise_detail;
-uniform float u_noise_scale;
-
 //Emissive
 uniform vec4 u_emitted_color;
 uniform int u_emitted_intensity;
 
 //Scattering
 uniform float u_scattering_coefficient;
+#ifndef USE_PHASE_FUNCTION
 uniform bool u_use_phase_function;
+#define USE_PHASE_FUNCTION u_use_phase_function
+#endif
 uniform float u_g;
 
-//VDB
+//VDB or baked 3D noise
 uniform sampler3D u_texture;
 
-//Jittering filter
-uniform bool u_use_jittering;
-
-//light
-uniform float u_light_intensity;
-uniform vec4 u_light_color;
-uniform vec3 u_local_light_position;
-
+//Pixel to the local space of the volume, for the depth of the opaque nodes
+uniform mat4 u_inverse_mvp; //clip space to the local space of the volume
+uniform vec4 u_viewport;
+
+#include "include/jitter.glsl"
+
+//Delta/ratio tracking, the majorant grid bounds the density of each block of voxels (before the window)
+uniform int u_frame; //advances every frame, also without the progressive or temporal rendering, seeds the tracking
+#ifndef USE_TRACKING
+uniform bool u_use_tracking;
+#define USE_TRACKING u_use_tracking
+#endif
+uniform sampler3D u_majorant_grid;
+uniform int u_tracking_samples;
+
+//Transfer function, pre-integrated per pair of densities on the CPU (see preintegrateTransferFunction)
+#ifndef USE_TRANSFER_FUNCTION
+uniform bool u_use_transfer_function;
+#define USE_TRANSFER_FUNCTION u_use_transfer_function
+#endif
+uniform sampler2D u_transfer_table;
+
+//Lights in the local space of the volume (LightBlock, filled by Light::uploadLightBlock)
+//specialized variants get NUM_LIGHTS as a macro, so the light loops unroll
+#define MAX_LIGHTS 8
+struct sLight {
+    vec4 position; //xyz, w unused
+    vec4 color;    //rgb already scaled by the intensity
+};
+layout(std140, binding = 0) uniform LightBlock {
+    sLight u_lights[MAX_LIGHTS];
+};
+#ifndef NUM_LIGHTS
+uniform int u_num_lights;
+#define NUM_LIGHTS u_num_lights
+#endif
+
+//Deep opacity maps of the lights (see deep_opacity.fs), a lookup gives the transmittance to the light
+#ifndef USE_OPACITY_MAPS
+uniform bool u_use_opacity_maps;
+#define USE_OPACITY_MAPS u_use_opacity_maps
+#endif
+uniform sampler2D u_opacity_maps[MAX_LIGHTS];
+uniform mat4 u_opacity_map_viewprojections[MAX_LIGHTS]; //local space to the clip space of each map
+
+//Irradiance volume (see IrradianceVolume), the light scattered more than once and the ambient light at every point
+#ifndef USE_IRRADIANCE_VOLUME
+uniform bool u_use_irradiance_volume;
+#define USE_IRRADIANCE_VOLUME u_use_irradiance_volume
+#endif
+uniform sampler3D u_irradiance_volume;
+uniform float u_irradiance_strength;
+
+// Specialized variants get DENSITY_TYPE, USE_JITTERING... as macros from the material so the
+// branches below fold at compile time, the generic shader reads them from uniforms
+#ifndef DENSITY_TYPE
 uniform int u_density_type;
+#define DENSITY_TYPE u_density_type
+#endif
 #define CONSTANT 0
 #define NOISE_3D 1
 #define VDB 2
 
 out vec4 FragColor;
 
-//Random function for the offset
-float random(vec2 st) {
-    return fract(sin(dot(st.xy,
-                         vec2(12.9898,78.233)))*
-        43758.5453123);
-}
-
-// Noise functions
-float hash1( float n )
-{
-    return fract( n*17.0*fract( n*0.3183099 ) );
-}
-
-float noise( vec3 x )
-{
-    vec3 p = floor(x);
-    vec3 w = fract(x);
-    
-    vec3 u = w*w*w*(w*(w*6.0-15.0)+10.0);
-    
-    float n = p.x + 317.0*p.y + 157.0*p.z;
-    
-    float a = hash1(n+0.0);
-    float b = hash1(n+1.0);
-    float c = hash1(n+317.0);
-    float d = hash1(n+318.0);
-    float e = hash1(n+157.0);
-    float f = hash1(n+158.0);
-    float g = hash1(n+474.0);
-    float h = hash1(n+475.0);
-
-    float k0 =   a;
-    float k1 =   b - a;
-    float k2 =   c - a;
-    float k3 =   e - a;
-    float k4 =   a - b - c + d;
-    float k5 =   a - c - e + g;
-    float k6 =   a - b - e + f;
-    float k7 = - a + b + c - d + e - f - g + h;
-
-    return -1.0+2.0*(k0 + k1*u.x + k2*u.y + k3*u.z + k4*u.x*u.y + k5*u.y*u.z + k6*u.z*u.x + k7*u.x*u.y*u.z);
-}
+#include "include/virtual_texture.glsl"
 
-#define MAX_OCTAVES 16
+#include "include/window.glsl"
 
-float fractal_noise( vec3 P, float detail )
-{
-    float fscale = 1.0;
-    float amp = 1.0;
-    float sum = 0.0;
-    float octaves = clamp(detail, 0.0, 16.0);
-    int n = int(octaves);
-
-    for (int i = 0; i <= MAX_OCTAVES; i++) {
-        if (i > n) continue;
-        float t = noise(fscale * P);
-        sum += t * amp;
-        amp *= 0.5;
-        fscale *= 2.0;
+// Density at a local position, the same the marching loops sample
+float sampleDensity(vec3 pos, float lod) {
+    if (DENSITY_TYPE == CONSTANT) {
+        return 1.0;
     }
-
-    return sum;
+    return applyWindow(volumeLod((pos + vec3(1.0)) / 2.0, lod));
 }
 
-float cnoise( vec3 P, float scale, float detail )
-{
-    P *= scale;
-    return clamp(fractal_noise(P, detail), 0.0, 1.0);
+// Average of color * opacity (rgb) and opacity (a) along a segment whose density goes linearly from front to back,
+// one lookup integrates the transfer function over the whole step whatever its length
+vec4 transferSegment(float front_density, float back_density) {
+    float size = float(textureSize(u_transfer_table, 0).x);
+    vec2 uv = (vec2(front_density, back_density) * (size - 1.0) + 0.5) / size;
+    return textureLod(u_transfer_table, uv, 0.0);
 }
 
+#include "include/lod.glsl"
+
+#include "include/adaptive_step.glsl"
+
 bool intersections(vec3 ray_origin, vec3 ray_direction, vec3 box_min, vec3 box_max, out float t_near, out float t_far) {
     vec3 t_min = (box_min - ray_origin) / ray_direction;
     vec3 t_max = (box_max - ray_origin) / ray_direction;
@@ -122,12 +124,41 @@ bool intersections(vec3 ray_origin, vec3 ray_direction, vec3 box_min, vec3 box_m
     return t_near <= t_far && t_far > 0.0;
 }
 
-void rayMarchingToLight(vec3 ray_origin, vec3 ray_direction, float t_far, out vec3 in_scattered_color){ 
-	// Initialize parameters
-    float step_length = u_step_length;           
+#include "include/scene_depth.glsl"
+
+// Optical depth from the light to pos, interpolated between the slabs of its deep opacity map.
+// Negative where the map does not reach (the light is inside the volume)
+float opacityMapDepth(sampler2D map, mat4 map_viewprojection, vec3 light_position, vec3 pos) {
+    vec4 clip = map_viewprojection * vec4(pos, 1.0);
+    if (clip.w <= 0.0) {
+        return -1.0;
+    }
+    vec2 uv = clip.xy / clip.w * 0.5 + vec2(0.5);
+    if (any(lessThan(uv, vec2(0.0))) || any(greaterThan(uv, vec2(1.0)))) {
+        return -1.0;
+    }
+
+    // the same slabs the map was rendered with, between the entry and exit of the ray from the light
+    vec3 ray_direction = normalize(pos - light_position);
+    float t_near, t_far;
+    if (!intersections(light_position, ray_direction, vec3(-1.0), vec3(1.0), t_near, t_far)) {
+        return 0.0;
+    }
+    t_near = max(t_near, 0.0);
+    float layer = clamp((length(pos - light_position) - t_near) / max(t_far - t_near, 1e-6), 0.0, 1.0) * 4.0;
+
+    vec4 depths = texture(map, uv);
+    float slabs[5] = float[5](0.0, depths.r, depths.g, depths.b, depths.a);
+    int i = min(int(layer), 3);
+    return mix(slabs[i], slabs[i + 1], layer - float(i));
+}
+
+float rayMarchingToLight(vec3 ray_origin, vec3 ray_direction, float t_far, float lod){ 
+	// Initialize parameters, the light ray uses the level of detail of the sample it starts from
+    float step_length = u_step_length * exp2(lod);
 	float t = 0.0; 
-    if (u_use_jittering){
-        float offset = random(gl_FragCoord.xy) * step_length;
+    if (USE_JITTERING){
+        float offset = jitterNoise(ivec2(gl_FragCoord.xy)) * step_length;
         if((t + offset) < t_far){
             t += offset;
         }
@@ -135,19 +166,25 @@ void rayMarchingToLight(vec3 ray_origin, vec3 ray_direction, float t_far, out ve
 	float optical_thickness = 0.0;
 	vec3 current_pos = ray_origin;
 	float particle_density;
+    float previous_density = 0.0;
     float absorption_coefficient;
 
     // Compute the transmittance
     while (t < t_far){
-        if (u_density_type == CONSTANT){
+        if (DENSITY_TYPE == CONSTANT){
             particle_density = 1.0;
-        } else if (u_density_type == VDB) { // VDB file
-            particle_density = texture(u_texture, (current_pos + vec3(1.0)) / 2.0).r;  //Remap the current pos since u_texture goes from 0 to 1
-        } else if (u_density_type == NOISE_3D) { // 3D Noise
-            particle_density = cnoise(current_pos, u_noise_scale, u_noise_detail);
+        } else if (DENSITY_TYPE == VDB || DENSITY_TYPE == NOISE_3D) { // VDB file or baked 3D noise
+            particle_density = applyWindow(volumeLod((current_pos + vec3(1.0)) / 2.0, lod));  //Remap the current pos since u_texture goes from 0 to 1
         }
 
-        absorption_coefficient = particle_density * u_absorption_coefficient;
+        if (USE_ADAPTIVE_STEPPING) {
+            step_length = adaptiveStepLength(u_step_length * exp2(lod), particle_density, previous_density, current_pos, lod, t_far - t);
+            previous_density = particle_density;
+        }
+
+        // the light rays take the opacity at the sample, the table diagonal
+        float medium_density = USE_TRANSFER_FUNCTION ? transferSegment(particle_density, particle_density).a : particle_density;
+        absorption_coefficient = medium_density * u_absorption_coefficient;
 
         optical_thickness += absorption_coefficient * step_length;
 
@@ -159,36 +196,144 @@ void rayMarchingToLight(vec3 ray_origin, vec3 ray_direction, float t_far, out ve
         current_pos = ray_origin + t * ray_direction;
     }
 
-    float transmittance = exp(-optical_thickness);
+    return exp(-optical_thickness);
+}
+
+const float PI = 3.14159265359;
+float phase_function(vec3 camera_ray_direction, vec3 light_ray_direction){
+    float g_square = pow(u_g, 2.0);
+    float cosine_between_rays = dot(camera_ray_direction, light_ray_direction) / (length(camera_ray_direction) * length(light_ray_direction));
+    return (1.0 / 4.0 * PI) * ((1 - g_square) / pow(1 + g_square - 2.0 * u_g * cosine_between_rays, 1.5));
+}
 
-    in_scattered_color = transmittance * u_light_color.xyz;
+// Light arriving at pos after more than one scattering, plus the ambient light, isotropic
+vec3 multipleScattering(vec3 pos) {
+    if (!USE_IRRADIANCE_VOLUME) {
+        return vec3(0.0);
+    }
+    return u_irradiance_strength * textureLod(u_irradiance_volume, (pos + vec3(1.0)) / 2.0, 0.0).rgb;
 }
 
-void CalculateInScattering(vec3 current_pos, out vec3 in_scattered_color)
+// Light scattered towards the camera ray at current_pos: one transmittance march per light. The position,
+// its level of detail and the volume bounds are shared, lights outside the volume cost no march
+vec3 CalculateInScattering(vec3 current_pos, vec3 ray_direction, float lod)
 {
-	// Initialize rayToLight
-	vec3 rayToLight_origin = current_pos;
-	vec3 rayToLight_direction = normalize(u_local_light_position - rayToLight_origin);
-
-	// Compute the volume intersection
     vec3 box_min = vec3(-1.0, -1.0, -1.0);  // Define your volume's min bounds
     vec3 box_max = vec3(1.0, 1.0, 1.0);     // Define your volume's max bounds
-    float t_near, t_far;
 
-	//Check intersections
-	if (intersections(rayToLight_origin, rayToLight_direction, box_min, box_max, t_near, t_far)) {
-        rayMarchingToLight(rayToLight_origin, rayToLight_direction, t_far, in_scattered_color);
-    } 
-    else {
-    	in_scattered_color = vec3(0.0);
+    vec3 in_scattered_color = vec3(0.0);
+    for (int i = 0; i < NUM_LIGHTS; i++) {
+        vec3 light_ray = normalize(u_lights[i].position.xyz - current_pos);
+        float t_near, t_far;
+        if (!intersections(current_pos, light_ray, box_min, box_max, t_near, t_far)) {
+            continue;
+        }
+        float light_transmittance = -1.0;
+        if (USE_OPACITY_MAPS) {
+            float optical_depth = opacityMapDepth(u_opacity_maps[i], u_opacity_map_viewprojections[i], u_lights[i].position.xyz, current_pos);
+            light_transmittance = optical_depth < 0.0 ? -1.0 : exp(-optical_depth);
+        }
+        if (light_transmittance < 0.0) {
+            light_transmittance = rayMarchingToLight(current_pos, light_ray, t_far, lod);
+        }
+        float phase = USE_PHASE_FUNCTION ? phase_function(ray_direction, light_ray) : 1.0;
+        in_scattered_color += light_transmittance * u_lights[i].color.rgb * phase;
     }
+    return in_scattered_color + multipleScattering(current_pos);
 }
 
-const float PI = 3.14159265359;
-float phase_function(vec3 camera_ray_direction, vec3 light_ray_direction){
-    float g_square = pow(u_g, 2.0);
-    float cosine_between_rays = dot(camera_ray_direction, light_ray_direction) / (length(camera_ray_direction) * length(light_ray_direction));
-    return (1.0 / 4.0 * PI) * ((1 - g_square) / pow(1 + g_square - 2.0 * u_g * cosine_between_rays, 1.5));
+// PCG hash, the random numbers of the tracking
+uint pcgHash(uint v) {
+    uint state = v * 747796405u + 2891336453u;
+    uint word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
+
+float randomFloat(inout uint seed) {
+    seed = pcgHash(seed);
+    return float(seed >> 8) / 16777216.0;
+}
+
+// Density at full resolution, the majorants only bound the finest level
+float trackingDensity(vec3 pos) {
+    if (DENSITY_TYPE == CONSTANT) {
+        return 1.0;
+    }
+    return applyWindow(volumeLod((pos + vec3(1.0)) / 2.0, 0.0));
+}
+
+float cellMajorant(ivec3 cell) {
+    if (DENSITY_TYPE == CONSTANT) {
+        return 1.0;
+    }
+    return applyWindow(texelFetch(u_majorant_grid, cell, 0).r);
+}
+
+// Tracks the ray between t_near and t_far through the majorant grid, crossed with a DDA. The free flights
+// are sampled with the majorant of each cell, so the cost follows the optical depth and an empty cell costs
+// a single iteration. Delta tracking stops at the first real collision (returns 0 and its distance in t_hit),
+// ratio tracking goes on weighting the transmittance by the probability of a null collision at each one
+float trackMajorants(vec3 ray_origin, vec3 ray_direction, float t_near, float t_far, bool ratio_tracking, inout uint seed, out float t_hit) {
+    ivec3 grid_size = DENSITY_TYPE == CONSTANT ? ivec3(1) : textureSize(u_majorant_grid, 0);
+    vec3 cell_size = 2.0 / vec3(grid_size);
+
+    float t = max(t_near, 0.0);
+    vec3 grid_pos = (ray_origin + t * ray_direction + vec3(1.0)) / cell_size;
+    ivec3 cell = clamp(ivec3(floor(grid_pos)), ivec3(0), grid_size - 1);
+    ivec3 cell_step = ivec3(sign(ray_direction));
+    vec3 t_delta = abs(cell_size / ray_direction);
+    vec3 t_next = ((vec3(cell + max(cell_step, ivec3(0))) * cell_size - vec3(1.0)) - ray_origin) / ray_direction;
+
+    float transmittance = 1.0;
+    float optical_depth = -log(1.0 - randomFloat(seed));
+    t_hit = t_far;
+
+    while (t < t_far) {
+        float majorant = cellMajorant(cell) * u_absorption_coefficient;
+        float t_exit = min(min(min(t_next.x, t_next.y), t_next.z), t_far);
+
+        // tentative collisions inside this cell
+        while (majorant * (t_exit - t) > optical_depth) {
+            t += optical_depth / majorant;
+            float null_probability = 1.0 - trackingDensity(ray_origin + t * ray_direction) * u_absorption_coefficient / majorant;
+            if (ratio_tracking) {
+                transmittance *= null_probability;
+                // russian roulette keeps it unbiased once the ray barely contributes
+                if (transmittance < 0.1) {
+                    if (transmittance <= 0.0 || randomFloat(seed) < 0.5) {
+                        return 0.0;
+                    }
+                    transmittance *= 2.0;
+                }
+            }
+            else if (randomFloat(seed) >= null_probability) {
+                t_hit = t;
+                return 0.0;
+            }
+            optical_depth = -log(1.0 - randomFloat(seed));
+        }
+
+        optical_depth -= majorant * (t_exit - t);
+        t = t_exit;
+
+        // next cell along the axis with the closest boundary
+        if (t_next.x <= t_next.y && t_next.x <= t_next.z) {
+            cell.x += cell_step.x;
+            t_next.x += t_delta.x;
+        }
+        else if (t_next.y <= t_next.z) {
+            cell.y += cell_step.y;
+            t_next.y += t_delta.y;
+        }
+        else {
+            cell.z += cell_step.z;
+            t_next.z += t_delta.z;
+        }
+        if (any(lessThan(cell, ivec3(0))) || any(greaterThanEqual(cell, grid_size))) {
+            break;
+        }
+    }
+    return transmittance;
 }
 
 void initializeRay(out vec3 ray_origin, out vec3 ray_direction)
@@ -198,13 +343,13 @@ void initializeRay(out vec3 ray_origin, out vec3 ray_direction)
 }
 
 //With step_length
-void rayMarching(vec3 ray_origin, vec3 ray_direction, float t_near, float t_far, out vec3 radiance) {
+void rayMarching(vec3 ray_origin, vec3 ray_direction, float t_near, float t_far, out vec4 radiance) {
 
     // Initialize parameters
-    float step_length = u_step_length;           
+    float step_length = u_step_length * exp2(computeLod(t_near));
     float t = t_near; 
-    if (u_use_jittering){
-        float offset = random(gl_FragCoord.xy) * step_length;
+    if (USE_JITTERING){
+        float offset = jitterNoise(ivec2(gl_FragCoord.xy)) * step_length;
         if((t + offset) < t_far){
             t += offset;
         }
@@ -214,43 +359,54 @@ void rayMarching(vec3 ray_origin, vec3 ray_direction, float t_near, float t_far,
     float emissive_scatter_transmittance = 0.0;
     vec3 accumulatedRadiance = vec3(0.0);
     float particle_density;
+    float previous_density = 0.0;
     float absorption_coefficient;
     vec3 emissive_part;
     vec3 scattering_part;
     vec3 in_scattered_color;
     float transmittance;
-    vec3 light_ray;
-    float phase;
+    float next_density = -1.0;
 
     // Compute the transmittance
     while (t < t_far){
-        if (u_density_type == CONSTANT){
+        float lod = computeLod(t);
+        step_length = u_step_length * exp2(lod);
+
+        if (DENSITY_TYPE == CONSTANT){
             particle_density = 1.0;
-        } else if (u_density_type == VDB) { // VDB file
-            particle_density = texture(u_texture, (current_pos + vec3(1.0)) / 2.0).r; //Remap the current pos since u_texture goes from 0 to 1
-        } else if (u_density_type == NOISE_3D) { // 3D Noise
-            particle_density = cnoise(current_pos, u_noise_scale, u_noise_detail);
+        } else if (USE_TRANSFER_FUNCTION && next_density >= 0.0) {
+            particle_density = next_density; // the end of the previous segment
+        } else if (DENSITY_TYPE == VDB || DENSITY_TYPE == NOISE_3D) { // VDB file or baked 3D noise
+            particle_density = applyWindow(volumeLod((current_pos + vec3(1.0)) / 2.0, lod)); //Remap the current pos since u_texture goes from 0 to 1
         }
 
-        absorption_coefficient = particle_density * u_absorption_coefficient;
+        if (USE_ADAPTIVE_STEPPING) {
+            step_length = adaptiveStepLength(step_length, particle_density, previous_density, current_pos, lod, t_far - t);
+            previous_density = particle_density;
+        }
 
-        optical_thickness += absorption_coefficient * step_length;
+        float medium_density = particle_density;
+        vec3 emitted_color = u_emitted_color.xyz;
+        if (USE_TRANSFER_FUNCTION) {
+            // the segment to the next sample, whose density the next step reuses
+            next_density = sampleDensity(current_pos + step_length * ray_direction, lod);
+            vec4 segment = transferSegment(particle_density, next_density);
+            medium_density = segment.a;
+            emitted_color = segment.a > 0.0 ? segment.rgb / segment.a : vec3(0.0);
+        }
 
-        transmittance = exp(-optical_thickness);
+        absorption_coefficient = medium_density * u_absorption_coefficient;
 
-        emissive_part = absorption_coefficient * u_emitted_color.xyz * u_emitted_intensity;
+        optical_thickness += absorption_coefficient * step_length;
 
-        CalculateInScattering(current_pos, in_scattered_color);
+        transmittance = exp(-optical_thickness);
 
-        light_ray = normalize(u_local_light_position - current_pos);
+        emissive_part = absorption_coefficient * emitted_color * u_emitted_intensity;
 
-        if(u_use_phase_function){
-            phase = phase_function(ray_direction, light_ray);
-        } else {
-            phase = 1.0;
-        }
+        // without density there is nothing to scatter, the light marches are skipped
+        in_scattered_color = medium_density > 0.0 ? CalculateInScattering(current_pos, ray_direction, lod) : vec3(0.0);
 
-        scattering_part = particle_density * u_scattering_coefficient * in_scattered_color * u_light_intensity * phase;
+        scattering_part = medium_density * u_scattering_coefficient * in_scattered_color;
         
         accumulatedRadiance += transmittance * (emissive_part + scattering_part) * step_length;
 
@@ -262,7 +418,7 @@ void rayMarching(vec3 ray_origin, vec3 ray_direction, float t_near, float t_far,
         current_pos = ray_origin + t * ray_direction;
     }
 
-    radiance = accumulatedRadiance + transmittance * u_background_color.xyz;
+    radiance = vec4(accumulatedRadiance, 1.0 - transmittance);
 
 }
 
@@ -275,15 +431,48 @@ void main() {
     vec3 box_max = vec3(1.0, 1.0, 1.0);     // Define your volume's max bounds
     float t_near, t_far;
     
-    // If ray intersects the volume, we perform ray marching
-    if (intersections(ray_origin, ray_direction, box_min, box_max, t_near, t_far)) {
-        vec3 radiance;
+    // If ray intersects the volume in front of the opaque nodes, we perform ray marching
+    bool hit = intersections(ray_origin, ray_direction, box_min, box_max, t_near, t_far);
+    if (hit) {
+        t_far = clipToSceneDepth((gl_FragCoord.xy - u_viewport.xy) / u_viewport.zw, ray_origin, ray_direction, t_far);
+    }
+    if (hit && t_far > t_near) {
+        if (USE_TRACKING) {
+            // delta tracking: at the first real collision the emission plus the single scattering towards the light,
+            // whose transmittance comes from ratio tracking. The collision pdf cancels the absorption coefficient
+            vec4 radiance = vec4(0.0);
+            // a different sequence per pixel and per frame of the progressive/temporal rendering
+            uint seed = pcgHash(uint(gl_FragCoord.x) + pcgHash(uint(gl_FragCoord.y) + pcgHash(uint(u_frame))));
+            for (int i = 0; i < u_tracking_samples; i++) {
+                float t_hit;
+                if (trackMajorants(ray_origin, ray_direction, t_near, t_far, false, seed, t_hit) > 0.0) {
+                    continue;
+                }
+
+                vec3 pos = ray_origin + t_hit * ray_direction;
+                vec3 in_scattered = vec3(0.0);
+                for (int l = 0; l < NUM_LIGHTS; l++) {
+                    vec3 light_ray = normalize(u_lights[l].position.xyz - pos);
+                    float light_t_near, light_t_far, light_t_hit;
+                    intersections(pos, light_ray, vec3(-1.0), vec3(1.0), light_t_near, light_t_far);
+                    float light_transmittance = trackMajorants(pos, light_ray, 0.0, light_t_far, true, seed, light_t_hit);
+                    float phase = USE_PHASE_FUNCTION ? phase_function(ray_direction, light_ray) : 1.0;
+                    in_scattered += light_transmittance * u_lights[l].color.rgb * phase;
+                }
+                in_scattered += multipleScattering(pos);
+                radiance += vec4(u_emitted_color.xyz * u_emitted_intensity + u_scattering_coefficient / max(u_absorption_coefficient, 1e-6) * in_scattered, 1.0);
+            }
+            FragColor = radiance / float(u_tracking_samples);
+            return;
+        }
+
+        vec4 radiance;
         rayMarching(ray_origin, ray_direction, t_near, t_far, radiance);
         
-        FragColor = vec4(radiance, 1.0);
+        FragColor = radiance;
     } 
     else {
-        // If no intersection, output the background color
-        FragColor = u_background_color;
+        // If no intersection (or it is hidden), leave what is behind
+        FragColor = vec4(0.0);
     }
 }
\ No newline at end of file
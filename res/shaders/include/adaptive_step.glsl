@@ -0,0 +1,22 @@
+//Adaptive stepping of the marchers, specialized variants get USE_ADAPTIVE_STEPPING as a macro. The shader declares
+//DENSITY_TYPE, u_absorption_coefficient, volumeLod, volumeLevels and applyWindow before including it
+#ifndef USE_ADAPTIVE_STEPPING
+uniform bool u_adaptive_stepping;
+#define USE_ADAPTIVE_STEPPING u_adaptive_stepping
+#endif
+uniform float u_adaptive_tolerance;
+uniform float u_adaptive_max_factor;
+
+// Adaptive stepping: the step grows while the optical depth of a step and the change of density stay small.
+// A coarse mip (8^3 voxels) is also checked, so the step shrinks before the ray gets into a dense region
+float adaptiveStepLength(float step_length, float density, float previous_density, vec3 pos, float lod, float remaining) {
+    float neighbourhood = density;
+    if (DENSITY_TYPE != CONSTANT) {
+        float max_lod = float(volumeLevels() - 1);
+        neighbourhood = applyWindow(volumeLod((pos + vec3(1.0)) / 2.0, min(lod + 3.0, max_lod)));
+    }
+    float optical_depth = max(density, neighbourhood) * u_absorption_coefficient * step_length;
+    float error = optical_depth + abs(density - previous_density);
+    float factor = clamp(u_adaptive_tolerance / max(error, 1e-4), 0.5, u_adaptive_max_factor);
+    return min(step_length * factor, max(remaining, 1e-4)); // the last step ends at the boundary
+}
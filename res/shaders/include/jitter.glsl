@@ -0,0 +1,14 @@
+//Jittering of the ray start, specialized variants get USE_JITTERING as a macro
+#ifndef USE_JITTERING
+uniform bool u_use_jittering;
+#define USE_JITTERING u_use_jittering
+#endif
+uniform float u_jitter_offset; //changes every frame of the progressive rendering
+uniform sampler2D u_blue_noise; //tiled blue noise, generated offline by tools/bluenoise.cpp
+
+// Jitter of the ray start in [0, 1): blue noise tiled over the screen, every frame shifted by the golden
+// ratio offset so each pixel also walks a low discrepancy sequence over time. The caller passes its pixel
+float jitterNoise(ivec2 pixel) {
+    ivec2 texel = pixel % textureSize(u_blue_noise, 0);
+    return fract(texelFetch(u_blue_noise, texel, 0).r + u_jitter_offset);
+}
@@ -0,0 +1,16 @@
+//Level of detail of the density texture (see buildMipChain), picked from the distance and the pixel footprint.
+//The shader declares DENSITY_TYPE, volumeResolution and volumeLevels before including it
+uniform bool u_use_lod;
+uniform float u_lod_bias;
+uniform float u_pixel_angle;
+
+// Mip level whose voxels match the pixel footprint at distance t, the step length grows with it
+float computeLod(float t) {
+    if (!u_use_lod || DENSITY_TYPE == CONSTANT) {
+        return 0.0;
+    }
+    float voxel_size = 2.0 / float(volumeResolution());
+    float footprint = max(t, 0.0) * u_pixel_angle;
+    float max_lod = float(volumeLevels() - 1);
+    return clamp(log2(footprint / voxel_size) + u_lod_bias, 0.0, max_lod);
+}
@@ -0,0 +1,17 @@
+//Depth of the opaque nodes (rendered before the volumes), the rays stop at it.
+//The shader declares u_inverse_mvp (clip space to the local space of the volume) before including it
+uniform bool u_use_scene_depth;
+uniform sampler2D u_scene_depth;
+
+// Distance along the ray to the opaque surface behind the pixel at uv, the ray segment past it is hidden
+float clipToSceneDepth(vec2 uv, vec3 ray_origin, vec3 ray_direction, float t_far) {
+    if (!u_use_scene_depth) {
+        return t_far;
+    }
+    float depth = texture(u_scene_depth, uv).x;
+    if (depth >= 1.0) {
+        return t_far;
+    }
+    vec4 local_pos = u_inverse_mvp * vec4(vec3(uv, depth) * 2.0 - 1.0, 1.0);
+    return min(t_far, dot(local_pos.xyz / local_pos.w - ray_origin, ray_direction));
+}
@@ -0,0 +1,57 @@
+//Virtual texturing of the scanned volumes that do not fit in memory (see VirtualVolume): u_texture keeps a coarse
+//level, the bricks live in u_brick_atlas where the page table says, and every sample stamps the brick it wanted in
+//the feedback buffer so the CPU pages it in for the next frames. The shader declares u_texture before including it
+#ifndef VIRTUAL_TEXTURE
+uniform bool u_virtual_texture;
+#define VIRTUAL_TEXTURE u_virtual_texture
+#endif
+#define MAX_VIRTUAL_LEVELS 12
+#define VIRTUAL_BRICK_SIZE 32
+uniform sampler3D u_brick_atlas;
+uniform ivec3 u_virtual_size; //voxels of level 0
+uniform int u_virtual_levels;
+uniform int u_virtual_offsets[MAX_VIRTUAL_LEVELS]; //id of the first brick of every level
+uniform ivec3 u_atlas_slots;
+uniform int u_virtual_frame;
+layout(std430, binding = 0) readonly buffer VirtualPageTable { uint page_table[]; }; //slot + 1, 0 if not resident
+layout(std430, binding = 1) buffer VirtualFeedback { uint feedback[]; }; //last frame each brick was wanted
+
+// Value of the virtual volume at uvw from the finest resident brick at the level of lod or above. The brick of lod
+// is stamped in the feedback, and until it is paged in the coarser ones (at last u_texture) stand in
+float virtualTextureLod(vec3 uvw, float lod) {
+    int wanted = clamp(int(lod), 0, u_virtual_levels - 1);
+    for (int level = wanted; level < u_virtual_levels; level++) {
+        ivec3 size = max((u_virtual_size + (1 << level) - 1) >> level, ivec3(1));
+        ivec3 bricks = (size + VIRTUAL_BRICK_SIZE - 1) / VIRTUAL_BRICK_SIZE;
+        vec3 voxel = clamp(uvw, 0.0, 1.0) * vec3(size);
+        ivec3 brick = min(ivec3(voxel) / VIRTUAL_BRICK_SIZE, bricks - 1);
+        int id = u_virtual_offsets[level] + (brick.z * bricks.y + brick.y) * bricks.x + brick.x;
+        uint entry = page_table[id];
+        if ((level == wanted || entry != 0u) && feedback[id] != uint(u_virtual_frame)) {
+            feedback[id] = uint(u_virtual_frame);
+        }
+        if (entry != 0u) {
+            int slot = int(entry) - 1;
+            ivec3 slot_pos = ivec3(slot % u_atlas_slots.x, (slot / u_atlas_slots.x) % u_atlas_slots.y, slot / (u_atlas_slots.x * u_atlas_slots.y));
+            vec3 texel = vec3(slot_pos * (VIRTUAL_BRICK_SIZE + 2) + 1) + voxel - vec3(brick * VIRTUAL_BRICK_SIZE);
+            return textureLod(u_brick_atlas, texel / vec3(u_atlas_slots * (VIRTUAL_BRICK_SIZE + 2)), 0.0).r;
+        }
+    }
+    return textureLod(u_texture, uvw, 0.0).r;
+}
+
+// Stored value at uvw, from the 3D texture or from the bricks of the virtual texture
+float volumeLod(vec3 uvw, float lod) {
+    if (VIRTUAL_TEXTURE) {
+        return virtualTextureLod(uvw, lod);
+    }
+    return textureLod(u_texture, uvw, lod).r;
+}
+
+int volumeResolution() {
+    return VIRTUAL_TEXTURE ? u_virtual_size.x : textureSize(u_texture, 0).x;
+}
+
+int volumeLevels() {
+    return VIRTUAL_TEXTURE ? u_virtual_levels : textureQueryLevels(u_texture);
+}
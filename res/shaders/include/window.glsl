@@ -0,0 +1,8 @@
+//Window/level of the scanned volumes, identity (0.5, 1) for the rest
+uniform float u_window_level;
+uniform float u_window_width;
+
+// Remaps a stored value through the window, 16 bit scans keep their precision until here
+float applyWindow(float value) {
+    return clamp((value - u_window_level) / u_window_width + 0.5, 0.0, 1.0);
+}
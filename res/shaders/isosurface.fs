@@ -7,7 +7,6 @@ in vec3 v_normal;
 uniform vec3 u_camera_position;
 
 uniform vec4 u_color;
-uniform vec4 u_background_color;
 
 uniform vec3 u_kd;
 uniform vec3 u_ks;
@@ -17,113 +16,72 @@ uniform float u_step_length;
 
 uniform float u_threshold;
 uniform float u_h;
+uniform int u_refinement_steps; //secant steps between the last sample below the threshold and the first above, 0 disables them
 
-//Noise
-uniform float u_noise_detail;
-uniform float u_noise_scale;
-
-//VDB
+//VDB or baked 3D noise
 uniform sampler3D u_texture;
 
+#ifndef USE_ILLUMINATION
 uniform bool u_illumination_activated;
-//light
-uniform float u_light_intensity;
-uniform vec4 u_light_color;
-uniform vec3 u_local_light_position;
+#define USE_ILLUMINATION u_illumination_activated
+#endif
+//Lights in the local space of the volume (LightBlock, filled by Light::uploadLightBlock)
+//specialized variants get NUM_LIGHTS as a macro, so the light loops unroll
+#define MAX_LIGHTS 8
+struct sLight {
+    vec4 position; //xyz, w unused
+    vec4 color;    //rgb already scaled by the intensity
+};
+layout(std140, binding = 0) uniform LightBlock {
+    sLight u_lights[MAX_LIGHTS];
+};
+#ifndef NUM_LIGHTS
+uniform int u_num_lights;
+#define NUM_LIGHTS u_num_lights
+#endif
 
 uniform vec3 u_ambient_term;
 
-//Jittering filter
-uniform bool u_use_jittering;
+//Pixel to the local space of the volume, for the depth of the opaque nodes
+uniform mat4 u_inverse_mvp; //clip space to the local space of the volume
+uniform vec4 u_viewport;
+
+#include "include/jitter.glsl"
 
+// Specialized variants get DENSITY_TYPE, USE_JITTERING... as macros from the material so the
+// branches below fold at compile time, the generic shader reads them from uniforms
+#ifndef DENSITY_TYPE
 uniform int u_density_type;
+#define DENSITY_TYPE u_density_type
+#endif
 #define CONSTANT 0
 #define NOISE_3D 1
 #define VDB 2
 
 out vec4 FragColor;
 
-//Random function for the offset
-float random(vec2 st) {
-    return fract(sin(dot(st.xy,
-                         vec2(12.9898,78.233)))*
-        43758.5453123);
-}
+#include "include/window.glsl"
 
-// Noise functions
-float hash1( float n )
-{
-    return fract( n*17.0*fract( n*0.3183099 ) );
-}
-
-float noise( vec3 x )
-{
-    vec3 p = floor(x);
-    vec3 w = fract(x);
-    
-    vec3 u = w*w*w*(w*(w*6.0-15.0)+10.0);
-    
-    float n = p.x + 317.0*p.y + 157.0*p.z;
-    
-    float a = hash1(n+0.0);
-    float b = hash1(n+1.0);
-    float c = hash1(n+317.0);
-    float d = hash1(n+318.0);
-    float e = hash1(n+157.0);
-    float f = hash1(n+158.0);
-    float g = hash1(n+474.0);
-    float h = hash1(n+475.0);
-
-    float k0 =   a;
-    float k1 =   b - a;
-    float k2 =   c - a;
-    float k3 =   e - a;
-    float k4 =   a - b - c + d;
-    float k5 =   a - c - e + g;
-    float k6 =   a - b - e + f;
-    float k7 = - a + b + c - d + e - f - g + h;
-
-    return -1.0+2.0*(k0 + k1*u.x + k2*u.y + k3*u.z + k4*u.x*u.y + k5*u.y*u.z + k6*u.z*u.x + k7*u.x*u.y*u.z);
+// Size and levels of the 3D texture, this shader has no virtual texture
+int volumeResolution() {
+    return textureSize(u_texture, 0).x;
 }
 
-#define MAX_OCTAVES 16
-
-float fractal_noise( vec3 P, float detail )
-{
-    float fscale = 1.0;
-    float amp = 1.0;
-    float sum = 0.0;
-    float octaves = clamp(detail, 0.0, 16.0);
-    int n = int(octaves);
-
-    for (int i = 0; i <= MAX_OCTAVES; i++) {
-        if (i > n) continue;
-        float t = noise(fscale * P);
-        sum += t * amp;
-        amp *= 0.5;
-        fscale *= 2.0;
-    }
-
-    return sum;
+int volumeLevels() {
+    return textureQueryLevels(u_texture);
 }
 
-float cnoise( vec3 P, float scale, float detail )
-{
-    P *= scale;
-    return clamp(fractal_noise(P, detail), 0.0, 1.0);
-}
+#include "include/lod.glsl"
 
-float getDensity(vec3 pos){
-    if (u_density_type == CONSTANT){
+float getDensity(vec3 pos, float lod){
+    if (DENSITY_TYPE == CONSTANT){
         return 1.0;
-    } else if (u_density_type == VDB) { // VDB file
-        return texture(u_texture, (pos + vec3(1.0)) / 2.0).r; //Remap the current pos since u_texture goes from 0 to 1
-    } else if (u_density_type == NOISE_3D) { // 3D Noise
-        return cnoise(pos, u_noise_scale, u_noise_detail);
+    } else if (DENSITY_TYPE == VDB || DENSITY_TYPE == NOISE_3D) { // VDB file or baked 3D noise
+        return applyWindow(textureLod(u_texture, (pos + vec3(1.0)) / 2.0, lod).r); //Remap the current pos since u_texture goes from 0 to 1
     }
 }
 
-float checkBoundsAndGetDensity(vec3 pos){
+float checkBoundsAndGetDensity(vec3 pos, float lod){
 
     vec3 box_min = vec3(-1.0, -1.0, -1.0);  // Define your volume's min bounds
     vec3 box_max = vec3(1.0, 1.0, 1.0);     // Define your volume's max bounds
@@ -131,7 +89,7 @@ float checkBoundsAndGetDensity(vec3 pos){
     if (pos.x >= box_min.x && pos.x <= box_max.x &&
         pos.y >= box_min.y && pos.y <= box_max.y &&
         pos.z >= box_min.z && pos.z <= box_max.z) {
-        return getDensity(pos);
+        return getDensity(pos, lod);
     } else {
         return 0.0;
     }
@@ -153,14 +111,16 @@ bool intersections(vec3 ray_origin, vec3 ray_direction, vec3 box_min, vec3 box_m
     return t_near <= t_far && t_far > 0.0;
 }
 
-bool CheckVisivilityWithRayMarching(vec3 rayToLight_origin, vec3 rayToLight_direction, float t_far){
-    float step_length = u_step_length;
+#include "include/scene_depth.glsl"
+
+bool CheckVisivilityWithRayMarching(vec3 rayToLight_origin, vec3 rayToLight_direction, float t_far, float lod){
+    float step_length = u_step_length * exp2(lod);
     float t = step_length;
     vec3 current_pos = rayToLight_origin + t * rayToLight_direction;
 
     while (t < t_far){
         
-        if (getDensity(current_pos) > u_threshold){
+        if (getDensity(current_pos, lod) > u_threshold){
             return false;
         }
 
@@ -170,7 +130,7 @@ bool CheckVisivilityWithRayMarching(vec3 rayToLight_origin, vec3 rayToLight_dire
     return true;
 }
 
-bool CheckVisibility(vec3 light_ray, vec3 current_pos){
+bool CheckVisibility(vec3 light_ray, vec3 current_pos, float lod){
 
     // Compute the volume intersection
     vec3 box_min = vec3(-1.0, -1.0, -1.0);  // Define your volume's min bounds
@@ -179,7 +139,7 @@ bool CheckVisibility(vec3 light_ray, vec3 current_pos){
 
 	//Check intersections
 	if (intersections(current_pos, light_ray, box_min, box_max, t_near, t_far)) {
-        return CheckVisivilityWithRayMarching(current_pos, light_ray, t_far);
+        return CheckVisivilityWithRayMarching(current_pos, light_ray, t_far, lod);
     } 
     else {
     	return true;
@@ -199,52 +159,94 @@ vec3 getReflectance(vec3 normal, vec3 wo, vec3 wi) {
     return diffuse + specular;
 }
 
-vec3 ComputeGradient(vec3 pos){
-    float x = checkBoundsAndGetDensity(pos + vec3(u_h,0.0,0.0)) - checkBoundsAndGetDensity(pos - vec3(u_h,0.0,0.0));
-    float y = checkBoundsAndGetDensity(pos + vec3(0.0,u_h,0.0)) - checkBoundsAndGetDensity(pos - vec3(0.0,u_h,0.0));
-    float z = checkBoundsAndGetDensity(pos + vec3(0.0,0.0,u_h)) - checkBoundsAndGetDensity(pos - vec3(0.0,0.0,u_h));
+vec3 ComputeGradient(vec3 pos, float lod){
+    float x = checkBoundsAndGetDensity(pos + vec3(u_h,0.0,0.0), lod) - checkBoundsAndGetDensity(pos - vec3(u_h,0.0,0.0), lod);
+    float y = checkBoundsAndGetDensity(pos + vec3(0.0,u_h,0.0), lod) - checkBoundsAndGetDensity(pos - vec3(0.0,u_h,0.0), lod);
+    float z = checkBoundsAndGetDensity(pos + vec3(0.0,0.0,u_h), lod) - checkBoundsAndGetDensity(pos - vec3(0.0,0.0,u_h), lod);
     return 1/(2*u_h) * vec3(x, y, z);
 }
 
-vec3 ComputeRadianceWithIllumination(vec3 pos, vec3 ray_direction){
-    vec3 normal = normalize(-ComputeGradient(pos));
-    vec3 light_ray = normalize(u_local_light_position - pos);
-    vec3 reflectance = getReflectance(normal, -ray_direction, light_ray);
-    float visibility = CheckVisibility(light_ray, pos) ? 1.0 : 0.0;
-
-    return visibility *(u_light_color.rgb * u_light_intensity) * dot(light_ray, normal) * reflectance + u_ambient_term;
+// The normal is computed once for all the lights, each light adds its shadow march
+vec3 ComputeRadianceWithIllumination(vec3 pos, vec3 ray_direction, float lod){
+    vec3 normal = normalize(-ComputeGradient(pos, lod));
+    vec3 radiance = u_ambient_term;
+    for (int i = 0; i < NUM_LIGHTS; i++) {
+        vec3 light_ray = normalize(u_lights[i].position.xyz - pos);
+        float n_dot_l = dot(light_ray, normal);
+        // facing away, no need to march the shadow ray
+        if (n_dot_l <= 0.0) {
+            continue;
+        }
+        vec3 reflectance = getReflectance(normal, -ray_direction, light_ray);
+        float visibility = CheckVisibility(light_ray, pos, lod) ? 1.0 : 0.0;
+        radiance += visibility * u_lights[i].color.rgb * n_dot_l * reflectance;
+    }
+    return radiance;
 }
 
 
+// Distance to the surface inside [t_below, t_above], where the density crosses the threshold. Secant steps keep the
+// bracket (regula falsi), each new point is kept away from the ends so the bracket shrinks even if one end stagnates
+float refineHit(vec3 ray_origin, vec3 ray_direction, float t_below, float density_below, float t_above, float density_above, float lod) {
+    for (int i = 0; i < u_refinement_steps; i++) {
+        float f = clamp((u_threshold - density_below) / max(density_above - density_below, 1e-6), 0.1, 0.9);
+        float t = mix(t_below, t_above, f);
+        float density = getDensity(ray_origin + t * ray_direction, lod);
+        if (density > u_threshold) {
+            t_above = t;
+            density_above = density;
+        } else {
+            t_below = t;
+            density_below = density;
+        }
+    }
+    float f = clamp((u_threshold - density_below) / max(density_above - density_below, 1e-6), 0.0, 1.0);
+    return mix(t_below, t_above, f);
+}
+
 //Heterogenous
 void rayMarching(vec3 ray_origin, vec3 ray_direction, float t_near, float t_far, out vec4 radiance) {
 
     // Initialize parameters
-    float step_length = u_step_length;           
+    float step_length = u_step_length * exp2(computeLod(t_near));
     float t = t_near; 
-    if (u_use_jittering){
-        float offset = random(gl_FragCoord.xy) * step_length;
+    if (USE_JITTERING){
+        float offset = jitterNoise(ivec2(gl_FragCoord.xy)) * step_length;
         if((t + offset) < t_far){
             t += offset;
         }
     }               
     vec3 current_pos = ray_origin + t * ray_direction;
     float particle_density;
-    radiance = u_background_color;
+    radiance = vec4(0.0);
+
+    // last sample below the threshold, the box entry counts as empty
+    float t_previous = t_near;
+    float previous_density = 0.0;
 
     // Compute the transmittance
     while (t < t_far){
-        particle_density = getDensity(current_pos);
+        float lod = computeLod(t);
+        step_length = u_step_length * exp2(lod);
+
+        particle_density = getDensity(current_pos, lod);
         
         if (particle_density > u_threshold){
-            if(u_illumination_activated){
-                radiance = vec4(ComputeRadianceWithIllumination(current_pos, ray_direction), 1.0);
+            // the hit is only as precise as the step, the refinement finds the crossing between the two samples
+            if (u_refinement_steps > 0 && t > t_previous) {
+                t = refineHit(ray_origin, ray_direction, t_previous, previous_density, t, particle_density, lod);
+                current_pos = ray_origin + t * ray_direction;
+            }
+            if(USE_ILLUMINATION){
+                radiance = vec4(ComputeRadianceWithIllumination(current_pos, ray_direction, lod), 1.0);
             } else {
-                radiance = u_color;
+                radiance = vec4(u_color.rgb, 1.0);
             }
             break;
         }
 
+        t_previous = t;
+        previous_density = particle_density;
         t += step_length;
         current_pos = ray_origin + t * ray_direction;
     }
@@ -259,15 +261,19 @@ void main() {
     vec3 box_max = vec3(1.0, 1.0, 1.0);     // Define your volume's max bounds
     float t_near, t_far;
     
-    // If ray intersects the volume, we perform ray marching
-    if (intersections(ray_origin, ray_direction, box_min, box_max, t_near, t_far)) {
+    // If ray intersects the volume in front of the opaque nodes, we perform ray marching
+    bool hit = intersections(ray_origin, ray_direction, box_min, box_max, t_near, t_far);
+    if (hit) {
+        t_far = clipToSceneDepth((gl_FragCoord.xy - u_viewport.xy) / u_viewport.zw, ray_origin, ray_direction, t_far);
+    }
+    if (hit && t_far > t_near) {
         vec4 radiance;
 		rayMarching(ray_origin, ray_direction, t_near, t_far, radiance);
         
         FragColor = radiance;
     } 
     else {
-        // If no intersection, output the background color
-        FragColor = u_background_color;
+        // If no intersection (or it is hidden), leave what is behind
+        FragColor = vec4(0.0);
     }
 }
\ No newline at end of file
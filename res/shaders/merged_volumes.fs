@@ -0,0 +1,141 @@
+#version 450 core
+
+in vec2 v_uv;
+
+//Overlapping volume nodes marched together in one pass: every volume gets the interval of the ray inside its box,
+//and the march covers their union front to back. Where they overlap their absorption and emission add up, like
+//a mixture of the media, the gaps between them are skipped and the ray stops once the sum is opaque
+//t is the distance in world units, each volume samples its local position and scales its coefficients by the
+//local length of a world unit along the ray
+
+#define MAX_MERGED_VOLUMES 4
+
+uniform int u_num_volumes;
+uniform mat4 u_inverse_models[MAX_MERGED_VOLUMES]; //world to the local space of each volume
+uniform int u_density_types[MAX_MERGED_VOLUMES];
+uniform float u_step_lengths[MAX_MERGED_VOLUMES]; //local space, like the step of each material
+uniform float u_absorption_coefficients[MAX_MERGED_VOLUMES];
+uniform vec3 u_emitted_radiances[MAX_MERGED_VOLUMES]; //color * intensity, black for the absorption only ones
+uniform vec2 u_windows[MAX_MERGED_VOLUMES]; //window level and width, identity (0.5, 1) for the rest
+uniform sampler3D u_textures[MAX_MERGED_VOLUMES];
+
+uniform mat4 u_inverse_viewprojection;
+uniform vec3 u_camera_position; //world space
+
+uniform float u_step_length; //scale of the steps of every volume, coarser in the progressive and temporal rendering
+
+//Depth of the opaque nodes (rendered before the volumes), the rays stop at it
+uniform bool u_use_scene_depth;
+uniform sampler2D u_scene_depth;
+
+#include "include/jitter.glsl"
+
+#define CONSTANT 0
+
+out vec4 FragColor;
+
+bool intersections(vec3 ray_origin, vec3 ray_direction, vec3 box_min, vec3 box_max, out float t_near, out float t_far) {
+    vec3 t_min = (box_min - ray_origin) / ray_direction;
+    vec3 t_max = (box_max - ray_origin) / ray_direction;
+    vec3 t1 = min(t_min, t_max);
+    vec3 t2 = max(t_min, t_max);
+    t_near = max(max(t1.x, t1.y), t1.z);
+    t_far = min(min(t2.x, t2.y), t2.z);
+    return t_near <= t_far && t_far > 0.0;
+}
+
+// Density of volume i at its local position, sampled like the marchers of the materials (without LOD)
+float sampleDensity(int i, vec3 pos) {
+    if (u_density_types[i] == CONSTANT) {
+        return 1.0;
+    }
+    float value = textureLod(u_textures[i], (pos + vec3(1.0)) / 2.0, 0.0).r;
+    return clamp((value - u_windows[i].x) / u_windows[i].y + 0.5, 0.0, 1.0);
+}
+
+void main() {
+    vec4 far_pos = u_inverse_viewprojection * vec4(v_uv * 2.0 - 1.0, 1.0, 1.0);
+    vec3 ray_origin = u_camera_position;
+    vec3 ray_direction = normalize(far_pos.xyz / far_pos.w - ray_origin);
+
+    // distance to the opaque surface behind this pixel
+    float t_scene = 1e30;
+    if (u_use_scene_depth) {
+        float depth = texture(u_scene_depth, v_uv).x;
+        if (depth < 1.0) {
+            vec4 world_pos = u_inverse_viewprojection * vec4(vec3(v_uv, depth) * 2.0 - 1.0, 1.0);
+            t_scene = dot(world_pos.xyz / world_pos.w - ray_origin, ray_direction);
+        }
+    }
+
+    // the ray in the local space of every volume keeps the world t, the direction is not normalized
+    vec3 local_origins[MAX_MERGED_VOLUMES];
+    vec3 local_directions[MAX_MERGED_VOLUMES];
+    float t_nears[MAX_MERGED_VOLUMES];
+    float t_fars[MAX_MERGED_VOLUMES];
+    float scales[MAX_MERGED_VOLUMES];
+    float t_start = 1e30;
+    float t_end = 0.0;
+    float step_length = 1e30;
+    for (int i = 0; i < u_num_volumes; i++) {
+        local_origins[i] = (u_inverse_models[i] * vec4(ray_origin, 1.0)).xyz;
+        local_directions[i] = mat3(u_inverse_models[i]) * ray_direction;
+        scales[i] = length(local_directions[i]);
+        float t_near, t_far;
+        if (!intersections(local_origins[i], local_directions[i], vec3(-1.0), vec3(1.0), t_near, t_far)) {
+            t_near = t_far = -1.0;
+        }
+        t_nears[i] = max(t_near, 0.0);
+        t_fars[i] = min(t_far, t_scene);
+        if (t_fars[i] > t_nears[i]) {
+            t_start = min(t_start, t_nears[i]);
+            t_end = max(t_end, t_fars[i]);
+            step_length = min(step_length, u_step_lengths[i] * u_step_length / scales[i]);
+        }
+    }
+    if (t_end <= t_start) {
+        FragColor = vec4(0.0);
+        return;
+    }
+
+    float jitter = u_use_jittering ? jitterNoise(ivec2(gl_FragCoord.xy)) : 0.0;
+    float t = t_start + jitter * step_length;
+    float optical_thickness = 0.0;
+    vec3 accumulated_radiance = vec3(0.0);
+
+    while (t < t_end) {
+        float absorption_coefficient = 0.0;
+        vec3 emission = vec3(0.0);
+        float t_next_entry = t_end;
+        bool inside = false;
+        for (int i = 0; i < u_num_volumes; i++) {
+            if (t < t_nears[i] && t_fars[i] > t_nears[i]) {
+                t_next_entry = min(t_next_entry, t_nears[i]);
+            }
+            if (t < t_nears[i] || t >= t_fars[i]) {
+                continue;
+            }
+            float coefficient = sampleDensity(i, local_origins[i] + t * local_directions[i]) * u_absorption_coefficients[i] * scales[i];
+            absorption_coefficient += coefficient;
+            emission += coefficient * u_emitted_radiances[i];
+            inside = true;
+        }
+
+        // in a gap between two volumes, the march goes on at the next entry with the same jitter
+        if (!inside) {
+            t = t_next_entry + jitter * step_length;
+            continue;
+        }
+
+        optical_thickness += absorption_coefficient * step_length;
+        accumulated_radiance += exp(-optical_thickness) * emission * step_length;
+
+        // shared early termination, the volumes behind are not sampled anymore
+        if (optical_thickness > 7.0) {
+            break;
+        }
+        t += step_length;
+    }
+
+    FragColor = vec4(accumulated_radiance, 1.0 - exp(-optical_thickness));
+}
@@ -0,0 +1,12 @@
+#version 450 core
+
+in vec3 a_vertex;
+
+out vec2 v_uv;
+
+//fullscreen quad (Mesh::getQuad), the vertices are already in clip space
+void main()
+{
+	v_uv = a_vertex.xy * 0.5 + vec2(0.5);
+	gl_Position = vec4(a_vertex.xy, 0.0, 1.0);
+}
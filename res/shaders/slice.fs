@@ -0,0 +1,113 @@
+#version 450 core
+
+in vec3 v_position;
+
+//Half-angle slicing: the volume is cut in slices perpendicular to the vector halfway between the view and the light
+//directions, so one order of the slices is front to back for the light and for the camera (or back to front, if they
+//face each other). Each slice is drawn twice: to the eye buffer, attenuating the light with the opacity the light
+//buffer accumulated so far, and then to the light buffer, adding its own opacity. The single scattering with shadows
+//costs one sample per slice and pixel instead of a march to the light per sample
+
+uniform bool u_light_pass;
+
+uniform vec3 u_camera_position; //local space
+uniform vec3 u_half_vector; //normal of the slices
+uniform float u_slice_spacing; //along u_half_vector
+
+uniform float u_absorption_coefficient;
+uniform float u_scattering_coefficient;
+uniform vec4 u_emitted_color;
+uniform int u_emitted_intensity;
+
+//Light of the slices (the first one of the scene) and the opacity its buffer accumulated up to this slice
+uniform vec3 u_light_position; //local space
+uniform vec3 u_light_color; //scaled by the intensity
+uniform mat4 u_light_viewprojection; //local space to the clip space of the light buffer
+uniform sampler2D u_light_buffer;
+
+//Henyey-Greenstein phase function
+uniform bool u_use_phase_function;
+uniform float u_g;
+
+//VDB or baked 3D noise
+uniform sampler3D u_texture;
+
+//Transfer function: emitted color and opacity at the density (the diagonal of the pre-integrated table)
+uniform bool u_use_transfer_function;
+uniform sampler2D u_transfer_table;
+
+//Irradiance volume (see IrradianceVolume), the light scattered more than once and the ambient light
+uniform bool u_use_irradiance_volume;
+uniform sampler3D u_irradiance_volume;
+uniform float u_irradiance_strength;
+
+//Depth of the opaque nodes (rendered before the volumes), the slices behind it are hidden
+uniform bool u_use_scene_depth;
+uniform sampler2D u_scene_depth;
+uniform vec2 u_eye_size; //pixels of the eye buffer
+
+uniform int u_density_type;
+#define CONSTANT 0
+
+out vec4 FragColor;
+
+#include "include/window.glsl"
+
+const float PI = 3.14159265359;
+float phaseFunction(vec3 view_direction, vec3 to_light) {
+    // the same normalization as the marcher, both modes look alike
+    float g_square = u_g * u_g;
+    float cosine = dot(view_direction, to_light);
+    return (1.0 / 4.0 * PI) * ((1.0 - g_square) / pow(1.0 + g_square - 2.0 * u_g * cosine, 1.5));
+}
+
+void main() {
+    // the quad covers more than the section of the cube
+    if (any(greaterThan(abs(v_position), vec3(1.0)))) {
+        discard;
+    }
+    if (!u_light_pass && u_use_scene_depth && gl_FragCoord.z > texture(u_scene_depth, gl_FragCoord.xy / u_eye_size).x) {
+        discard;
+    }
+
+    float density = 1.0;
+    if (u_density_type != CONSTANT) {
+        density = applyWindow(textureLod(u_texture, (v_position + vec3(1.0)) / 2.0, 0.0).r);
+    }
+    vec3 emitted_color = u_emitted_color.rgb;
+    if (u_use_transfer_function) {
+        float size = float(textureSize(u_transfer_table, 0).x);
+        vec4 transfer = textureLod(u_transfer_table, (vec2(density) * (size - 1.0) + 0.5) / size, 0.0);
+        density = transfer.a;
+        emitted_color = transfer.a > 0.0 ? transfer.rgb / transfer.a : vec3(0.0);
+    }
+    float absorption = density * u_absorption_coefficient;
+
+    // the slab between two slices is longer along the rays that cross it at grazing angles
+    vec3 light_direction = normalize(v_position - u_light_position);
+    if (u_light_pass) {
+        float thickness = u_slice_spacing / max(abs(dot(light_direction, u_half_vector)), 0.05);
+        float alpha = 1.0 - exp(-absorption * thickness);
+        FragColor = vec4(alpha);
+        return;
+    }
+
+    vec3 view_direction = normalize(v_position - u_camera_position);
+    float thickness = u_slice_spacing / max(abs(dot(view_direction, u_half_vector)), 0.05);
+    float alpha = 1.0 - exp(-absorption * thickness);
+    if (alpha <= 0.0) {
+        discard;
+    }
+
+    vec4 light_clip = u_light_viewprojection * vec4(v_position, 1.0);
+    float light_transmittance = 1.0 - texture(u_light_buffer, light_clip.xy / light_clip.w * 0.5 + vec2(0.5)).a;
+    float phase = u_use_phase_function ? phaseFunction(view_direction, -light_direction) : 1.0;
+    vec3 in_scattered = light_transmittance * u_light_color * phase;
+    if (u_use_irradiance_volume) {
+        in_scattered += u_irradiance_strength * textureLod(u_irradiance_volume, (v_position + vec3(1.0)) / 2.0, 0.0).rgb;
+    }
+
+    // emission and scattering integrated over the slab, the density cancels out like in the tracking
+    vec3 radiance = emitted_color * float(u_emitted_intensity) + u_scattering_coefficient / max(u_absorption_coefficient, 1e-6) * in_scattered;
+    FragColor = vec4(alpha * radiance, alpha);
+}
@@ -0,0 +1,18 @@
+#version 450 core
+
+in vec3 a_vertex;
+
+//One slice of the half-angle slicing (see slice.fs), a quad (Mesh::getQuad) on the plane of the slice that
+//covers the whole section of the cube. Everything is in the local space of the volume
+uniform mat4 u_mvp; //local space to the clip space of the camera, or of the light
+uniform vec3 u_slice_center;
+uniform vec3 u_slice_axis_u; //in the plane, scaled by the radius of the section
+uniform vec3 u_slice_axis_v;
+
+out vec3 v_position;
+
+void main()
+{
+    v_position = u_slice_center + a_vertex.x * u_slice_axis_u + a_vertex.y * u_slice_axis_v;
+    gl_Position = u_mvp * vec4(v_position, 1.0);
+}
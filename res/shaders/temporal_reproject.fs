@@ -0,0 +1,53 @@
+#version 450 core
+
+in vec2 v_uv;
+
+//new jittered frame and its depth
+uniform sampler2D u_texture;
+uniform sampler2D u_depth;
+//blended result of the previous frames
+uniform sampler2D u_history;
+
+uniform mat4 u_inverse_viewprojection;
+//view-projection the history was rendered with
+uniform mat4 u_previous_viewprojection;
+uniform vec2 u_texel_size;
+//weight of the new frame
+uniform float u_blend;
+uniform bool u_history_valid;
+
+out vec4 FragColor;
+
+void main() {
+    vec4 current = texture(u_texture, v_uv);
+    if (!u_history_valid) {
+        FragColor = current;
+        return;
+    }
+
+    // world position of the pixel (the proxy geometry for the volumes) seen from the previous camera
+    float depth = texture(u_depth, v_uv).x;
+    vec4 world_pos = u_inverse_viewprojection * vec4(vec3(v_uv, depth) * 2.0 - 1.0, 1.0);
+    vec4 previous_pos = u_previous_viewprojection * vec4(world_pos.xyz / world_pos.w, 1.0);
+    vec2 previous_uv = previous_pos.xy / previous_pos.w * 0.5 + vec2(0.5);
+
+    // it was outside the previous frame, there is nothing to reuse
+    if (previous_pos.w <= 0.0 || any(lessThan(previous_uv, vec2(0.0))) || any(greaterThan(previous_uv, vec2(1.0)))) {
+        FragColor = current;
+        return;
+    }
+
+    // the history is only trusted inside the color range of the new neighborhood
+    vec4 neighborhood_min = current;
+    vec4 neighborhood_max = current;
+    for (int j = -1; j <= 1; j++) {
+        for (int i = -1; i <= 1; i++) {
+            vec4 neighbor = texture(u_texture, v_uv + vec2(i, j) * u_texel_size);
+            neighborhood_min = min(neighborhood_min, neighbor);
+            neighborhood_max = max(neighborhood_max, neighbor);
+        }
+    }
+    vec4 history = clamp(texture(u_history, previous_uv), neighborhood_min, neighborhood_max);
+
+    FragColor = mix(history, current, u_blend);
+}
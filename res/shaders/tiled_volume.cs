@@ -0,0 +1,275 @@
+#version 450 core
+
+//Tiled ray marcher of the absorption and emission-absorption models, the compute alternative to the fragment
+//shaders on the cube. Every work group is a tile of 8x8 pixels:
+// - only the tiles inside the projected bounds of the volume are dispatched (u_tile_offset is the first one)
+// - a tile whose rays only cross empty cells of the majorant grid writes nothing and leaves
+// - the rays march in batches of BATCH_STEPS, the voxels a batch of the whole tile reaches are fetched once
+//   into shared memory when they fit in a brick, and the tile stops as soon as all its rays are done
+//The result (premultiplied radiance, 1 - transmittance) goes to u_output and is composited afterwards
+
+layout(local_size_x = 8, local_size_y = 8) in;
+layout(rgba32f, binding = 0) uniform writeonly image2D u_output;
+
+uniform ivec2 u_tile_offset; //first pixel of the dispatched rectangle, relative to the viewport
+uniform vec4 u_viewport;
+uniform mat4 u_inverse_mvp; //clip space to the local space of the volume
+uniform vec3 u_camera_position; //local space
+
+uniform float u_step_length;
+uniform float u_absorption_coefficient;
+
+//Emissive
+#ifndef USE_EMISSION
+uniform bool u_use_emission;
+#define USE_EMISSION u_use_emission
+#endif
+uniform vec4 u_emitted_color;
+uniform int u_emitted_intensity;
+
+//VDB or baked 3D noise
+uniform sampler3D u_texture;
+
+#include "include/jitter.glsl"
+
+//Occupancy, the upper bound of the density of each block of voxels (before the window), if it was built
+uniform bool u_use_occupancy;
+uniform sampler3D u_majorant_grid;
+
+#ifndef DENSITY_TYPE
+uniform int u_density_type;
+#define DENSITY_TYPE u_density_type
+#endif
+#define CONSTANT 0
+#define NOISE_3D 1
+#define VDB 2
+
+#define TILE_PIXELS 64
+#define BATCH_STEPS 8
+#define BRICK_SIZE 16 //voxels per side of the shared brick, 16 KB
+
+shared float brick[BRICK_SIZE * BRICK_SIZE * BRICK_SIZE];
+shared int brick_min[3];
+shared int brick_max[3];
+shared int tile_level;
+shared uint active_rays;
+
+#include "include/window.glsl"
+
+// Size and levels of the 3D texture, this shader has no virtual texture
+int volumeResolution() {
+    return textureSize(u_texture, 0).x;
+}
+
+int volumeLevels() {
+    return textureQueryLevels(u_texture);
+}
+
+#include "include/lod.glsl"
+
+bool intersections(vec3 ray_origin, vec3 ray_direction, vec3 box_min, vec3 box_max, out float t_near, out float t_far) {
+    vec3 t_min = (box_min - ray_origin) / ray_direction;
+    vec3 t_max = (box_max - ray_origin) / ray_direction;
+    vec3 t1 = min(t_min, t_max);
+    vec3 t2 = max(t_min, t_max);
+    t_near = max(max(t1.x, t1.y), t1.z);
+    t_far = min(min(t2.x, t2.y), t2.z);
+    return t_near <= t_far && t_far > 0.0;
+}
+
+#include "include/scene_depth.glsl"
+
+// The ray crosses some cell of the majorant grid with density, walking it like the delta tracking does
+bool crossesOccupiedCells(vec3 ray_origin, vec3 ray_direction, float t_near, float t_far) {
+    ivec3 grid_size = textureSize(u_majorant_grid, 0);
+    vec3 cell_size = 2.0 / vec3(grid_size);
+
+    float t = t_near;
+    vec3 grid_pos = (ray_origin + t * ray_direction + vec3(1.0)) / cell_size;
+    ivec3 cell = clamp(ivec3(floor(grid_pos)), ivec3(0), grid_size - 1);
+    ivec3 cell_step = ivec3(sign(ray_direction));
+    vec3 t_delta = abs(cell_size / ray_direction);
+    vec3 t_next = ((vec3(cell + max(cell_step, ivec3(0))) * cell_size - vec3(1.0)) - ray_origin) / ray_direction;
+
+    while (t < t_far) {
+        if (texelFetch(u_majorant_grid, cell, 0).r > 0.0) {
+            return true;
+        }
+        if (t_next.x <= t_next.y && t_next.x <= t_next.z) {
+            t = t_next.x;
+            cell.x += cell_step.x;
+            t_next.x += t_delta.x;
+        }
+        else if (t_next.y <= t_next.z) {
+            t = t_next.y;
+            cell.y += cell_step.y;
+            t_next.y += t_delta.y;
+        }
+        else {
+            t = t_next.z;
+            cell.z += cell_step.z;
+            t_next.z += t_delta.z;
+        }
+        if (any(lessThan(cell, ivec3(0))) || any(greaterThanEqual(cell, grid_size))) {
+            break;
+        }
+    }
+    return false;
+}
+
+// Trilinear filtering of the brick, the same the sampler does on the texture (clamped to the edge)
+float sampleBrick(vec3 pos, ivec3 origin, ivec3 size) {
+    vec3 voxel = (pos + vec3(1.0)) / 2.0 * vec3(size) - vec3(0.5);
+    vec3 base = floor(voxel);
+    vec3 f = voxel - base;
+    ivec3 v0 = clamp(ivec3(base), ivec3(0), size - 1) - origin;
+    ivec3 v1 = clamp(ivec3(base) + 1, ivec3(0), size - 1) - origin;
+
+    float c000 = brick[(v0.z * BRICK_SIZE + v0.y) * BRICK_SIZE + v0.x];
+    float c100 = brick[(v0.z * BRICK_SIZE + v0.y) * BRICK_SIZE + v1.x];
+    float c010 = brick[(v0.z * BRICK_SIZE + v1.y) * BRICK_SIZE + v0.x];
+    float c110 = brick[(v0.z * BRICK_SIZE + v1.y) * BRICK_SIZE + v1.x];
+    float c001 = brick[(v1.z * BRICK_SIZE + v0.y) * BRICK_SIZE + v0.x];
+    float c101 = brick[(v1.z * BRICK_SIZE + v0.y) * BRICK_SIZE + v1.x];
+    float c011 = brick[(v1.z * BRICK_SIZE + v1.y) * BRICK_SIZE + v0.x];
+    float c111 = brick[(v1.z * BRICK_SIZE + v1.y) * BRICK_SIZE + v1.x];
+
+    float c00 = mix(c000, c100, f.x);
+    float c10 = mix(c010, c110, f.x);
+    float c01 = mix(c001, c101, f.x);
+    float c11 = mix(c011, c111, f.x);
+    return mix(mix(c00, c10, f.y), mix(c01, c11, f.y), f.z);
+}
+
+void main() {
+    ivec2 pixel = u_tile_offset + ivec2(gl_GlobalInvocationID.xy);
+    bool inside = all(lessThan(pixel, ivec2(u_viewport.zw)));
+    uint local_index = gl_LocalInvocationIndex;
+
+    if (local_index == 0u) {
+        active_rays = 0u;
+    }
+    barrier();
+
+    // ray of the pixel center, from the camera through the far plane
+    vec2 uv = (vec2(pixel) + vec2(0.5)) / u_viewport.zw;
+    vec4 far_pos = u_inverse_mvp * vec4(uv * 2.0 - 1.0, 1.0, 1.0);
+    vec3 ray_origin = u_camera_position;
+    vec3 ray_direction = normalize(far_pos.xyz / far_pos.w - ray_origin);
+
+    float t_near, t_far;
+    bool marching = inside && intersections(ray_origin, ray_direction, vec3(-1.0), vec3(1.0), t_near, t_far);
+    if (marching) {
+        t_near = max(t_near, 0.0);
+        t_far = clipToSceneDepth(uv, ray_origin, ray_direction, t_far);
+        marching = t_far > t_near;
+    }
+
+    // a window that lifts the zero density makes the empty blocks visible, then nothing is culled
+    if (marching && u_use_occupancy && DENSITY_TYPE != CONSTANT && applyWindow(0.0) <= 0.0) {
+        marching = crossesOccupiedCells(ray_origin, ray_direction, t_near, t_far);
+    }
+    if (marching) {
+        atomicAdd(active_rays, 1u);
+    }
+    barrier();
+
+    // empty tile: none of its pixels sees the volume, or only its empty blocks
+    if (active_rays == 0u) {
+        if (inside) {
+            imageStore(u_output, pixel, vec4(0.0));
+        }
+        return;
+    }
+
+    float t = t_near;
+    if (marching && USE_JITTERING) {
+        float offset = jitterNoise(pixel) * u_step_length * exp2(computeLod(t_near));
+        if (t + offset < t_far) {
+            t += offset;
+        }
+    }
+
+    float optical_thickness = 0.0;
+    vec3 accumulated_radiance = vec3(0.0);
+
+    while (true) {
+        barrier(); // everyone is done with the brick and the counters of the previous batch
+        if (local_index == 0u) {
+            active_rays = 0u;
+            tile_level = 1 << 16;
+            for (int i = 0; i < 3; i++) {
+                brick_min[i] = 1 << 30;
+                brick_max[i] = -(1 << 30);
+            }
+        }
+        barrier();
+
+        // the whole tile samples the finest level its rays need
+        float lod = marching ? computeLod(t) : 0.0;
+        if (marching) {
+            atomicAdd(active_rays, 1u);
+            atomicMin(tile_level, int(lod));
+        }
+        barrier();
+
+        // early exit of the tile, all its rays left the volume or became opaque
+        if (active_rays == 0u) {
+            break;
+        }
+
+        int level = tile_level;
+        ivec3 size = DENSITY_TYPE == CONSTANT ? ivec3(1) : textureSize(u_texture, level);
+        float step_length = u_step_length * exp2(lod);
+
+        // voxels this batch reaches, including the next one for the trilinear filter
+        if (marching && DENSITY_TYPE != CONSTANT) {
+            float t_last = min(t + float(BATCH_STEPS - 1) * step_length, t_far);
+            vec3 a = (ray_origin + t * ray_direction + vec3(1.0)) / 2.0 * vec3(size) - vec3(0.5);
+            vec3 b = (ray_origin + t_last * ray_direction + vec3(1.0)) / 2.0 * vec3(size) - vec3(0.5);
+            ivec3 low = clamp(ivec3(floor(min(a, b))), ivec3(0), size - 1);
+            ivec3 high = clamp(ivec3(floor(max(a, b))) + 1, ivec3(0), size - 1);
+            for (int i = 0; i < 3; i++) {
+                atomicMin(brick_min[i], low[i]);
+                atomicMax(brick_max[i], high[i]);
+            }
+        }
+        barrier();
+
+        // the 64 invocations fetch the brick together, if the batch fits in it
+        ivec3 origin = ivec3(brick_min[0], brick_min[1], brick_min[2]);
+        ivec3 extent = ivec3(brick_max[0], brick_max[1], brick_max[2]) - origin + 1;
+        bool use_brick = DENSITY_TYPE != CONSTANT && all(lessThanEqual(extent, ivec3(BRICK_SIZE)));
+        if (use_brick) {
+            int count = extent.x * extent.y * extent.z;
+            for (int i = int(local_index); i < count; i += TILE_PIXELS) {
+                ivec3 v = ivec3(i % extent.x, (i / extent.x) % extent.y, i / (extent.x * extent.y));
+                brick[(v.z * BRICK_SIZE + v.y) * BRICK_SIZE + v.x] = texelFetch(u_texture, origin + v, level).r;
+            }
+        }
+        barrier();
+
+        if (marching) {
+            for (int i = 0; i < BATCH_STEPS && t < t_far; i++) {
+                vec3 current_pos = ray_origin + t * ray_direction;
+                float particle_density = 1.0;
+                if (DENSITY_TYPE != CONSTANT) {
+                    float value = use_brick ? sampleBrick(current_pos, origin, size) : textureLod(u_texture, (current_pos + vec3(1.0)) / 2.0, float(level)).r;
+                    particle_density = applyWindow(value);
+                }
+
+                float absorption_coefficient = particle_density * u_absorption_coefficient;
+                optical_thickness += absorption_coefficient * step_length;
+                if (USE_EMISSION) {
+                    accumulated_radiance += exp(-optical_thickness) * absorption_coefficient * u_emitted_color.xyz * float(u_emitted_intensity) * step_length;
+                }
+                t += step_length;
+            }
+            marching = t < t_far && optical_thickness <= 7.0;
+        }
+    }
+
+    if (inside) {
+        imageStore(u_output, pixel, vec4(accumulated_radiance, 1.0 - exp(-optical_thickness)));
+    }
+}
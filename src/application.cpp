@@ -1,5 +1,9 @@
 #include "application.h"
 
+#include <algorithm>
+#include <cfloat>
+#include <tuple>
+
 bool render_wireframe = false;
 Camera* Application::camera = nullptr;
 
@@ -35,13 +39,13 @@ void Application::init(GLFWwindow* window)
     VolumeNode* volumenode = new VolumeNode("Volume Node");
     volumenode->model = glm::translate(volumenode->model, glm::vec3(1.5f, 0.f, 0.f));
     volumenode->mesh = Mesh::Get("res/meshes/cube.obj");
-    volumenode->material = new VolumeMaterial(background_color, "res/volumes/bunny_cloud.vdb");
+    volumenode->material = new VolumeMaterial("res/volumes/bunny_cloud.vdb");
     this->node_list.push_back(volumenode);
 
     VolumeNode* isosurfacenode = new VolumeNode("Volume_isosurface Node");
     isosurfacenode->model = glm::translate(isosurfacenode->model, glm::vec3(-1.5f, 0.f, 0.f));
     isosurfacenode->mesh = Mesh::Get("res/meshes/cube.obj");
-    isosurfacenode->material = new IsosurfaceMaterial(glm::vec4(1.f, 0.2f, 0.6f, 1.0f), background_color, "res/volumes/bunny_cloud.vdb");
+    isosurfacenode->material = new IsosurfaceMaterial(glm::vec4(1.f, 0.2f, 0.6f, 1.0f), "res/volumes/bunny_cloud.vdb");
     this->node_list.push_back(isosurfacenode);
 
     Light* point_light = new Light(glm::vec3(0.0f, 1.5f, 1.5f), LIGHT_POINT);
@@ -61,6 +65,97 @@ void Application::update(float dt)
 
 void Application::render()
 {
+    // runs before the clear, so the frame shown is the regular one
+    if (this->benchmark_requested) {
+        this->benchmarkShaderVariants();
+        this->benchmarkComputeRenderer();
+        this->benchmark_requested = false;
+        this->resetAccumulation();
+        if (this->exit_after_benchmark)
+            this->close = true;
+    }
+
+    if (this->use_dynamic_resolution)
+        this->updateDynamicResolution();
+
+    // volumes at reduced resolution, or mixed with opaque nodes, need the depth of the scene as a texture,
+    // so the scene goes to frame_fbo
+    bool volumes = false;
+    bool opaque_nodes = false;
+    bool reduced_volumes = this->use_dynamic_resolution && this->render_scale < 1.f;
+    for (auto* node : this->node_list) {
+        if (node->type == NODE_VOLUME) {
+            volumes = true;
+            reduced_volumes |= ((VolumeNode*)node)->resolution_divisor > 1;
+        }
+        else if (node->material) {
+            opaque_nodes = true;
+        }
+    }
+
+    if (!this->use_progressive && !this->use_temporal && !reduced_volumes && !(volumes && (opaque_nodes || this->use_merged_volumes))) {
+        this->renderScene();
+        return;
+    }
+
+    this->updateFrameBuffers();
+
+    if (this->use_progressive) {
+        this->renderProgressive();
+        return;
+    }
+
+    this->frame_fbo->bind();
+    this->renderScene();
+    this->frame_fbo->unbind();
+
+    if (this->use_temporal) {
+        this->renderTemporal();
+        return;
+    }
+
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
+    this->frame_fbo->color_textures[0]->toViewport();
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_CULL_FACE);
+}
+
+void Application::updateFrameBuffers()
+{
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    int width = viewport[2];
+    int height = viewport[3];
+
+    if (this->frame_fbo && this->frame_fbo->width == width && this->frame_fbo->height == height)
+        return;
+
+    delete this->frame_fbo;
+    delete this->accumulation_fbo;
+    delete this->depth_fbo;
+    this->frame_fbo = new FBO();
+    this->frame_fbo->create(width, height);
+    this->accumulation_fbo = new FBO();
+    this->accumulation_fbo->create(width, height, 1, GL_RGBA, GL_FLOAT, GL_RGBA32F, false);
+    this->depth_fbo = new FBO();
+    this->depth_fbo->create(width, height, 0);
+    for (auto& it : this->reduced_fbos)
+        delete it.second;
+    this->reduced_fbos.clear();
+    for (int i = 0; i < 2; i++) {
+        delete this->history_fbos[i];
+        this->history_fbos[i] = new FBO();
+        this->history_fbos[i]->create(width, height, 1, GL_RGBA, GL_FLOAT, GL_RGBA32F, false);
+    }
+
+    this->resetAccumulation();
+}
+
+void Application::renderScene()
+{
+    this->frame_count++;
+
     // set the clear color (the background color)
     //glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
     glClearColor(background_color.r, background_color.g, background_color.b, background_color.a);
@@ -72,6 +167,25 @@ void Application::render()
     glEnable(GL_DEPTH_TEST);
     glEnable(GL_CULL_FACE);
 
+    // the opacity maps go first, the meshes are shadowed with them
+    this->shadow_volumes.clear();
+    for (SceneNode* node : this->node_list) {
+        auto* volumeMaterial = dynamic_cast<VolumeMaterial*>(node->material);
+        if (node->type != NODE_VOLUME || !volumeMaterial || !volumeMaterial->use_opacity_maps || this->volumenode_type == ISOSURFACE_MATERIAL)
+            continue;
+        volumeMaterial->updateOpacityMaps(node, node->model);
+        this->shadow_volumes.push_back(node);
+    }
+
+    // the volumes go after the opaque nodes, their rays stop at the depth of them
+    std::vector<VolumeNode*> volume_nodes;
+    auto renderNode = [&](SceneNode* node) {
+        if (node->type == NODE_VOLUME)
+            volume_nodes.push_back((VolumeNode*)node);
+        else
+            node->render(this->camera);
+    };
+
     for (unsigned int i = 0; i < this->node_list.size(); i++)
     {
         SceneNode* node = this->node_list[i];
@@ -85,16 +199,16 @@ void Application::render()
         }
 
         if (volumenode_type == NOT_APPLY) {
-            node->render(this->camera);
+            renderNode(node);
         }
         else if (volumenode_type == VOLUME_MATERIAL) {
             if (auto* volumeMaterial = dynamic_cast<VolumeMaterial*>(node->material)) {
-                node->render(this->camera);
+                renderNode(node);
             }
         }
         else if (volumenode_type == ISOSURFACE_MATERIAL) {
             if (auto* isosurfaceMaterial = dynamic_cast<IsosurfaceMaterial*>(node->material)) {
-                node->render(this->camera);
+                renderNode(node);
             }
         }
 
@@ -103,6 +217,421 @@ void Application::render()
 
     // Draw the floor grid
     if (this->flag_grid) drawGrid();
+
+    // the depth can only be sampled from a copy, and only when rendering offscreen
+    GLint framebuffer = 0;
+    glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &framebuffer);
+    if (this->frame_fbo && framebuffer == (GLint)this->frame_fbo->fbo_id) {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, this->frame_fbo->fbo_id);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, this->depth_fbo->fbo_id);
+        glBlitFramebuffer(0, 0, this->frame_fbo->width, this->frame_fbo->height, 0, 0, this->depth_fbo->width, this->depth_fbo->height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, this->frame_fbo->fbo_id);
+        this->scene_depth = this->depth_fbo->depth_texture;
+    }
+
+    this->updateQualityLevels(volume_nodes);
+
+    // the volume passes are timed for the dynamic resolution, only in the frames that render them
+    GPUTimer* volume_timer = NULL;
+    if (this->use_dynamic_resolution && !volume_nodes.empty()) {
+        int query = this->volume_timer_frame++ % DYNAMIC_TIMER_QUERIES;
+        volume_timer = &this->volume_timers[query];
+        this->volume_timer_pending[query] = true;
+        volume_timer->begin();
+    }
+
+    // full resolution first, the reduced ones need their depth too
+    bool dynamic_scale = this->use_dynamic_resolution && this->render_scale < 1.f;
+    std::vector<VolumeNode*> full_nodes;
+    for (auto* node : volume_nodes)
+        if (node->resolution_divisor <= 1 && !dynamic_scale)
+            full_nodes.push_back(node);
+    if (this->use_merged_volumes && this->scene_depth) {
+        this->renderMergedVolumes(full_nodes);
+    }
+    else if (this->use_instancing) {
+        this->renderInstancedVolumes(full_nodes);
+    }
+    else {
+        for (auto* node : full_nodes)
+            node->render(this->camera);
+    }
+    for (auto* node : volume_nodes)
+        if (node->resolution_divisor > 1 || dynamic_scale)
+            this->renderReducedVolume(node);
+
+    if (volume_timer)
+        volume_timer->end();
+
+    this->scene_depth = NULL;
+}
+
+// Renders the volume into a 1/divisor target (times the dynamic render scale) tested against the scene depth, then
+// upsamples it over the current frame weighting the low resolution texels by how close their depth is to the full
+// resolution one
+void Application::renderReducedVolume(VolumeNode* node)
+{
+    float scale = (this->use_dynamic_resolution ? this->render_scale : 1.f) / node->resolution_divisor;
+    int percent = (int)(scale * 100.f + 0.5f);
+    FBO*& reduced_fbo = this->reduced_fbos[percent];
+    if (!reduced_fbo) {
+        reduced_fbo = new FBO();
+        reduced_fbo->create(std::max(this->frame_fbo->width * percent / 100, 1), std::max(this->frame_fbo->height * percent / 100, 1));
+    }
+
+    // the frame depth is sampled while frame_fbo is bound, so it is read from a copy
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, this->frame_fbo->fbo_id);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, this->depth_fbo->fbo_id);
+    glBlitFramebuffer(0, 0, this->frame_fbo->width, this->frame_fbo->height, 0, 0, this->depth_fbo->width, this->depth_fbo->height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+
+    // nearest depth downsample, the volume is occluded at low resolution as well
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, reduced_fbo->fbo_id);
+    glBlitFramebuffer(0, 0, this->frame_fbo->width, this->frame_fbo->height, 0, 0, reduced_fbo->width, reduced_fbo->height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, this->frame_fbo->fbo_id);
+
+    reduced_fbo->bind();
+    glClearColor(0.f, 0.f, 0.f, 0.f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_CULL_FACE);
+    node->render(this->camera);
+    reduced_fbo->unbind();
+
+    // the cleared texels have alpha 0, so the upsampled color is premultiplied
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+    Shader* shader = Shader::Get("res/shaders/screen.vs", "res/shaders/bilateral_upsample.fs");
+    shader->enable();
+    shader->setUniform("u_texture", reduced_fbo->color_textures[0], 0);
+    shader->setUniform("u_low_depth", reduced_fbo->depth_texture, 1);
+    shader->setUniform("u_depth", this->depth_fbo->depth_texture, 2);
+    shader->setUniform("u_low_size", glm::vec2(reduced_fbo->width, reduced_fbo->height));
+    shader->setUniform("u_camera_nearfar", glm::vec2(this->camera->near_plane, this->camera->far_plane));
+    Mesh::getQuad()->render(GL_TRIANGLES);
+    shader->disable();
+
+    glDisable(GL_BLEND);
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_CULL_FACE);
+}
+
+// Projects the corners of the box of every volume node to the viewport, and picks its quality level from the
+// fraction of the viewport the rectangle around them covers. The nodes with a corner behind the camera are close
+// enough to keep the full quality
+void Application::updateQualityLevels(const std::vector<VolumeNode*>& nodes)
+{
+    for (auto* node : nodes) {
+        node->footprint = 1.f;
+        node->quality_level = 0;
+        if (!this->use_footprint_lod)
+            continue;
+
+        glm::vec2 rect_min = glm::vec2(FLT_MAX);
+        glm::vec2 rect_max = glm::vec2(-FLT_MAX);
+        bool behind = false;
+        glm::mat4 mvp = this->camera->viewprojection_matrix * node->model;
+        for (int i = 0; i < 8 && !behind; i++) {
+            glm::vec4 clip = mvp * glm::vec4(i & 1 ? 1.f : -1.f, i & 2 ? 1.f : -1.f, i & 4 ? 1.f : -1.f, 1.f);
+            behind = clip.w <= this->camera->near_plane;
+            glm::vec2 ndc = glm::vec2(clip) / clip.w;
+            rect_min = glm::min(rect_min, ndc);
+            rect_max = glm::max(rect_max, ndc);
+        }
+        if (behind)
+            continue;
+
+        rect_min = glm::clamp(rect_min, glm::vec2(-1.f), glm::vec2(1.f));
+        rect_max = glm::clamp(rect_max, glm::vec2(-1.f), glm::vec2(1.f));
+        glm::vec2 size = glm::max(rect_max - rect_min, glm::vec2(0.f));
+        node->footprint = size.x * size.y / 4.f;
+        if (node->footprint >= this->footprint_full_quality)
+            continue;
+
+        // off screen nodes are culled by the rasterizer anyway, they take the last level
+        float levels = node->footprint > 0.f ? 1.f + floorf(log2f(this->footprint_full_quality / node->footprint) / 2.f) : (float)NUM_QUALITY_LEVELS;
+        node->quality_level = std::min((int)levels, NUM_QUALITY_LEVELS - 1);
+    }
+}
+
+// Reads the GPU time of the oldest volume pass in flight and moves the quality level towards the budget. The cost
+// of the volumes is modelled as render_scale^2 / step_scale, both interpolated in log space between full quality and
+// their bounds, so the level that scales the cost by budget / time is solved directly. Half of that correction is
+// applied when the time is over the band and a quarter when it is under, so the level settles instead of oscillating
+void Application::updateDynamicResolution()
+{
+    int query = this->volume_timer_frame % DYNAMIC_TIMER_QUERIES;
+    if (!this->volume_timer_pending[query] || !this->volume_timers[query].isAvailable())
+        return;
+    this->volume_timer_pending[query] = false;
+    this->volume_pass_ms = this->volume_timers[query].getMilliseconds();
+
+    // log of the cost at quality 0, the cost at quality q is exp((1 - q) * min_cost)
+    float min_cost = 2.f * logf(this->dynamic_min_render_scale) - logf(this->dynamic_max_step_scale);
+    if (this->volume_pass_ms <= 0.0 || min_cost > -1e-3f)
+        return;
+
+    float budget = this->dynamic_budget_ms;
+    float gain;
+    if (this->volume_pass_ms > budget * (1.f + this->dynamic_hysteresis))
+        gain = 0.5f;
+    else if (this->volume_pass_ms < budget * (1.f - this->dynamic_hysteresis) && this->dynamic_quality < 1.f)
+        gain = 0.25f;
+    else
+        return;
+
+    float quality = this->dynamic_quality - gain * logf(budget / (float)this->volume_pass_ms) / min_cost;
+    quality = glm::clamp(quality, 0.f, 1.f);
+    float render_scale = powf(this->dynamic_min_render_scale, 1.f - quality);
+    render_scale = glm::clamp(roundf(render_scale / DYNAMIC_SCALE_STEP) * DYNAMIC_SCALE_STEP, this->dynamic_min_render_scale, 1.f);
+    float step_scale = powf(this->dynamic_max_step_scale, 1.f - quality);
+
+    this->dynamic_quality = quality;
+    this->dynamic_step_scale = step_scale;
+    if (render_scale != this->render_scale) {
+        // the targets of the previous scale are not used anymore
+        for (auto it = this->reduced_fbos.begin(); it != this->reduced_fbos.end();) {
+            delete it->second;
+            it = this->reduced_fbos.erase(it);
+        }
+        this->render_scale = render_scale;
+    }
+    this->resetAccumulation();
+}
+
+// Groups the volumes whose world boxes overlap, each group is marched in a single pass over the union of its
+// ray segments. The groups and the volumes that cannot be merged are drawn back to front, as the blending needs
+void Application::renderMergedVolumes(const std::vector<VolumeNode*>& nodes)
+{
+    struct sVolumeGroup {
+        std::vector<VolumeNode*> nodes;
+        glm::vec3 box_min = glm::vec3(FLT_MAX);
+        glm::vec3 box_max = glm::vec3(-FLT_MAX);
+        bool mergeable = true;
+    };
+
+    std::vector<sVolumeGroup> groups;
+    for (auto* node : nodes) {
+        if (!node->visible || !node->material)
+            continue;
+        sVolumeGroup group;
+        group.nodes.push_back(node);
+        for (int i = 0; i < 8; i++) {
+            glm::vec3 corner = glm::vec3(node->model * glm::vec4(i & 1 ? 1.f : -1.f, i & 2 ? 1.f : -1.f, i & 4 ? 1.f : -1.f, 1.f));
+            group.box_min = glm::min(group.box_min, corner);
+            group.box_max = glm::max(group.box_max, corner);
+        }
+        auto* material = dynamic_cast<VolumeMaterial*>(node->material);
+        group.mergeable = material && material->canMerge();
+        groups.push_back(group);
+    }
+
+    // merges the groups until no two mergeable ones overlap, the boxes grow to the union of their nodes
+    bool merged = true;
+    while (merged) {
+        merged = false;
+        for (size_t i = 0; i < groups.size() && !merged; i++)
+            for (size_t j = i + 1; j < groups.size() && !merged; j++) {
+                sVolumeGroup& a = groups[i];
+                sVolumeGroup& b = groups[j];
+                bool overlap = glm::all(glm::lessThan(a.box_min, b.box_max)) && glm::all(glm::lessThan(b.box_min, a.box_max));
+                if (!overlap || !a.mergeable || !b.mergeable || a.nodes.size() + b.nodes.size() > MAX_MERGED_VOLUMES)
+                    continue;
+                a.nodes.insert(a.nodes.end(), b.nodes.begin(), b.nodes.end());
+                a.box_min = glm::min(a.box_min, b.box_min);
+                a.box_max = glm::max(a.box_max, b.box_max);
+                groups.erase(groups.begin() + j);
+                merged = true;
+            }
+    }
+
+    // back to front by the distance to the center of the box
+    glm::vec3 eye = this->camera->eye;
+    std::sort(groups.begin(), groups.end(), [&](const sVolumeGroup& a, const sVolumeGroup& b) {
+        return glm::length((a.box_min + a.box_max) * 0.5f - eye) > glm::length((b.box_min + b.box_max) * 0.5f - eye);
+    });
+
+    for (const sVolumeGroup& group : groups) {
+        if (group.nodes.size() == 1) {
+            group.nodes[0]->render(this->camera);
+            continue;
+        }
+        std::vector<VolumeMaterial*> materials;
+        std::vector<glm::mat4> models;
+        int quality_level = NUM_QUALITY_LEVELS - 1;
+        for (auto* node : group.nodes) {
+            materials.push_back((VolumeMaterial*)node->material);
+            models.push_back(node->model);
+            quality_level = std::min(quality_level, node->quality_level);
+        }
+        // the steps and jitter come from the first material, at the finest level of the group
+        materials[0]->quality_level = quality_level;
+        VolumeMaterial::renderMerged(materials, models, this->camera);
+    }
+}
+
+// The nodes that share a material, a mesh and a quality level go in one instanced draw, with the uniforms uploaded once. The
+// instances are sorted back to front, the blending of the overlapping ones depends on the order
+void Application::renderInstancedVolumes(const std::vector<VolumeNode*>& nodes)
+{
+    std::vector<std::tuple<VolumeMaterial*, Mesh*, int>> batch_keys;
+    std::vector<std::vector<VolumeNode*>> batches;
+    for (auto* node : nodes) {
+        auto* material = dynamic_cast<VolumeMaterial*>(node->material);
+        if (!node->visible || !material || !material->canInstance()) {
+            node->render(this->camera);
+            continue;
+        }
+        auto key = std::make_tuple(material, node->mesh, node->quality_level);
+        size_t batch = std::find(batch_keys.begin(), batch_keys.end(), key) - batch_keys.begin();
+        if (batch == batch_keys.size()) {
+            batch_keys.push_back(key);
+            batches.push_back({});
+        }
+        batches[batch].push_back(node);
+    }
+
+    glm::vec3 eye = this->camera->eye;
+    for (size_t i = 0; i < batches.size(); i++) {
+        std::vector<VolumeNode*>& batch = batches[i];
+        if (batch.size() == 1) {
+            batch[0]->render(this->camera);
+            continue;
+        }
+        std::sort(batch.begin(), batch.end(), [&](VolumeNode* a, VolumeNode* b) {
+            return glm::length(glm::vec3(a->model[3]) - eye) > glm::length(glm::vec3(b->model[3]) - eye);
+        });
+        std::vector<glm::mat4> models;
+        for (auto* node : batch)
+            models.push_back(node->model);
+        VolumeMaterial* material = std::get<0>(batch_keys[i]);
+        material->quality_level = std::get<2>(batch_keys[i]);
+        material->renderInstanced(std::get<1>(batch_keys[i]), models, this->camera);
+    }
+}
+
+// Fills the scene with copies of the first volume node, all sharing its material and mesh
+void Application::addVolumeInstances(int count)
+{
+    VolumeNode* source = NULL;
+    for (auto* node : this->node_list)
+        if (node->type == NODE_VOLUME && dynamic_cast<VolumeMaterial*>(node->material)) {
+            source = (VolumeNode*)node;
+            break;
+        }
+    if (!source)
+        return;
+
+    int instances = 0;
+    for (auto* node : this->node_list)
+        instances += node->material == source->material && node != source;
+
+    // a grid of clouds over the scene, each one a bit rotated and scaled
+    int side = (int)ceilf(sqrtf((float)(instances + count)));
+    for (int i = instances; i < instances + count; i++) {
+        VolumeNode* node = new VolumeNode(("Volume Instance " + std::to_string(i)).c_str());
+        node->mesh = source->mesh;
+        node->material = source->material;
+        glm::vec3 position = glm::vec3((i % side - side * 0.5f) * 2.5f, 3.f + 0.5f * (i % 3), (i / side - side * 0.5f) * 2.5f);
+        node->model = glm::translate(glm::mat4(1.f), position);
+        node->model = glm::rotate(node->model, 0.7f * i, glm::vec3(0.f, 1.f, 0.f));
+        node->model = glm::scale(node->model, glm::vec3(0.75f + 0.25f * (i % 2)));
+        this->node_list.push_back(node);
+    }
+    this->resetAccumulation();
+}
+
+void Application::renderProgressive()
+{
+    if (this->sceneChanged())
+        this->resetAccumulation();
+
+    // once converged the volumes are not rendered anymore, only the accumulated image is shown
+    if (this->accumulated_frames < this->progressive_max_frames) {
+        this->frame_fbo->bind();
+        this->renderScene();
+        this->frame_fbo->unbind();
+
+        // running average, the new frame weights 1 / (n + 1)
+        this->accumulation_fbo->bind();
+        glDisable(GL_DEPTH_TEST);
+        glDisable(GL_CULL_FACE);
+        glEnable(GL_BLEND);
+        glBlendColor(0.f, 0.f, 0.f, 1.f / (this->accumulated_frames + 1));
+        glBlendFunc(GL_CONSTANT_ALPHA, GL_ONE_MINUS_CONSTANT_ALPHA);
+        this->frame_fbo->color_textures[0]->toViewport();
+        glDisable(GL_BLEND);
+        this->accumulation_fbo->unbind();
+
+        this->accumulated_frames++;
+    }
+
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
+    this->accumulation_fbo->color_textures[0]->toViewport();
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_CULL_FACE);
+}
+
+// Reprojects the previous result to the current frame through its depth and the view-projection it was
+// rendered with, then keeps a running blend of both. The history is clamped to the color range of the 3x3
+// neighborhood of the new frame, so disoccluded or moved content does not leave ghosts behind
+void Application::renderTemporal()
+{
+    FBO* history = this->history_fbos[this->temporal_frame % 2];
+    FBO* target = this->history_fbos[(this->temporal_frame + 1) % 2];
+
+    target->bind();
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_CULL_FACE);
+
+    Shader* shader = Shader::Get("res/shaders/screen.vs", "res/shaders/temporal_reproject.fs");
+    shader->enable();
+    shader->setUniform("u_texture", this->frame_fbo->color_textures[0], 0);
+    shader->setUniform("u_history", history->color_textures[0], 1);
+    shader->setUniform("u_depth", this->frame_fbo->depth_texture, 2);
+    shader->setUniform("u_inverse_viewprojection", glm::inverse(this->camera->viewprojection_matrix));
+    shader->setUniform("u_previous_viewprojection", this->temporal_viewprojection);
+    shader->setUniform("u_texel_size", glm::vec2(1.f / this->frame_fbo->width, 1.f / this->frame_fbo->height));
+    shader->setUniform("u_blend", this->temporal_blend);
+    shader->setUniform("u_history_valid", this->temporal_history_valid);
+    Mesh::getQuad()->render(GL_TRIANGLES);
+    shader->disable();
+    target->unbind();
+
+    target->color_textures[0]->toViewport();
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_CULL_FACE);
+
+    this->temporal_viewprojection = this->camera->viewprojection_matrix;
+    this->temporal_history_valid = true;
+    this->temporal_frame++;
+}
+
+bool Application::sceneChanged()
+{
+    bool changed = this->camera->viewprojection_matrix != this->last_viewprojection;
+    this->last_viewprojection = this->camera->viewprojection_matrix;
+
+    if (this->last_models.size() != this->node_list.size()) {
+        this->last_models.resize(this->node_list.size());
+        changed = true;
+    }
+    for (size_t i = 0; i < this->node_list.size(); i++) {
+        if (this->node_list[i]->model != this->last_models[i]) {
+            this->last_models[i] = this->node_list[i]->model;
+            changed = true;
+        }
+    }
+
+    // materials are edited from the GUI: any active widget, and the frame after it is released, restarts
+    bool gui_active = ImGui::IsAnyItemActive();
+    changed |= gui_active || this->gui_was_active;
+    this->gui_was_active = gui_active;
+
+    return changed;
 }
 
 void Application::renderGUI()
@@ -111,14 +640,54 @@ void Application::renderGUI()
     {
         ImGui::ColorEdit3("Ambient light", (float*)&this->ambient_light);
 
-        if (ImGui::ColorEdit3("Background color", (float*)&this->background_color)) {
-            for (auto* node : node_list) {
-                if (node->type == NODE_VOLUME) {
-                    VolumeMaterial* volumematerial = (VolumeMaterial*)node->material;
-                    volumematerial->background_color = this->background_color;
-                }
-            }
+        // the volumes blend over the cleared background, nothing to update in them
+        ImGui::ColorEdit3("Background color", (float*)&this->background_color);
+
+        if (ImGui::Button("Benchmark shader variants"))
+            this->benchmark_requested = true;
+
+        // both reuse the jittered frames, only one of them at a time
+        if (ImGui::Checkbox("Progressive rendering", &this->use_progressive) && this->use_progressive)
+            this->use_temporal = false;
+        if (this->use_progressive) {
+            ImGui::SliderInt("Max accumulated frames", &this->progressive_max_frames, 1, 1024);
+            ImGui::SliderFloat("Progressive step scale", &this->progressive_step_scale, 1.0f, 8.0f);
+            ImGui::Text("Accumulated frames: %d", this->accumulated_frames);
+        }
+        if (ImGui::Checkbox("Temporal reprojection", &this->use_temporal)) {
+            if (this->use_temporal)
+                this->use_progressive = false;
+            this->temporal_history_valid = false;
         }
+        if (this->use_temporal) {
+            ImGui::SliderFloat("Temporal blend", &this->temporal_blend, 0.02f, 1.0f);
+            ImGui::SliderFloat("Temporal step scale", &this->temporal_step_scale, 1.0f, 8.0f);
+        }
+
+        // the volume passes follow a GPU time budget, between full quality and the bounds
+        if (ImGui::Checkbox("Dynamic resolution", &this->use_dynamic_resolution)) {
+            this->dynamic_quality = 1.f;
+            this->render_scale = 1.f;
+            this->dynamic_step_scale = 1.f;
+            this->resetAccumulation();
+        }
+        if (this->use_dynamic_resolution) {
+            ImGui::SliderFloat("Volume budget (ms)", &this->dynamic_budget_ms, 1.0f, 50.0f);
+            ImGui::SliderFloat("Hysteresis", &this->dynamic_hysteresis, 0.0f, 0.5f);
+            ImGui::SliderFloat("Min render scale", &this->dynamic_min_render_scale, DYNAMIC_SCALE_STEP, 1.0f);
+            ImGui::SliderFloat("Max step scale", &this->dynamic_max_step_scale, 1.0f, 8.0f);
+            ImGui::Text("Volumes %.2f ms, render scale %.3f, step scale %.2f", this->volume_pass_ms, this->render_scale, this->dynamic_step_scale);
+        }
+
+        if (ImGui::Checkbox("Merge overlapping volumes", &this->use_merged_volumes))
+            this->resetAccumulation();
+        ImGui::Checkbox("Instance shared volumes", &this->use_instancing);
+        if (ImGui::Checkbox("Footprint LOD", &this->use_footprint_lod))
+            this->resetAccumulation();
+        if (this->use_footprint_lod)
+            ImGui::SliderFloat("Full quality footprint", &this->footprint_full_quality, 0.001f, 0.5f, "%.3f");
+        if (ImGui::Button("Add 16 volume instances"))
+            this->addVolumeInstances(16);
 
         if (ImGui::TreeNode("Camera")) {
             this->camera->renderInMenu();
@@ -173,6 +742,155 @@ void Application::renderGUI()
 
 void Application::shutdown() { }
 
+// Renders every volume node with each combination of settings, first with the generic shader and then with its
+// specialized variant, and prints the GPU cost per shaded pixel of both
+void Application::benchmarkShaderVariants()
+{
+    const int draws = 16;
+    const char* shader_names[] = { "ABSORPTION", "EMISSION_ABSORPTION", "EMISSION_SCATTER_ABSORPTION" };
+    const char* density_names[] = { "CONSTANT", "NOISE_3D", "VDB_FILE" };
+
+    GPUTimer timer;
+    GLuint samples_query;
+    glGenQueries(1, &samples_query);
+
+    // every draw has to shade the same pixels, the depth test would discard all but the first
+    glDisable(GL_DEPTH_TEST);
+
+    auto measure = [&](SceneNode* node, Material* material, bool variants) {
+        material->use_shader_variants = variants;
+
+        // compiles the shader and bakes the textures out of the timing
+        node->render(this->camera);
+        glFinish();
+
+        glBeginQuery(GL_SAMPLES_PASSED, samples_query);
+        timer.begin();
+        for (int i = 0; i < draws; i++)
+            node->render(this->camera);
+        timer.end();
+        glEndQuery(GL_SAMPLES_PASSED);
+
+        GLuint64 samples = 0;
+        glGetQueryObjectui64v(samples_query, GL_QUERY_RESULT, &samples);
+        return samples ? timer.getMilliseconds() * 1e6 / (double)samples : 0.0; // ns per pixel
+    };
+
+    auto report = [&](SceneNode* node, Material* material, const std::string& setting) {
+        double generic = measure(node, material, false);
+        double variant = measure(node, material, true);
+        double gain = generic > 0.0 ? 100.0 * (generic - variant) / generic : 0.0;
+        printf("  %-24s %-70s generic %8.3f ns/px  variant %8.3f ns/px  gain %6.2f%%\n", node->name.c_str(), setting.c_str(), generic, variant, gain);
+    };
+
+    std::cout << " + Shader variants benchmark, " << draws << " draws per setting" << std::endl;
+    for (auto* node : this->node_list) {
+        if (auto* material = dynamic_cast<VolumeMaterial*>(node->material)) {
+            VolumeMaterial::eShaderType shader_type_saved = material->shaderType;
+            VolumeMaterial::eDensityType density_type_saved = material->densityType;
+            bool use_jittering = material->use_jittering;
+            bool use_phase_function = material->use_phase_function;
+            bool use_adaptive_stepping = material->use_adaptive_stepping;
+            bool use_shader_variants = material->use_shader_variants;
+            for (int shader_type = 0; shader_type < 3; shader_type++)
+                for (int density_type = 0; density_type < 3; density_type++)
+                    for (int jittering = 0; jittering < 2; jittering++)
+                        for (int phase_function = 0; phase_function < (shader_type == VolumeMaterial::EMISSION_SCATTER_ABSORPTION ? 2 : 1); phase_function++)
+                            for (int adaptive_stepping = 0; adaptive_stepping < 2; adaptive_stepping++) {
+                                material->shaderType = (VolumeMaterial::eShaderType)shader_type;
+                                material->densityType = (VolumeMaterial::eDensityType)density_type;
+                                material->use_jittering = jittering;
+                                material->use_phase_function = phase_function;
+                                material->use_adaptive_stepping = adaptive_stepping;
+                                report(node, material, std::string(shader_names[shader_type]) + " " + density_names[density_type] + " jitter:" + std::to_string(jittering) + " phase:" + std::to_string(phase_function) + " adaptive:" + std::to_string(adaptive_stepping));
+                            }
+            material->shaderType = shader_type_saved;
+            material->densityType = density_type_saved;
+            material->use_jittering = use_jittering;
+            material->use_phase_function = use_phase_function;
+            material->use_adaptive_stepping = use_adaptive_stepping;
+            material->use_shader_variants = use_shader_variants;
+        }
+        else if (auto* material = dynamic_cast<IsosurfaceMaterial*>(node->material)) {
+            IsosurfaceMaterial::eDensityType density_type_saved = material->densityType;
+            bool use_jittering = material->use_jittering;
+            bool activate_illumination = material->activate_illumination;
+            bool use_shader_variants = material->use_shader_variants;
+            for (int density = 0; density < 3; density++)
+                for (int jittering = 0; jittering < 2; jittering++)
+                    for (int illumination = 0; illumination < 2; illumination++) {
+                        material->densityType = (IsosurfaceMaterial::eDensityType)density;
+                        material->use_jittering = jittering;
+                        material->activate_illumination = illumination;
+                        report(node, material, std::string("ISOSURFACE ") + density_names[density] + " jitter:" + std::to_string(jittering) + " illumination:" + std::to_string(illumination));
+                    }
+            material->densityType = density_type_saved;
+            material->use_jittering = use_jittering;
+            material->activate_illumination = activate_illumination;
+            material->use_shader_variants = use_shader_variants;
+        }
+    }
+
+    glEnable(GL_DEPTH_TEST);
+    glDeleteQueries(1, &samples_query);
+}
+
+// Renders every volume node the tiled compute marcher supports with the fragment shaders and with the compute
+// shader, and prints the GPU time per frame of both (the compute one includes the composite)
+void Application::benchmarkComputeRenderer()
+{
+    const int draws = 16;
+    const char* shader_names[] = { "ABSORPTION", "EMISSION_ABSORPTION" };
+    const char* density_names[] = { "CONSTANT", "NOISE_3D", "VDB_FILE" };
+
+    GPUTimer timer;
+    glDisable(GL_DEPTH_TEST);
+
+    auto measure = [&](SceneNode* node, VolumeMaterial* material, bool compute) {
+        material->use_compute = compute;
+
+        // compiles the shader and bakes the textures out of the timing
+        node->render(this->camera);
+        glFinish();
+
+        timer.begin();
+        for (int i = 0; i < draws; i++)
+            node->render(this->camera);
+        timer.end();
+        return timer.getMilliseconds() / (double)draws;
+    };
+
+    std::cout << " + Compute renderer benchmark, " << draws << " draws per setting" << std::endl;
+    for (auto* node : this->node_list) {
+        auto* material = dynamic_cast<VolumeMaterial*>(node->material);
+        if (!material)
+            continue;
+
+        VolumeMaterial::eShaderType shader_type_saved = material->shaderType;
+        VolumeMaterial::eDensityType density_type_saved = material->densityType;
+        bool use_tracking = material->use_tracking;
+        bool use_compute = material->use_compute;
+        material->use_tracking = false;
+        for (int shader_type = 0; shader_type < 2; shader_type++)
+            for (int density_type = 0; density_type < 3; density_type++) {
+                material->shaderType = (VolumeMaterial::eShaderType)shader_type;
+                material->densityType = (VolumeMaterial::eDensityType)density_type;
+                double fragment = measure(node, material, false);
+                double compute = measure(node, material, true);
+                double gain = fragment > 0.0 ? 100.0 * (fragment - compute) / fragment : 0.0;
+                std::string setting = std::string(shader_names[shader_type]) + " " + density_names[density_type];
+                printf("  %-24s %-32s fragment %8.3f ms  compute %8.3f ms  gain %6.2f%%\n", node->name.c_str(), setting.c_str(), fragment, compute, gain);
+            }
+        material->shaderType = shader_type_saved;
+        material->densityType = density_type_saved;
+        material->use_tracking = use_tracking;
+        material->use_compute = use_compute;
+    }
+    fflush(stdout);
+
+    glEnable(GL_DEPTH_TEST);
+}
+
 // keycodes: https://www.glfw.org/docs/3.3/group__keys.html
 void Application::onKeyDown(int key, int scancode)
 {
@@ -183,6 +901,9 @@ void Application::onKeyDown(int key, int scancode)
     case GLFW_KEY_R:
         Shader::ReloadAll();
         break;
+    case GLFW_KEY_B:
+        this->benchmark_requested = true;
+        break;
     }
 }
 
@@ -4,8 +4,13 @@
 #include "framework/camera.h"
 #include "framework/scenenode.h"
 #include "framework/light.h"
+#include "graphics/fbo.h"
 
 #include <glm/vec2.hpp>
+#include <map>
+
+#define DYNAMIC_TIMER_QUERIES 3 //the GPU time of a frame is read a few frames later, without stalling
+#define DYNAMIC_SCALE_STEP 0.125f //the render scale is quantized, every scale has its own target
 
 class Application
 {
@@ -30,6 +35,69 @@ public:
 	bool flag_wireframe;
 
 	bool close = false;
+	unsigned int frame_count = 0; //scenes rendered, the per frame work of the materials runs once for each
+	bool benchmark_requested = false;
+	bool exit_after_benchmark = false; //--benchmark in the command line, for headless runs (llvmpipe)
+
+	//progressive rendering: jittered frames are averaged in accumulation_fbo while the scene does not change
+	bool use_progressive = false;
+	int progressive_max_frames = 256;
+	float progressive_step_scale = 2.0f;
+	int accumulated_frames = 0;
+	FBO* frame_fbo = NULL;
+	FBO* accumulation_fbo = NULL;
+
+	//temporal reprojection: the history is reprojected with temporal_viewprojection, clamped to the neighborhood
+	//of the new frame and blended with it, so the camera can move while the coarser jittered frames converge
+	bool use_temporal = false;
+	float temporal_blend = 0.1f;
+	float temporal_step_scale = 2.0f;
+	int temporal_frame = 0;
+	bool temporal_history_valid = false;
+	FBO* history_fbos[2] = { NULL, NULL };
+	glm::mat4 temporal_viewprojection;
+
+	//volume nodes with resolution_divisor > 1 (or with a dynamic render scale below 1) are rendered in
+	//reduced_fbos[percent of the frame size] and upsampled with depth_fbo
+	FBO* depth_fbo = NULL;
+	std::map<int, FBO*> reduced_fbos;
+
+	//dynamic resolution: the GPU time of the volume passes is measured every frame, and a quality level sets the
+	//render scale of the volumes and the scale of their steps to keep it within dynamic_budget_ms. The level only
+	//moves when the time leaves the hysteresis band around the budget, and it drops faster than it recovers
+	bool use_dynamic_resolution = false;
+	float dynamic_budget_ms = 16.6f;
+	float dynamic_hysteresis = 0.1f; //fraction of the budget
+	float dynamic_min_render_scale = 0.5f;
+	float dynamic_max_step_scale = 4.0f;
+	float dynamic_quality = 1.0f; //1 is full resolution and steps, 0 the bounds above
+	float render_scale = 1.0f;
+	float dynamic_step_scale = 1.0f;
+	double volume_pass_ms = 0.0;
+	GPUTimer volume_timers[DYNAMIC_TIMER_QUERIES];
+	bool volume_timer_pending[DYNAMIC_TIMER_QUERIES] = {};
+	int volume_timer_frame = 0;
+
+	//copy of the depth of the opaque nodes while the volumes of an offscreen frame are rendered, NULL otherwise
+	Texture* scene_depth = NULL;
+
+	//overlapping volume nodes (at full resolution) are marched together in one pass, and every volume is
+	//composited back to front. The merged pass reads the scene depth, so the frame is rendered offscreen
+	bool use_merged_volumes = false;
+
+	//volume nodes that share their material and mesh are drawn with a single instanced draw call
+	bool use_instancing = true;
+
+	//footprint LOD: every volume node gets a quality level from the fraction of the viewport its projected box
+	//covers, the full quality down to footprint_full_quality and one level more every time it is 4 times smaller
+	bool use_footprint_lod = false;
+	float footprint_full_quality = 1.f / 16.f;
+
+	//volume nodes with up to date deep opacity maps this frame, the meshes read them for their shadows
+	std::vector<SceneNode*> shadow_volumes;
+	glm::mat4 last_viewprojection;
+	std::vector<glm::mat4> last_models;
+	bool gui_was_active = false;
 	bool dragging;
 	glm::vec2 mousePosition;
 	glm::vec2 lastMousePosition;
@@ -37,9 +105,24 @@ public:
 	void init(GLFWwindow* window);
 	void update(float dt);
 	void render();
+	void renderScene();
+	void renderReducedVolume(VolumeNode* node);
+	void updateDynamicResolution();
+	void updateQualityLevels(const std::vector<VolumeNode*>& nodes);
+	void renderMergedVolumes(const std::vector<VolumeNode*>& nodes);
+	void renderInstancedVolumes(const std::vector<VolumeNode*>& nodes);
+	void addVolumeInstances(int count);
+	void updateFrameBuffers();
+	void renderProgressive();
+	void renderTemporal();
+	void resetAccumulation() { this->accumulated_frames = 0; this->temporal_history_valid = false; }
+	bool sceneChanged();
 	void renderGUI();
 	void shutdown();
 
+	void benchmarkShaderVariants();
+	void benchmarkComputeRenderer();
+
 	void onKeyDown(int key, int scancode);
 	void onKeyUp(int key, int scancode);
 	void onRightMouseDown();
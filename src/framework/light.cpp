@@ -2,6 +2,8 @@
 
 #include "ImGuizmo.h"
 
+#include <algorithm>
+
 Light::Light(glm::vec3 position, eLightType type, float intensity, glm::vec4 color)
 {
 	this->type = NODE_LIGHT;
@@ -42,6 +44,33 @@ void Light::setUniforms(Shader* shader, const glm::mat4& model)
 	shader->setUniform("u_local_light_position", local_pos);
 }
 
+int Light::uploadLightBlock(const std::vector<Light*>& lights, const glm::mat4& model)
+{
+	static GLuint buffer = 0;
+	if (!buffer) {
+		glGenBuffers(1, &buffer);
+		glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+		glBufferData(GL_UNIFORM_BUFFER, sizeof(sLightData) * MAX_LIGHTS, NULL, GL_DYNAMIC_DRAW);
+	}
+
+	int num_lights = std::min((int)lights.size(), MAX_LIGHTS);
+	sLightData data[MAX_LIGHTS];
+	glm::mat4 inverseModel = glm::inverse(model);
+	for (int i = 0; i < num_lights; i++) {
+		Light* light = lights[i];
+		glm::vec4 local_pos = inverseModel * glm::vec4(light->model[3][0], light->model[3][1], light->model[3][2], 1.0);
+		data[i].position = glm::vec4(glm::vec3(local_pos) / local_pos.w, 1.0f);
+		data[i].color = glm::vec4(glm::vec3(light->color) * light->intensity, 1.0f);
+	}
+
+	glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+	if (num_lights)
+		glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(sLightData) * num_lights, data);
+	glBindBufferBase(GL_UNIFORM_BUFFER, LIGHT_BLOCK_BINDING, buffer);
+	glBindBuffer(GL_UNIFORM_BUFFER, 0);
+	return num_lights;
+}
+
 void Light::renderInMenu()
 {
 	glm::vec3 front = glm::vec3(model[2][0], model[2][1], model[2][2]);
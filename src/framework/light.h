@@ -4,6 +4,16 @@
 
 enum eLightType { LIGHT_DIRECTIONAL, LIGHT_POINT, LIGHT_SPOT };
 
+#define MAX_LIGHTS 8 //size of the light array of the volume shaders, it has to match their MAX_LIGHTS
+#define LIGHT_BLOCK_BINDING 0 //uniform buffer binding of that array (LightBlock)
+
+//one light of the LightBlock uniform buffer (std140 layout)
+struct sLightData
+{
+	glm::vec4 position; //local to the node being rendered, w unused
+	glm::vec4 color; //rgb scaled by the intensity
+};
+
 class Light : public SceneNode {
 public:
 
@@ -18,5 +28,9 @@ public:
 	Light(glm::vec3 position = glm::vec3(0.f), eLightType type = LIGHT_DIRECTIONAL, float intensity = 1.f, glm::vec4 color = glm::vec4(1.f));
 
 	void setUniforms(Shader* shader, const glm::mat4& model);
+
+	//fills the LightBlock buffer with the first MAX_LIGHTS lights in the local space of model and binds it,
+	//all the lights go in a single draw. Returns the number of lights uploaded
+	static int uploadLightBlock(const std::vector<Light*>& lights, const glm::mat4& model);
 	void renderInMenu();
 };
\ No newline at end of file
@@ -80,12 +80,21 @@ VolumeNode::~VolumeNode() { }
 
 void VolumeNode::render(Camera* camera)
 {
-	if (this->material && this->visible)
+	if (this->material && this->visible) {
+		// the material can be shared with other nodes at other levels
+		this->material->quality_level = this->quality_level;
+		this->material->node = this;
 		this->material->render(this->mesh, this->model, camera);
+	}
 }
 
 void VolumeNode::renderInMenu()
 {
+	int resolution = this->resolution_divisor == 4 ? 2 : this->resolution_divisor - 1;
+	if (ImGui::Combo("Resolution", &resolution, "FULL\0HALF\0QUARTER\0"))
+		this->resolution_divisor = 1 << resolution;
+	ImGui::Text("Footprint: %.2f%% of the screen, quality level %d", this->footprint * 100.f, this->quality_level);
+
 	// Model edit
 	if (ImGui::TreeNode("Model"))
 	{
@@ -38,6 +38,13 @@ class VolumeNode : public SceneNode
 {
 public:
 
+	int resolution_divisor = 1; //1, 2 or 4: rendered at full, half or quarter resolution and upsampled
+
+	//fraction of the viewport covered by the projected box, and the quality level picked from it (see
+	//Application::updateQualityLevels), 0 while the footprint LOD is off
+	float footprint = 1.f;
+	int quality_level = 0;
+
 	VolumeNode();
 	VolumeNode(const char* name);
 	~VolumeNode();
@@ -15,6 +15,9 @@
 
 #include <glm/gtx/transform.hpp>
 
+#include <thread>
+#include <algorithm>
+
 long getTime()
 {
 	#ifdef _WIN32
@@ -81,6 +84,41 @@ glm::vec3 transformQuat(const glm::vec3& a, const glm::quat& q)
 	return out;
 }
 
+int getNumThreads()
+{
+	unsigned int num_threads = std::thread::hardware_concurrency();
+	return num_threads ? (int)num_threads : 1;
+}
+
+void parallelFor(int begin, int end, const std::function<void(int, int, int)>& func)
+{
+	int count = end - begin;
+	if (count <= 0)
+		return;
+
+	int num_threads = std::min(getNumThreads(), count);
+	if (num_threads == 1) {
+		func(begin, end, 0);
+		return;
+	}
+
+	// the calling thread takes the first chunk, the rest go to workers
+	int chunk = (count + num_threads - 1) / num_threads;
+	std::vector<std::thread> workers;
+	for (int i = 1; i < num_threads; i++) {
+		int first = begin + i * chunk;
+		int last = std::min(first + chunk, end);
+		if (first >= last)
+			break;
+		workers.emplace_back(func, first, last, i);
+	}
+
+	func(begin, std::min(begin + chunk, end), 0);
+
+	for (auto& worker : workers)
+		worker.join();
+}
+
 //this function is used to access OpenGL Extensions (special features not supported by all cards)
 //void* getGLProcAddress(const char* name)
 //{
@@ -211,6 +249,42 @@ bool checkGLErrors()
 	return true;
 }
 
+GPUTimer::~GPUTimer()
+{
+	if (this->query)
+		glDeleteQueries(1, &this->query);
+}
+
+void GPUTimer::begin()
+{
+	if (!this->query)
+		glGenQueries(1, &this->query);
+	glBeginQuery(GL_TIME_ELAPSED, this->query);
+}
+
+void GPUTimer::end()
+{
+	glEndQuery(GL_TIME_ELAPSED);
+}
+
+bool GPUTimer::isAvailable()
+{
+	GLint available = 0;
+	if (this->query)
+		glGetQueryObjectiv(this->query, GL_QUERY_RESULT_AVAILABLE, &available);
+	return available != 0;
+}
+
+double GPUTimer::getMilliseconds()
+{
+	if (!this->query)
+		return 0.0;
+
+	GLuint64 nanoseconds = 0;
+	glGetQueryObjectui64v(this->query, GL_QUERY_RESULT, &nanoseconds);
+	return nanoseconds * 1e-6;
+}
+
 std::vector<std::string>& split(const std::string& s, char delim, std::vector<std::string>& elems) {
 	std::stringstream ss(s);
 	std::string item;
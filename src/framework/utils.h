@@ -7,6 +7,7 @@
 #include <string>
 #include <sstream>
 #include <vector>
+#include <functional>
 
 #include <glm/vec3.hpp>
 #include <glm/gtx/quaternion.hpp>
@@ -23,9 +24,29 @@ bool readFile(const std::string& filename, std::string& content);
 void drawGrid();
 glm::vec3 transformQuat(const glm::vec3& a, const glm::quat& q);
 
+//multithreading: splits [begin, end) in contiguous chunks and calls func(first, last, thread_id) for each one in parallel
+int getNumThreads();
+void parallelFor(int begin, int end, const std::function<void(int, int, int)>& func);
+
 //check opengl errors
 bool checkGLErrors();
 
+//GPU time of the commands issued between begin and end (GL_TIME_ELAPSED query)
+class GPUTimer
+{
+public:
+	GPUTimer() {};
+	~GPUTimer();
+
+	void begin();
+	void end();
+	bool isAvailable(); //the result can be read without stalling
+	double getMilliseconds(); //waits for the GPU if the result is not available yet
+
+private:
+	unsigned int query = 0;
+};
+
 std::string getPath();
 
 //Vector2 getDesktopSize(int display_index = 0);
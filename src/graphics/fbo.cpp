@@ -0,0 +1,97 @@
+#include "fbo.h"
+
+#include "texture.h"
+#include "../framework/utils.h"
+
+#include <cassert>
+#include <iostream>
+
+FBO::FBO()
+{
+	fbo_id = 0;
+	for (int i = 0; i < MAX_FBO_TEXTURES; i++)
+		color_textures[i] = NULL;
+	depth_texture = NULL;
+	num_color_textures = 0;
+	width = 0;
+	height = 0;
+	old_fbo = 0;
+}
+
+FBO::~FBO()
+{
+	freeTextures();
+	if (fbo_id)
+		glDeleteFramebuffers(1, &fbo_id);
+}
+
+bool FBO::create(int width, int height, int num_textures, unsigned int format, unsigned int type, unsigned int internal_format, bool use_depth_texture)
+{
+	assert(width && height && "FBO must have a size");
+	assert(num_textures >= 0 && num_textures <= MAX_FBO_TEXTURES);
+
+	freeTextures();
+
+	this->width = width;
+	this->height = height;
+	this->num_color_textures = num_textures;
+
+	if (!this->fbo_id)
+		glGenFramebuffers(1, &this->fbo_id);
+	glBindFramebuffer(GL_FRAMEBUFFER, this->fbo_id);
+
+	GLenum buffers[MAX_FBO_TEXTURES];
+	for (int i = 0; i < num_textures; i++) {
+		this->color_textures[i] = new Texture(width, height, format, type, false, NULL, internal_format);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + i, GL_TEXTURE_2D, this->color_textures[i]->texture_id, 0);
+		buffers[i] = GL_COLOR_ATTACHMENT0 + i;
+	}
+	if (num_textures)
+		glDrawBuffers(num_textures, buffers);
+	else
+		glDrawBuffer(GL_NONE); //depth only
+
+	if (use_depth_texture) {
+		this->depth_texture = new Texture(width, height, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, false, NULL, GL_DEPTH_COMPONENT24);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, this->depth_texture->texture_id, 0);
+	}
+
+	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	if (status != GL_FRAMEBUFFER_COMPLETE) {
+		std::cerr << "[ERROR] FBO incomplete: " << status << std::endl;
+		return false;
+	}
+
+	assert(checkGLErrors() && "Error creating FBO");
+	return true;
+}
+
+void FBO::freeTextures()
+{
+	for (int i = 0; i < MAX_FBO_TEXTURES; i++) {
+		delete this->color_textures[i];
+		this->color_textures[i] = NULL;
+	}
+	delete this->depth_texture;
+	this->depth_texture = NULL;
+	this->num_color_textures = 0;
+}
+
+void FBO::bind()
+{
+	assert(this->fbo_id && "FBO not created");
+
+	glGetIntegerv(GL_FRAMEBUFFER_BINDING, &this->old_fbo);
+	glGetIntegerv(GL_VIEWPORT, this->old_viewport);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, this->fbo_id);
+	glViewport(0, 0, this->width, this->height);
+}
+
+void FBO::unbind()
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, this->old_fbo);
+	glViewport(this->old_viewport[0], this->old_viewport[1], this->old_viewport[2], this->old_viewport[3]);
+}
@@ -0,0 +1,35 @@
+/*  Offscreen render target: up to MAX_FBO_TEXTURES color textures (none for depth only) and an optional depth texture.
+	bind() redirects the rendering and the viewport to it, unbind() restores the previous ones.
+*/
+
+#pragma once
+
+#include "../framework/includes.h"
+
+#define MAX_FBO_TEXTURES 4
+
+class Texture;
+
+class FBO
+{
+public:
+	GLuint fbo_id;
+	Texture* color_textures[MAX_FBO_TEXTURES];
+	Texture* depth_texture;
+	int num_color_textures;
+	int width;
+	int height;
+
+	FBO();
+	~FBO();
+
+	bool create(int width, int height, int num_textures = 1, unsigned int format = GL_RGBA, unsigned int type = GL_UNSIGNED_BYTE, unsigned int internal_format = 0, bool use_depth_texture = true);
+	void freeTextures();
+
+	void bind();
+	void unbind();
+
+private:
+	GLint old_fbo;
+	GLint old_viewport[4];
+};
@@ -5,7 +5,15 @@
 #include <istream>
 #include <fstream>
 #include <algorithm>
+#include <cfloat>
 
+int Material::volume_uploads = 0;
+
+// every material can page a scanned volume in, whichever subclass is deleted
+Material::~Material()
+{
+	this->releaseVirtualVolume();
+}
 
 glm::vec3 Material::GetInverseCameraPos(Camera* camera, glm::mat4 model){
 	if (use_local_pos) {
@@ -20,20 +28,303 @@ glm::vec3 Material::GetInverseCameraPos(Camera* camera, glm::mat4 model){
 	}
 }
 
+void Material::loadVolume(std::string file_path)
+{
+	this->releaseVirtualVolume();
+	std::string ext = file_path.substr(file_path.find_last_of(".") + 1);
+	if (ext == "ply" || ext == "PLY" || ext == "pts" || ext == "PTS")
+		loadParticles(file_path);
+	else if (ext == "raw" || ext == "nrrd" || ext == "nhdr")
+		loadRawVolume(file_path);
+	else
+		loadVDB(file_path);
+}
+
 void Material::loadVDB(std::string file_path)
 {
 	easyVDB::OpenVDBReader* vdbReader = new easyVDB::OpenVDBReader();
 	vdbReader->read(file_path);
 
 	// now, read the grid from the vdbReader and store the data in a 3D texture
+	// the reader is kept to re-voxelize when the resolution or radius change
+	this->vdb_reader = vdbReader;
 	estimate3DTexture(vdbReader);
 }
 
+void Material::loadParticles(std::string file_path)
+{
+	if (!::loadParticles(file_path, this->particles))
+		return;
+
+	// same as the VDB: first splat blocks, later ones run from the voxelization menu
+	VolumeData volume;
+	splatParticles(this->particles, volume, this->vdb_resolution, this->vdb_radius);
+	this->uploadFileVolume(volume);
+}
+
+void Material::loadRawVolume(std::string file_path)
+{
+	this->raw_path = file_path;
+	this->releaseVirtualVolume();
+
+	// the size in the header picks the path, so the file is mapped only once and with the access pattern of that path
+	RawVolumeFile header;
+	if (!header.readSize(file_path))
+		return;
+	if (this->supports_virtual_texture && (this->use_virtual_texture || (size_t)header.width * header.height * header.depth > VIRTUAL_TEXTURE_MIN_VOXELS)) {
+		this->loadVirtualVolume(file_path);
+		return;
+	}
+
+	// the mapped file goes straight to the driver, it is unmapped when raw goes out of scope
+	RawVolumeFile raw;
+	if (!raw.load(file_path))
+		return;
+
+	if (!this->texture)
+		this->texture = new Texture();
+	this->texture->create3DRaw(raw.width, raw.height, raw.depth, raw.bytes_per_voxel == 2 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE, raw.voxels(), raw.big_endian && raw.bytes_per_voxel == 2);
+
+	VolumeData majorants;
+	buildMajorantGrid(raw, majorants);
+	this->majorant_texture = uploadMajorantTexture(this->majorant_texture, majorants);
+
+	this->raw_volume = true;
+	Material::volume_uploads++;
+	Application::instance->resetAccumulation();
+}
+
+// Pages the scanned volume in as virtual texture, for the ones too large for a single 3D texture
+void Material::loadVirtualVolume(std::string file_path)
+{
+	VirtualVolume* volume = new VirtualVolume();
+	if (!volume->load(file_path, this->virtual_atlas_slots)) {
+		delete volume;
+		return;
+	}
+	const RawVolumeFile& raw = volume->file;
+	this->virtual_volume = volume;
+	this->use_virtual_texture = true;
+
+	// the coarse level stays resident, every pass without virtual texturing samples it. 16 bit like the bricks, the
+	// window can stretch a narrow range of values
+	VolumeData fallback;
+	volume->buildLevel(volume->fallbackLevel(), fallback);
+	this->texture = uploadVolumeTexture(this->texture, fallback, GL_R16);
+
+	// the tracking needs the majorants of the whole volume, one sequential read of the file
+	VolumeData majorants;
+	buildMajorantGrid(raw, majorants);
+	this->majorant_texture = uploadMajorantTexture(this->majorant_texture, majorants);
+
+	int atlas_size = this->virtual_atlas_slots * VIRTUAL_BRICK_TEXELS;
+	this->brick_atlas = new Texture();
+	this->brick_atlas->create3D(atlas_size, atlas_size, atlas_size, GL_RED, GL_FLOAT, false, (float*)NULL, GL_R16);
+
+	std::vector<uint32_t> zeros(volume->num_bricks, 0);
+	glGenBuffers(1, &this->page_table_buffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->page_table_buffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, zeros.size() * sizeof(uint32_t), zeros.data(), GL_DYNAMIC_DRAW);
+	glGenBuffers(1, &this->feedback_buffer);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->feedback_buffer);
+	glBufferData(GL_SHADER_STORAGE_BUFFER, zeros.size() * sizeof(uint32_t), zeros.data(), GL_DYNAMIC_COPY);
+	glGenBuffers(VIRTUAL_FEEDBACK_READBACKS, this->feedback_readbacks);
+	for (int i = 0; i < VIRTUAL_FEEDBACK_READBACKS; i++) {
+		glBindBuffer(GL_COPY_WRITE_BUFFER, this->feedback_readbacks[i]);
+		glBufferData(GL_COPY_WRITE_BUFFER, zeros.size() * sizeof(uint32_t), NULL, GL_STREAM_READ);
+	}
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	this->virtual_frame = 1;
+	this->virtual_update_frame = Application::instance->frame_count;
+
+	std::cout << " + Virtual texture: " << volume->levels << " levels, " << volume->num_bricks << " bricks, " << volume->slot_bricks.size() << " slots" << std::endl;
+	this->raw_volume = true;
+	Material::volume_uploads++;
+	Application::instance->resetAccumulation();
+}
+
+void Material::releaseVirtualVolume()
+{
+	delete this->virtual_volume;
+	delete this->brick_atlas;
+	if (this->page_table_buffer)
+		glDeleteBuffers(1, &this->page_table_buffer);
+	if (this->feedback_buffer)
+		glDeleteBuffers(1, &this->feedback_buffer);
+	if (this->feedback_readbacks[0])
+		glDeleteBuffers(VIRTUAL_FEEDBACK_READBACKS, this->feedback_readbacks);
+	for (int i = 0; i < VIRTUAL_FEEDBACK_READBACKS; i++) {
+		if (this->feedback_fences[i])
+			glDeleteSync(this->feedback_fences[i]);
+		this->feedback_readbacks[i] = 0;
+		this->feedback_fences[i] = NULL;
+	}
+	this->virtual_volume = NULL;
+	this->brick_atlas = NULL;
+	this->page_table_buffer = 0;
+	this->feedback_buffer = 0;
+}
+
+// Once per frame: the feedback the draws of the last frame stamped is copied to a readback buffer behind a fence, and
+// the oldest copy whose fence has signaled pages in the missing bricks, evicting the least recently used. Every node
+// that shares the material stamps the same frame, so the bricks of one are never evicted for another
+void Material::updateVirtualTexture()
+{
+	VirtualVolume* volume = this->virtual_volume;
+	unsigned int frame_count = Application::instance->frame_count;
+	if (!volume || this->virtual_update_frame == frame_count)
+		return;
+	this->virtual_update_frame = frame_count;
+
+	// the oldest copy is read before its buffer is reused, it is skipped if the GPU is still that far behind
+	int index = this->feedback_readback_index;
+	this->feedback_readback_index = (index + 1) % VIRTUAL_FEEDBACK_READBACKS;
+	std::vector<int> uploads;
+	if (GLsync fence = this->feedback_fences[index]) {
+		GLenum status = glClientWaitSync(fence, 0, 0);
+		if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+			std::vector<uint32_t> feedback(volume->num_bricks);
+			glBindBuffer(GL_COPY_READ_BUFFER, this->feedback_readbacks[index]);
+			glGetBufferSubData(GL_COPY_READ_BUFFER, 0, feedback.size() * sizeof(uint32_t), feedback.data());
+			glBindBuffer(GL_COPY_READ_BUFFER, 0);
+			volume->update(feedback.data(), this->feedback_frames[index], this->virtual_max_uploads, uploads);
+		}
+		glDeleteSync(fence);
+		this->feedback_fences[index] = NULL;
+	}
+
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glBindBuffer(GL_COPY_READ_BUFFER, this->feedback_buffer);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, this->feedback_readbacks[index]);
+	glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, volume->num_bricks * sizeof(uint32_t));
+	glBindBuffer(GL_COPY_READ_BUFFER, 0);
+	glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+	this->feedback_fences[index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	this->feedback_frames[index] = this->virtual_frame;
+	this->virtual_frame++;
+	if (uploads.empty())
+		return;
+
+	std::vector<float> texels;
+	for (int brick : uploads) {
+		volume->buildBrick(brick, texels);
+		int slot = volume->page_table[brick] - 1;
+		int x = slot % volume->atlas_slots[0];
+		int y = slot / volume->atlas_slots[0] % volume->atlas_slots[1];
+		int z = slot / (volume->atlas_slots[0] * volume->atlas_slots[1]);
+		this->brick_atlas->upload3DRegion(x * VIRTUAL_BRICK_TEXELS, y * VIRTUAL_BRICK_TEXELS, z * VIRTUAL_BRICK_TEXELS, VIRTUAL_BRICK_TEXELS, VIRTUAL_BRICK_TEXELS, VIRTUAL_BRICK_TEXELS, texels.data());
+	}
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, this->page_table_buffer);
+	glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, volume->page_table.size() * sizeof(uint32_t), volume->page_table.data());
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+	// the accumulated frames were rendered with coarser bricks
+	Application::instance->resetAccumulation();
+}
+
+void Material::setVirtualTextureUniforms(bool sampling_file)
+{
+	bool use_virtual = sampling_file && this->virtual_volume;
+	this->shader->setUniform("u_virtual_texture", use_virtual);
+	if (!use_virtual)
+		return;
+
+	this->updateVirtualTexture();
+	VirtualVolume* volume = this->virtual_volume;
+	this->shader->setUniform("u_brick_atlas", this->brick_atlas, 13);
+	this->shader->setUniform3("u_virtual_size", volume->file.width, volume->file.height, volume->file.depth);
+	this->shader->setUniform("u_virtual_levels", volume->levels);
+	this->shader->setUniform1Array("u_virtual_offsets", volume->level_offset, MAX_VIRTUAL_LEVELS);
+	this->shader->setUniform3("u_atlas_slots", volume->atlas_slots[0], volume->atlas_slots[1], volume->atlas_slots[2]);
+	this->shader->setUniform("u_virtual_frame", (int)this->virtual_frame);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, this->page_table_buffer);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, this->feedback_buffer);
+}
+
 void Material::estimate3DTexture(easyVDB::OpenVDBReader* vdbReader)
 {
-	int resolution = 128;
-	float radius = 2.0;
+	VolumeData volume;
+	voxelizeVDB(vdbReader, volume, this->vdb_resolution, this->vdb_radius);
+	this->uploadFileVolume(volume);
+}
+
+void Material::uploadFileVolume(const VolumeData& volume)
+{
+	this->texture = uploadVolumeTexture(this->texture, volume);
 
+	VolumeData majorants;
+	buildMajorantGrid(volume, majorants);
+	this->majorant_texture = uploadMajorantTexture(this->majorant_texture, majorants);
+}
+
+void Material::requestVoxelization()
+{
+	// the current texture stays bound until the new one is uploaded in updateVDBTexture
+	int resolution = this->vdb_resolution;
+	float radius = this->vdb_radius;
+	if (!this->vdb_reader) {
+		if (this->particles.empty())
+			return;
+
+		// particles are not modified after loading, the worker reads them in place
+		const std::vector<sParticle>* particles = &this->particles;
+		this->vdb_bake.start([particles, resolution, radius](VolumeData& volume, const std::atomic<bool>& cancelled) {
+			return splatParticles(*particles, volume, resolution, radius, &cancelled);
+		});
+		return;
+	}
+
+	easyVDB::OpenVDBReader* vdbReader = this->vdb_reader;
+	this->vdb_bake.start([vdbReader, resolution, radius](VolumeData& volume, const std::atomic<bool>& cancelled) {
+		return voxelizeVDB(vdbReader, volume, resolution, radius, &cancelled);
+	});
+}
+
+void Material::updateVDBTexture()
+{
+	VolumeData volume;
+	if (this->vdb_bake.fetch(volume))
+		this->uploadFileVolume(volume);
+}
+
+void Material::renderVoxelizationMenu()
+{
+	if (!this->vdb_reader && this->particles.empty())
+		return;
+
+	bool changed = false;
+	changed |= ImGui::SliderInt("Voxel Resolution", &this->vdb_resolution, 16, 256);
+	changed |= ImGui::SliderFloat("Bleed Radius", &this->vdb_radius, 0.0f, 4.0f);
+	if (changed)
+		requestVoxelization();
+
+	if (this->vdb_bake.isRunning())
+		ImGui::Text("Voxelizing...");
+}
+
+void Material::renderWindowMenu()
+{
+	if (!this->raw_volume)
+		return;
+
+	ImGui::SliderFloat("Window Level", &this->window_level, 0.0f, 1.0f);
+	ImGui::SliderFloat("Window Width", &this->window_width, 0.001f, 1.0f);
+
+	// the volumes over VIRTUAL_TEXTURE_MIN_VOXELS are always virtual, the smaller ones can be for testing
+	if (this->supports_virtual_texture && ImGui::Checkbox("Virtual texturing", &this->use_virtual_texture) && !this->raw_path.empty())
+		this->loadRawVolume(this->raw_path);
+	if (this->virtual_volume) {
+		int resident = 0;
+		for (int brick : this->virtual_volume->slot_bricks)
+			resident += brick >= 0;
+		ImGui::Text("Resident bricks: %d / %d (%d slots)", resident, this->virtual_volume->num_bricks, (int)this->virtual_volume->slot_bricks.size());
+		ImGui::SliderInt("Bricks per frame", &this->virtual_max_uploads, 1, 64);
+	}
+}
+
+bool Material::voxelizeVDB(easyVDB::OpenVDBReader* vdbReader, VolumeData& volume, int resolution, float radius, const std::atomic<bool>* cancelled)
+{
 	int convertedGrids = 0;
 	int convertedVoxels = 0;
 
@@ -47,8 +338,8 @@ void Material::estimate3DTexture(easyVDB::OpenVDBReader* vdbReader)
 	// read all grids data and convert to texture
 	for (unsigned int i = 0; i < totalGrids; i++) {
 		easyVDB::Grid& grid = vdbReader->grids[i];
-		float* data = new float[resolutionPow3];
-		memset(data, 0, sizeof(float) * resolutionPow3);
+		volume.resize(resolution, resolution, resolution);
+		float* data = volume.data.data();
 
 		// Bbox
 		easyVDB::Bbox bbox = easyVDB::Bbox();
@@ -123,6 +414,10 @@ void Material::estimate3DTexture(easyVDB::OpenVDBReader* vdbReader)
 
 				y++;
 				target.y += step.y;
+
+				// a newer request makes this one useless
+				if (cancelled && *cancelled)
+					return false;
 			}
 
 			if (y >= resolution) {
@@ -136,11 +431,185 @@ void Material::estimate3DTexture(easyVDB::OpenVDBReader* vdbReader)
 			// yield
 		}
 
-		// now we create the texture with the data
+		// every grid overwrites the previous one, the texture keeps the last grid
 		// use this: https://www.khronos.org/opengl/wiki/OpenGL_Type
 		// and this: https://registry.khronos.org/OpenGL-Refpages/gl4/html/glTexImage3D.xhtml
-		this->texture = new Texture();
-		this->texture->create3D(resolution, resolution, resolution, GL_RED, GL_FLOAT, false, data, GL_R8);
+	}
+
+	return totalGrids > 0;
+}
+
+Texture* Material::uploadVolumeTexture(Texture* texture, const VolumeData& volume, unsigned int internal_format)
+{
+	// a scanned volume leaves a texture of 8/16 bit voxels behind, the floats need their own
+	if (texture && (texture->width != volume.width || texture->height != volume.height || texture->depth != volume.depth || texture->type != GL_FLOAT || texture->internal_format != internal_format)) {
+		delete texture;
+		texture = NULL;
+	}
+
+	if (!texture) {
+		texture = new Texture();
+		texture->create3D(volume.width, volume.height, volume.depth, GL_RED, GL_FLOAT, false, (float*)NULL, internal_format);
+	}
+
+	// distant volumes sample the coarser levels instead of thrashing the cache with the full grid
+	std::vector<VolumeData> mips;
+	buildMipChain(volume, mips);
+
+	std::vector<const float*> levels = { volume.data.data() };
+	for (auto& mip : mips)
+		levels.push_back(mip.data.data());
+
+	texture->upload3DMipmaps(levels);
+
+	// the accumulated frames were rendered with the previous volume
+	Material::volume_uploads++;
+	Application::instance->resetAccumulation();
+	return texture;
+}
+
+Texture* Material::uploadMajorantTexture(Texture* texture, const VolumeData& majorants)
+{
+	if (texture && (texture->width != majorants.width || texture->height != majorants.height || texture->depth != majorants.depth)) {
+		delete texture;
+		texture = NULL;
+	}
+
+	// full float, a majorant rounded down would bias the tracking. The shader fetches whole cells
+	if (!texture) {
+		texture = new Texture();
+		texture->create3D(majorants.width, majorants.height, majorants.depth, GL_RED, GL_FLOAT, false, (float*)NULL, GL_R32F);
+	}
+	texture->upload3D((float*)majorants.data.data(), GL_NEAREST, GL_NEAREST, GL_CLAMP_TO_EDGE);
+	return texture;
+}
+
+void Material::setLodUniforms(Camera* camera)
+{
+	// angle covered by a pixel, the footprint at distance t is t * pixel_angle (also in local space)
+	// the viewport is smaller than the window when the volume is rendered at reduced resolution
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	float pixel_angle = 2.f * tanf(glm::radians(camera->fov) * 0.5f) / (float)viewport[3];
+
+	// the coarser quality levels sample the mips even without the distance LOD, the shaders scale the step with them
+	this->shader->setUniform("u_use_lod", this->use_lod || this->quality_level > 0);
+	this->shader->setUniform("u_lod_bias", this->lod_bias + this->qualityLodBias());
+	this->shader->setUniform("u_pixel_angle", pixel_angle);
+}
+
+void Material::setWindowUniforms(bool sampling_file)
+{
+	// only the scanned volumes use it, the rest keep the identity window (level 0.5, width 1)
+	bool use_window = this->raw_volume && sampling_file;
+	this->shader->setUniform("u_window_level", use_window ? this->window_level : 0.5f);
+	this->shader->setUniform("u_window_width", use_window ? this->window_width : 1.0f);
+}
+
+float Material::getProgressiveStepScale(float& jitter_offset)
+{
+	// every accumulated (or reprojected) frame rotates the jitter by the golden ratio and marches with a coarser step
+	Application* app = Application::instance;
+	jitter_offset = 0.f;
+	float step_scale = 1.f;
+	if (app->use_progressive) {
+		jitter_offset = fmodf(app->accumulated_frames * 0.618034f, 1.f);
+		step_scale = app->progressive_step_scale;
+	}
+	else if (app->use_temporal) {
+		jitter_offset = fmodf(app->temporal_frame * 0.618034f, 1.f);
+		step_scale = app->temporal_step_scale;
+	}
+	// and the dynamic resolution coarsens them when the volumes go over their time budget
+	if (app->use_dynamic_resolution)
+		step_scale *= app->dynamic_step_scale;
+	return step_scale;
+}
+
+void Material::setProgressiveUniforms(float step_length)
+{
+	float jitter_offset;
+	float step_scale = this->getProgressiveStepScale(jitter_offset);
+	this->shader->setUniform("u_jitter_offset", jitter_offset);
+	this->shader->setUniform("u_step_length", step_length * step_scale);
+	this->shader->setUniform("u_frame", (int)Application::instance->frame_count);
+
+	// blue noise jitter, generated by tools/bluenoise.cpp. Without it only the per frame offset is left
+	static Texture* blue_noise = Texture::Get("res/textures/bluenoise.tga", false, false);
+	this->shader->setUniform("u_blue_noise", blue_noise ? blue_noise : Texture::getBlackTexture(), 1);
+}
+
+void Material::setSceneDepthUniforms(Camera* camera, const glm::mat4& model)
+{
+	// only there once the opaque nodes were rendered offscreen, otherwise the rays cross the whole volume
+	Texture* scene_depth = Application::instance->scene_depth;
+	this->shader->setUniform("u_use_scene_depth", scene_depth != NULL);
+	if (!scene_depth)
+		return;
+
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	this->shader->setUniform("u_scene_depth", scene_depth, 3);
+	this->shader->setUniform("u_inverse_mvp", glm::inverse(camera->viewprojection_matrix * model));
+	this->shader->setUniform("u_viewport", glm::vec4(viewport[0], viewport[1], viewport[2], viewport[3]));
+}
+
+// LOD bias, jitter and lights of every quality level, the small nodes do not show the banding the jitter hides
+static const struct {
+	float lod_bias;
+	bool jittering;
+	int max_lights;
+} quality_levels[NUM_QUALITY_LEVELS] = { { 0.f, true, MAX_LIGHTS }, { 1.f, true, MAX_LIGHTS }, { 2.f, false, 2 }, { 3.f, false, 1 } };
+
+bool Material::isJittering(bool use_jittering)
+{
+	if (!quality_levels[this->quality_level].jittering)
+		return false;
+	return use_jittering || Application::instance->use_progressive || Application::instance->use_temporal;
+}
+
+float Material::qualityLodBias()
+{
+	return quality_levels[this->quality_level].lod_bias;
+}
+
+int Material::qualityLights(int num_lights)
+{
+	return std::min(num_lights, quality_levels[this->quality_level].max_lights);
+}
+
+void Material::updateNoiseTexture(float noise_scale, float noise_detail)
+{
+	int octaves = (int)noise_detail;
+
+	// first bake blocks so the shader never samples an empty texture
+	if (!this->noise_texture) {
+		VolumeData volume;
+		bakeFractalNoise(volume, NOISE_VOLUME_RESOLUTION, noise_scale, noise_detail);
+		this->noise_texture = uploadVolumeTexture(NULL, volume);
+		VolumeData majorants;
+		buildMajorantGrid(volume, majorants);
+		this->noise_majorant_texture = uploadMajorantTexture(NULL, majorants);
+		this->baked_noise_scale = noise_scale;
+		this->baked_noise_octaves = octaves;
+		return;
+	}
+
+	// parameters changed: re-bake in background, the old noise stays bound meanwhile
+	if (noise_scale != this->baked_noise_scale || octaves != this->baked_noise_octaves) {
+		this->baked_noise_scale = noise_scale;
+		this->baked_noise_octaves = octaves;
+		this->noise_bake.start([noise_scale, noise_detail](VolumeData& volume, const std::atomic<bool>& cancelled) {
+			return bakeFractalNoise(volume, NOISE_VOLUME_RESOLUTION, noise_scale, noise_detail, &cancelled);
+		});
+	}
+
+	VolumeData volume;
+	if (this->noise_bake.fetch(volume)) {
+		this->noise_texture = uploadVolumeTexture(this->noise_texture, volume);
+		VolumeData majorants;
+		buildMajorantGrid(volume, majorants);
+		this->noise_majorant_texture = uploadMajorantTexture(this->noise_majorant_texture, majorants);
 	}
 }
 
@@ -236,6 +705,27 @@ void StandardMaterial::setUniforms(Camera* camera, glm::mat4 model)
 	}
 }
 
+void StandardMaterial::setShadowUniforms(int light_index)
+{
+	// the volumes between the mesh and the light dim it, from the deep opacity maps of that light
+	int num_shadows = 0;
+	for (SceneNode* node : Application::instance->shadow_volumes) {
+		VolumeMaterial* volume = (VolumeMaterial*)node->material;
+		auto it = volume->opacity_maps.find(node);
+		if (num_shadows == MAX_SHADOW_VOLUMES || it == volume->opacity_maps.end() || light_index >= (int)it->second.viewprojections.size())
+			continue;
+
+		const VolumeMaterial::sOpacityMaps& maps = it->second;
+		std::string index = "[" + std::to_string(num_shadows) + "]";
+		this->shader->setUniform(("u_shadow_opacity_maps" + index).c_str(), maps.maps[light_index]->color_textures[0], num_shadows);
+		this->shader->setUniform(("u_shadow_inverse_models" + index).c_str(), glm::inverse(node->model));
+		this->shader->setUniform(("u_shadow_viewprojections" + index).c_str(), maps.viewprojections[light_index]);
+		this->shader->setUniform(("u_shadow_light_positions" + index).c_str(), maps.lights[light_index]);
+		num_shadows++;
+	}
+	this->shader->setUniform("u_num_shadow_volumes", num_shadows);
+}
+
 void StandardMaterial::render(Mesh* mesh, glm::mat4 model, Camera* camera)
 {
 	bool first_pass = true;
@@ -263,6 +753,7 @@ void StandardMaterial::render(Mesh* mesh, glm::mat4 model, Camera* camera)
 			if (num_lights > 0) {
 				Light* light = Application::instance->light_list[nlight];
 				light->setUniforms(this->shader, model);
+				this->setShadowUniforms(nlight);
 			}
 			else {
 				// Set some uniforms in case there is no light
@@ -298,9 +789,8 @@ void StandardMaterial::renderInMenu()
 
 
 /// Volume Material
-VolumeMaterial::VolumeMaterial(glm::vec4 background_color_) {
+VolumeMaterial::VolumeMaterial() {
 	this->color = glm::vec4(1.f, 1.f, 1.f, 0.8f);
-	this->background_color = background_color_;
 
 	this->emitted_color = glm::vec4(1.f, 0.8f, 0.2f, 1.f);
 	this->absorption_coefficient = 1.467f;
@@ -314,19 +804,37 @@ VolumeMaterial::VolumeMaterial(glm::vec4 background_color_) {
 	this->shaderType = eShaderType::ABSORPTION;
 	this->densityType = eDensityType::CONSTANT;
 
-	this->absorption_shader = Shader::Get("res/shaders/basic.vs", "res/shaders/absorption.fs");
-	this->emissive_absorption_shader = Shader::Get("res/shaders/basic.vs", "res/shaders/emissive_absorption.fs");
-	this->emissive_scatter_absorption_shader = Shader::Get("res/shaders/basic.vs", "res/shaders/emissive_scatter_absorption.fs");
-
 	this->use_jittering = false;
 	this->use_phase_function = false;
+	this->use_adaptive_stepping = false;
+	this->adaptive_tolerance = 0.05f;
+	this->adaptive_max_factor = 8.0f;
+	this->use_tracking = false;
+	this->tracking_samples = 1;
+
+	// a ramp of the emitted color, what the shaders do without transfer function
+	this->use_transfer_function = false;
+	this->transfer_function = {
+		{ 0.f, { this->emitted_color.x, this->emitted_color.y, this->emitted_color.z }, 0.f },
+		{ 1.f, { this->emitted_color.x, this->emitted_color.y, this->emitted_color.z }, 1.f } };
+	this->transfer_texture = NULL;
+	this->transfer_function_changed = true;
+	this->use_opacity_maps = false;
+	this->use_irradiance_volume = false;
+	this->irradiance_strength = 1.0f;
+	this->irradiance_ambient = 0.2f;
+	this->use_half_angle_slicing = false;
+	this->slice_eye_buffer = NULL;
+	this->slice_light_buffer = NULL;
+	this->use_compute = false;
+	this->compute_target = NULL;
+
 	this->use_local_pos = true;
 	this->assignShader();
 }
 
-VolumeMaterial::VolumeMaterial(glm::vec4 background_color_, std::string file_path) {
+VolumeMaterial::VolumeMaterial(std::string file_path) {
 	this->color = glm::vec4(1.f, 1.f, 1.f, 0.8f);
-	this->background_color = background_color_;
 
 	this->emitted_color = glm::vec4(1.f, 0.8f, 0.2f, 1.f);
 	this->absorption_coefficient = 1.467f;
@@ -340,19 +848,49 @@ VolumeMaterial::VolumeMaterial(glm::vec4 background_color_, std::string file_pat
 	this->shaderType = eShaderType::ABSORPTION;
 	this->densityType = eDensityType::CONSTANT;
 
-	this->absorption_shader = Shader::Get("res/shaders/basic.vs", "res/shaders/absorption.fs");
-	this->emissive_absorption_shader = Shader::Get("res/shaders/basic.vs", "res/shaders/emissive_absorption.fs");
-	this->emissive_scatter_absorption_shader = Shader::Get("res/shaders/basic.vs", "res/shaders/emissive_scatter_absorption.fs");
-
 	this->use_jittering = false;
 	this->use_phase_function = false;
+	this->use_adaptive_stepping = false;
+	this->adaptive_tolerance = 0.05f;
+	this->adaptive_max_factor = 8.0f;
+	this->use_tracking = false;
+	this->tracking_samples = 1;
+
+	// a ramp of the emitted color, what the shaders do without transfer function
+	this->use_transfer_function = false;
+	this->transfer_function = {
+		{ 0.f, { this->emitted_color.x, this->emitted_color.y, this->emitted_color.z }, 0.f },
+		{ 1.f, { this->emitted_color.x, this->emitted_color.y, this->emitted_color.z }, 1.f } };
+	this->transfer_texture = NULL;
+	this->transfer_function_changed = true;
+	this->use_opacity_maps = false;
+	this->use_irradiance_volume = false;
+	this->irradiance_strength = 1.0f;
+	this->irradiance_ambient = 0.2f;
+	this->use_half_angle_slicing = false;
+	this->slice_eye_buffer = NULL;
+	this->slice_light_buffer = NULL;
+	this->use_compute = false;
+	this->compute_target = NULL;
+
 	this->use_local_pos = true;
 	this->assignShader();
 
-	this->loadVDB(file_path);
+	this->loadVolume(file_path);
 }
 
-VolumeMaterial::~VolumeMaterial() { }
+VolumeMaterial::~VolumeMaterial()
+{
+	delete this->transfer_texture;
+	delete this->compute_target;
+	for (auto& it : this->irradiance_volumes)
+		delete it.second.texture;
+	delete this->slice_eye_buffer;
+	delete this->slice_light_buffer;
+	for (auto& it : this->opacity_maps)
+		for (FBO* fbo : it.second.maps)
+			delete fbo;
+}
 
 //This three functions have to be addapted to volume material
 void VolumeMaterial::setUniforms(Camera* camera, glm::mat4 model)
@@ -362,16 +900,31 @@ void VolumeMaterial::setUniforms(Camera* camera, glm::mat4 model)
 	glm::vec3 camera_pos = GetInverseCameraPos(camera, model);
 	this->shader->setUniform("u_camera_position", camera_pos);
 	this->shader->setUniform("u_model", model);
-	this->shader->setUniform("u_background_color", this->background_color);
-	this->shader->setUniform("u_step_length", this->step_length);
+	// the constant density has no mips to bias, its quality level scales the step instead
+	float quality_step_scale = this->densityType == eDensityType::CONSTANT ? exp2f(this->qualityLodBias()) : 1.f;
+	this->setProgressiveUniforms(this->step_length * quality_step_scale);
+	this->setSceneDepthUniforms(camera, model);
 	this->shader->setUniform("u_absorption_coefficient", this->absorption_coefficient);
 
 	this->shader->setUniform("u_density_type", (int)this->densityType);
-	this->shader->setUniform("u_use_jittering", this->use_jittering);
+	this->shader->setUniform("u_use_jittering", this->isJittering(this->use_jittering));
+	this->shader->setUniform("u_adaptive_stepping", this->use_adaptive_stepping);
+	this->shader->setUniform("u_adaptive_tolerance", this->adaptive_tolerance);
+	this->shader->setUniform("u_adaptive_max_factor", this->adaptive_max_factor);
+	this->shader->setUniform("u_use_tracking", this->use_tracking);
+	this->shader->setUniform("u_tracking_samples", this->tracking_samples);
+	// always bound, the generic shader would otherwise leave the 2D sampler in the unit of the 3D texture
+	this->updateTransferFunction();
+	this->shader->setUniform("u_use_transfer_function", this->use_transfer_function);
+	this->shader->setUniform("u_transfer_table", this->transfer_texture, 4);
+	this->setLodUniforms(camera);
+	this->setWindowUniforms(this->densityType == eDensityType::VDB_FILE);
+	this->setVirtualTextureUniforms(this->densityType == eDensityType::VDB_FILE);
 
 	if (this->densityType == eDensityType::NOISE_3D) {
-		this->shader->setUniform("u_noise_scale", this->noise_scale);
-		this->shader->setUniform("u_noise_detail", this->noise_detail);
+		this->updateNoiseTexture(this->noise_scale, this->noise_detail);
+		this->shader->setUniform("u_texture", this->noise_texture, 0);
+		this->shader->setUniform("u_majorant_grid", this->noise_majorant_texture, 2);
 	}
 
 	if (!(this->shaderType == eShaderType::ABSORPTION)) {
@@ -380,9 +933,13 @@ void VolumeMaterial::setUniforms(Camera* camera, glm::mat4 model)
 	}
 
 	if (this->densityType == eDensityType::VDB_FILE) {
+		this->updateVDBTexture();
 		if (this->texture) {
 			this->shader->setUniform("u_texture", this->texture, 0);
 		}
+		if (this->majorant_texture) {
+			this->shader->setUniform("u_majorant_grid", this->majorant_texture, 2);
+		}
 	}
 
 	if (this->shaderType == eShaderType::EMISSION_SCATTER_ABSORPTION) {
@@ -391,16 +948,575 @@ void VolumeMaterial::setUniforms(Camera* camera, glm::mat4 model)
 		if (this->use_phase_function) {
 			this->shader->setUniform("u_g", this->Henyey_Greenstein_g);
 		}
-		Application::instance->light_list[0]->setUniforms(this->shader, model);
+		this->shader->setUniform("u_num_lights", this->qualityLights(Light::uploadLightBlock(Application::instance->light_list, model)));
+		this->setOpacityMapUniforms();
+		this->setIrradianceUniforms();
+	}
+}
+
+void VolumeMaterial::setOpacityMapUniforms()
+{
+	this->shader->setUniform("u_use_opacity_maps", this->use_opacity_maps);
+
+	// every element of the sampler array is bound (slots 5 to 12), the lights without map to an empty texture
+	auto it = this->opacity_maps.find(this->node);
+	const sOpacityMaps* maps = this->use_opacity_maps && it != this->opacity_maps.end() ? &it->second : NULL;
+	std::vector<glm::mat4> viewprojections(MAX_LIGHTS, glm::mat4(0.f));
+	for (int i = 0; i < MAX_LIGHTS; i++) {
+		bool has_map = maps && i < (int)maps->viewprojections.size();
+		std::string name = "u_opacity_maps[" + std::to_string(i) + "]";
+		this->shader->setUniform(name.c_str(), has_map ? maps->maps[i]->color_textures[0] : Texture::getBlackTexture(), 5 + i);
+		if (has_map)
+			viewprojections[i] = maps->viewprojections[i];
+	}
+	this->shader->setUniform("u_opacity_map_viewprojections", viewprojections);
+}
+
+void VolumeMaterial::setIrradianceUniforms()
+{
+	auto it = this->irradiance_volumes.find(this->node);
+	Texture* texture = it != this->irradiance_volumes.end() ? it->second.texture : NULL;
+	bool use_irradiance = this->use_irradiance_volume && texture;
+	this->shader->setUniform("u_use_irradiance_volume", use_irradiance);
+	this->shader->setUniform("u_irradiance_strength", this->irradiance_strength);
+	if (use_irradiance)
+		this->shader->setUniform("u_irradiance_volume", texture, 14);
+}
+
+// the tiled marcher has no scattering nor tracking, and it keeps the fixed steps and the emitted color
+bool VolumeMaterial::canRenderCompute()
+{
+	bool tracking = this->use_tracking && this->shaderType != eShaderType::ABSORPTION;
+	return this->shaderType != eShaderType::EMISSION_SCATTER_ABSORPTION && !tracking;
+}
+
+void VolumeMaterial::renderCompute(glm::mat4 model, Camera* camera)
+{
+	bool emission = this->shaderType == eShaderType::EMISSION_ABSORPTION;
+	if (this->use_shader_variants) {
+		std::string macros = "#define DENSITY_TYPE " + std::to_string((int)this->densityType) + "\n";
+		macros += std::string("#define USE_JITTERING ") + (this->isJittering(this->use_jittering) ? "true" : "false") + "\n";
+		macros += std::string("#define USE_EMISSION ") + (emission ? "true" : "false") + "\n";
+		this->shader = Shader::GetCompute("res/shaders/tiled_volume.cs", macros.c_str());
+	}
+	if (!this->use_shader_variants || !this->shader)
+		this->shader = Shader::GetCompute("res/shaders/tiled_volume.cs");
+	if (!this->shader)
+		return;
+
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	int width = viewport[2];
+	int height = viewport[3];
+	if (!this->compute_target || (int)this->compute_target->width != width || (int)this->compute_target->height != height) {
+		delete this->compute_target;
+		this->compute_target = new Texture(width, height, GL_RGBA, GL_FLOAT, false, NULL, GL_RGBA32F);
+	}
+
+	// pixel rectangle of the projected cube, the whole viewport if some corner is behind the camera
+	glm::mat4 mvp = camera->viewprojection_matrix * model;
+	glm::vec2 rect_min(0.f), rect_max((float)width, (float)height);
+	bool behind = false;
+	glm::vec2 corners_min(FLT_MAX), corners_max(-FLT_MAX);
+	for (int i = 0; i < 8; i++) {
+		glm::vec4 corner = mvp * glm::vec4(i & 1 ? 1.f : -1.f, i & 2 ? 1.f : -1.f, i & 4 ? 1.f : -1.f, 1.f);
+		if (corner.w <= 0.f) {
+			behind = true;
+			break;
+		}
+		glm::vec2 pixel = (glm::vec2(corner) / corner.w * 0.5f + 0.5f) * glm::vec2((float)width, (float)height);
+		corners_min = glm::min(corners_min, pixel);
+		corners_max = glm::max(corners_max, pixel);
+	}
+	if (!behind) {
+		rect_min = glm::clamp(glm::floor(corners_min), glm::vec2(0.f), rect_max);
+		rect_max = glm::clamp(glm::ceil(corners_max), glm::vec2(0.f), rect_max);
+	}
+	glm::ivec2 offset(rect_min);
+	glm::ivec2 size = glm::ivec2(rect_max) - offset;
+	if (size.x <= 0 || size.y <= 0)
+		return;
+
+	this->shader->enable();
+	this->setUniforms(camera, model);
+	this->shader->setUniform("u_inverse_mvp", glm::inverse(mvp));
+	this->shader->setUniform("u_viewport", glm::vec4(viewport[0], viewport[1], viewport[2], viewport[3]));
+	this->shader->setUniform2("u_tile_offset", offset.x, offset.y);
+	this->shader->setUniform("u_use_emission", emission);
+
+	// the 2D samplers cannot be left in the unit of the 3D texture
+	Texture* majorants = this->densityType == eDensityType::NOISE_3D ? this->noise_majorant_texture : this->majorant_texture;
+	this->shader->setUniform("u_use_occupancy", majorants != NULL && this->densityType != eDensityType::CONSTANT);
+	if (!Application::instance->scene_depth)
+		this->shader->setUniform("u_scene_depth", Texture::getBlackTexture(), 3);
+
+	glBindImageTexture(0, this->compute_target->texture_id, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+	this->shader->dispatch((size.x + 7) / 8, (size.y + 7) / 8);
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+	this->shader->disable();
+
+	// only the dispatched rectangle was written, the scissor keeps the rest of the target out
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	glDisable(GL_DEPTH_TEST);
+	glEnable(GL_SCISSOR_TEST);
+	glScissor(viewport[0] + offset.x, viewport[1] + offset.y, size.x, size.y);
+	this->compute_target->toViewport();
+	glDisable(GL_SCISSOR_TEST);
+	glEnable(GL_DEPTH_TEST);
+	glDisable(GL_BLEND);
+}
+
+// the slices take the place of the marches to the light, the tracking has none
+bool VolumeMaterial::canRenderSlices()
+{
+	bool tracking = this->use_tracking && this->shaderType != eShaderType::ABSORPTION;
+	return this->shaderType == eShaderType::EMISSION_SCATTER_ABSORPTION && !tracking && !Application::instance->light_list.empty();
+}
+
+bool VolumeMaterial::renderSlices(glm::mat4 model, Camera* camera)
+{
+	Shader* shader = Shader::Get("res/shaders/slice.vs", "res/shaders/slice.fs");
+	Texture* volume = this->updateDensityTexture();
+	if (!shader || (this->densityType != eDensityType::CONSTANT && !volume))
+		return false;
+
+	// the light buffer is a perspective from the light fitted to the bounding sphere of the cube, like the opacity
+	// maps. With the light inside there is no order of the slices that is front to back for it
+	Light* light = Application::instance->light_list[0];
+	glm::mat4 inverse_model = glm::inverse(model);
+	glm::vec4 local_light = inverse_model * glm::vec4(light->model[3][0], light->model[3][1], light->model[3][2], 1.0f);
+	glm::vec3 light_pos = glm::vec3(local_light) / local_light.w;
+	float distance = glm::length(light_pos);
+	float radius = sqrtf(3.0f);
+	if (distance <= radius * 1.01f)
+		return false;
+	glm::vec3 up = fabsf(light_pos.y) > 0.99f * distance ? glm::vec3(1.f, 0.f, 0.f) : glm::vec3(0.f, 1.f, 0.f);
+	glm::mat4 light_viewprojection = glm::perspective(2.0f * asinf(radius / distance), 1.0f, distance - radius, distance + radius) * glm::lookAt(light_pos, glm::vec3(0.f), up);
+
+	// the slices are perpendicular to the vector halfway between the view and the light directions. If they face
+	// each other it is halfway to the inverted view, and the slices are back to front for the camera
+	glm::vec3 view_direction = glm::normalize(glm::mat3(inverse_model) * (camera->center - camera->eye));
+	glm::vec3 light_direction = -light_pos / distance;
+	bool front_to_back = glm::dot(view_direction, light_direction) >= 0.f;
+	glm::vec3 half_vector = glm::normalize(front_to_back ? light_direction + view_direction : light_direction - view_direction);
+	glm::vec3 axis_u = glm::normalize(glm::cross(half_vector, fabsf(half_vector.y) > 0.9f ? glm::vec3(1.f, 0.f, 0.f) : glm::vec3(0.f, 1.f, 0.f)));
+	glm::vec3 axis_v = glm::cross(half_vector, axis_u);
+
+	// the slices cover the projection of the cube on the half vector, shifted by the jitter of the frame
+	float jitter_offset;
+	float spacing = this->step_length * this->getProgressiveStepScale(jitter_offset) * exp2f(this->qualityLodBias());
+	float extent = fabsf(half_vector.x) + fabsf(half_vector.y) + fabsf(half_vector.z);
+	int num_slices = (int)ceilf(2.f * extent / spacing);
+
+	GLint viewport[4];
+	glGetIntegerv(GL_VIEWPORT, viewport);
+	if (!this->slice_eye_buffer || this->slice_eye_buffer->width != viewport[2] || this->slice_eye_buffer->height != viewport[3]) {
+		delete this->slice_eye_buffer;
+		this->slice_eye_buffer = new FBO();
+		this->slice_eye_buffer->create(viewport[2], viewport[3], 1, GL_RGBA, GL_FLOAT, GL_RGBA16F, false);
+	}
+	if (!this->slice_light_buffer) {
+		this->slice_light_buffer = new FBO();
+		this->slice_light_buffer->create(SLICE_LIGHT_BUFFER_SIZE, SLICE_LIGHT_BUFFER_SIZE, 1, GL_RGBA, GL_FLOAT, GL_RGBA16F, false);
+	}
+	glClearColor(0.f, 0.f, 0.f, 0.f);
+	for (FBO* buffer : { this->slice_eye_buffer, this->slice_light_buffer }) {
+		buffer->bind();
+		glClear(GL_COLOR_BUFFER_BIT);
+		buffer->unbind();
+	}
+
+	// the helpers of the material set the scene depth, the window and the irradiance on the slice shader
+	Shader* volume_shader = this->shader;
+	this->shader = shader;
+	shader->enable();
+	this->setSceneDepthUniforms(camera, model);
+	if (!Application::instance->scene_depth)
+		shader->setUniform("u_scene_depth", Texture::getBlackTexture(), 3);
+	this->setWindowUniforms(this->densityType == eDensityType::VDB_FILE);
+	this->setIrradianceUniforms();
+	this->shader = volume_shader;
+
+	shader->setUniform("u_density_type", (int)this->densityType);
+	if (volume)
+		shader->setUniform("u_texture", volume, 0);
+	this->updateTransferFunction();
+	shader->setUniform("u_use_transfer_function", this->use_transfer_function);
+	shader->setUniform("u_transfer_table", this->transfer_texture, 4);
+	shader->setUniform("u_absorption_coefficient", this->absorption_coefficient);
+	shader->setUniform("u_scattering_coefficient", this->scaterring_coefficient);
+	shader->setUniform("u_emitted_color", this->emitted_color);
+	shader->setUniform("u_emitted_intensity", this->emitted_intensity);
+	shader->setUniform("u_use_phase_function", this->use_phase_function);
+	shader->setUniform("u_g", this->Henyey_Greenstein_g);
+	shader->setUniform("u_camera_position", this->GetInverseCameraPos(camera, model));
+	shader->setUniform("u_half_vector", half_vector);
+	shader->setUniform("u_slice_spacing", spacing);
+	shader->setUniform("u_light_position", light_pos);
+	shader->setUniform("u_light_color", glm::vec3(light->color) * light->intensity);
+	shader->setUniform("u_light_viewprojection", light_viewprojection);
+	shader->setUniform("u_eye_size", glm::vec2(viewport[2], viewport[3]));
+
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_CULL_FACE);
+	glEnable(GL_BLEND);
+
+	Mesh* quad = Mesh::getQuad();
+	glm::mat4 mvp = camera->viewprojection_matrix * model;
+	for (int i = 0; i < num_slices; i++) {
+		float s = -extent + (i + jitter_offset) * spacing;
+		float section = sqrtf(std::max(3.f - s * s, 0.f));
+		if (section <= 0.f)
+			continue;
+		shader->setUniform("u_slice_center", half_vector * s);
+		shader->setUniform("u_slice_axis_u", axis_u * section);
+		shader->setUniform("u_slice_axis_v", axis_v * section);
+
+		// the camera sees the slice lit by the opacity of the slices before it, front to back adds it under them
+		this->slice_eye_buffer->bind();
+		if (front_to_back)
+			glBlendFunc(GL_ONE_MINUS_DST_ALPHA, GL_ONE);
+		else
+			glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+		shader->setUniform("u_light_pass", false);
+		shader->setUniform("u_mvp", mvp);
+		shader->setUniform("u_light_buffer", this->slice_light_buffer->color_textures[0], 5);
+		quad->render(GL_TRIANGLES);
+		this->slice_eye_buffer->unbind();
+
+		// then its opacity goes to the light buffer, which is not sampled while it is the target
+		this->slice_light_buffer->bind();
+		glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+		shader->setUniform("u_light_pass", true);
+		shader->setUniform("u_mvp", light_viewprojection);
+		shader->setUniform("u_light_buffer", Texture::getBlackTexture(), 5);
+		quad->render(GL_TRIANGLES);
+		this->slice_light_buffer->unbind();
+	}
+	shader->disable();
+
+	// premultiplied like the marchers, over what is behind
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	this->slice_eye_buffer->color_textures[0]->toViewport();
+	glDisable(GL_BLEND);
+	glEnable(GL_DEPTH_TEST);
+	glEnable(GL_CULL_FACE);
+	return true;
+}
+
+Texture* VolumeMaterial::updateDensityTexture()
+{
+	if (this->densityType == eDensityType::NOISE_3D) {
+		this->updateNoiseTexture(this->noise_scale, this->noise_detail);
+		return this->noise_texture;
+	}
+	if (this->densityType == eDensityType::VDB_FILE) {
+		this->updateVDBTexture();
+		return this->texture;
+	}
+	return NULL;
+}
+
+// the merged pass marches with the fixed steps and the emitted color, as the compute one
+bool VolumeMaterial::canMerge()
+{
+	return this->canRenderCompute();
+}
+
+// the scattering has the lights and the opacity maps in the local space of a single node
+bool VolumeMaterial::canInstance()
+{
+	return this->shaderType != eShaderType::EMISSION_SCATTER_ABSORPTION && !this->use_compute;
+}
+
+void VolumeMaterial::renderInstanced(Mesh* mesh, const std::vector<glm::mat4>& models, Camera* camera)
+{
+	this->assignShader(true);
+	if (!mesh || !this->shader || models.empty())
+		return;
+
+	std::vector<glm::mat4> inverse_models(models.size());
+	for (size_t i = 0; i < models.size(); i++)
+		inverse_models[i] = glm::inverse(models[i]);
+
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
+	// the uniforms go once for every instance, in world space (identity model). basic_instanced.vs moves the
+	// camera and the inverse view-projection to the local space of each instance
+	this->shader->enable();
+	this->setUniforms(camera, glm::mat4(1.f));
+	mesh->renderInstanced(GL_TRIANGLES, models.data(), inverse_models.data(), (int)models.size());
+	this->shader->disable();
+
+	glDisable(GL_BLEND);
+}
+
+void VolumeMaterial::renderMerged(const std::vector<VolumeMaterial*>& materials, const std::vector<glm::mat4>& models, Camera* camera)
+{
+	Shader* shader = Shader::Get("res/shaders/screen.vs", "res/shaders/merged_volumes.fs");
+	if (!shader || materials.empty())
+		return;
+
+	// the constant density volumes have no texture, but every element of the sampler array has to be a 3D one
+	static Texture* empty_volume = NULL;
+	if (!empty_volume) {
+		float zero = 0.f;
+		empty_volume = new Texture();
+		empty_volume->create3D(1, 1, 1, GL_RED, GL_FLOAT, false, &zero, GL_R32F);
+	}
+
+	int num_volumes = std::min((int)materials.size(), MAX_MERGED_VOLUMES);
+	std::vector<glm::mat4> inverse_models(MAX_MERGED_VOLUMES, glm::mat4(1.f));
+	std::vector<int> density_types(MAX_MERGED_VOLUMES, 0);
+	std::vector<float> step_lengths(MAX_MERGED_VOLUMES, 1.f);
+	std::vector<float> absorption_coefficients(MAX_MERGED_VOLUMES, 0.f);
+	std::vector<glm::vec3> emitted_radiances(MAX_MERGED_VOLUMES, glm::vec3(0.f));
+	std::vector<glm::vec2> windows(MAX_MERGED_VOLUMES, glm::vec2(0.5f, 1.f));
+	std::vector<Texture*> textures(MAX_MERGED_VOLUMES, empty_volume);
+	bool jittering = false;
+	for (int i = 0; i < num_volumes; i++) {
+		VolumeMaterial* material = materials[i];
+		Texture* volume = material->updateDensityTexture();
+		bool constant = material->densityType == eDensityType::CONSTANT || !volume;
+		bool use_window = material->raw_volume && material->densityType == eDensityType::VDB_FILE;
+		inverse_models[i] = glm::inverse(models[i]);
+		density_types[i] = constant ? (int)eDensityType::CONSTANT : (int)material->densityType;
+		step_lengths[i] = material->step_length;
+		absorption_coefficients[i] = material->absorption_coefficient;
+		if (material->shaderType == eShaderType::EMISSION_ABSORPTION)
+			emitted_radiances[i] = glm::vec3(material->emitted_color) * (float)material->emitted_intensity;
+		if (use_window)
+			windows[i] = glm::vec2(material->window_level, material->window_width);
+		if (!constant)
+			textures[i] = volume;
+		jittering |= material->isJittering(material->use_jittering);
+	}
+
+	// the helpers of the first material set the jitter, the step scale and the scene depth on the merged shader
+	VolumeMaterial* first = materials[0];
+	Shader* first_shader = first->shader;
+	first->shader = shader;
+
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_CULL_FACE);
+
+	shader->enable();
+	first->setProgressiveUniforms(1.f);
+	first->setSceneDepthUniforms(camera, glm::mat4(1.f));
+	if (!Application::instance->scene_depth)
+		shader->setUniform("u_scene_depth", Texture::getBlackTexture(), 3);
+	shader->setUniform("u_use_jittering", jittering);
+	shader->setUniform("u_inverse_viewprojection", glm::inverse(camera->viewprojection_matrix));
+	shader->setUniform("u_camera_position", camera->eye);
+	shader->setUniform("u_num_volumes", num_volumes);
+	shader->setUniform("u_inverse_models", inverse_models);
+	shader->setUniform1Array("u_density_types", density_types.data(), MAX_MERGED_VOLUMES);
+	shader->setUniform1Array("u_step_lengths", step_lengths.data(), MAX_MERGED_VOLUMES);
+	shader->setUniform1Array("u_absorption_coefficients", absorption_coefficients.data(), MAX_MERGED_VOLUMES);
+	shader->setUniform3Array("u_emitted_radiances", (float*)emitted_radiances.data(), MAX_MERGED_VOLUMES);
+	shader->setUniform2Array("u_windows", (float*)windows.data(), MAX_MERGED_VOLUMES);
+	for (int i = 0; i < MAX_MERGED_VOLUMES; i++) {
+		std::string name = "u_textures[" + std::to_string(i) + "]";
+		shader->setUniform(name.c_str(), textures[i], 5 + i);
+	}
+	Mesh::getQuad()->render(GL_TRIANGLES);
+	shader->disable();
+	first->shader = first_shader;
+
+	glEnable(GL_DEPTH_TEST);
+	glEnable(GL_CULL_FACE);
+	glDisable(GL_BLEND);
+}
+
+void VolumeMaterial::updateIrradianceVolume(const SceneNode* node, const glm::mat4& model)
+{
+	const std::vector<Light*>& lights = Application::instance->light_list;
+	int num_lights = std::min((int)lights.size(), MAX_LIGHTS);
+	this->updateTransferFunction();
+	bool use_window = this->raw_volume && this->densityType == eDensityType::VDB_FILE;
+
+	// the medium: the density seen by the marchers at about the resolution of the volume, read back from the GPU
+	std::vector<float> medium_state = { (float)this->densityType, this->absorption_coefficient, this->scaterring_coefficient,
+		use_window ? this->window_level : 0.5f, use_window ? this->window_width : 1.0f, (float)this->use_transfer_function, (float)Material::volume_uploads };
+	if (this->use_transfer_function)
+		for (const sTransferPoint& point : this->transfer_function)
+			medium_state.insert(medium_state.end(), { point.density, point.opacity });
+	if (medium_state != this->irradiance_medium_state) {
+		Texture* volume = this->updateDensityTexture();
+		if (this->densityType != eDensityType::CONSTANT && !volume)
+			return;
+
+		VolumeData& density = this->irradiance_medium;
+		density = VolumeData();
+		if (volume) {
+			int level = 0;
+			while (((int)volume->width >> (level + 1)) >= IRRADIANCE_VOLUME_SIZE && volume->mipmaps)
+				level++;
+			volume->download3D(level, density.data, density.width, density.height, density.depth);
+			for (float& value : density.data) {
+				if (use_window)
+					value = glm::clamp((value - this->window_level) / this->window_width + 0.5f, 0.0f, 1.0f);
+				if (this->use_transfer_function) {
+					int i = (int)(glm::clamp(value, 0.0f, 1.0f) * (TRANSFER_FUNCTION_SIZE - 1) + 0.5f);
+					value = this->transfer_table[((size_t)i * TRANSFER_FUNCTION_SIZE + i) * 4 + 3];
+				}
+			}
+		}
+		this->irradiance_medium_state = medium_state;
+	}
+
+	// every node builds its volume over the shared medium
+	sIrradiance& irradiance = this->irradiance_volumes[node];
+	if (irradiance.medium_state != medium_state) {
+		irradiance.volume.setMedium(this->irradiance_medium, this->absorption_coefficient, this->scaterring_coefficient, IRRADIANCE_VOLUME_SIZE);
+		irradiance.medium_state = medium_state;
+		irradiance.light_state.clear();
+	}
+
+	// the lights in the local space of the volume, like the LightBlock
+	glm::vec3 ambient = glm::vec3(Application::instance->ambient_light) * this->irradiance_ambient;
+	std::vector<float> light_state = { ambient.x, ambient.y, ambient.z };
+	for (int i = 0; i < 4; i++)
+		for (int j = 0; j < 4; j++)
+			light_state.push_back(model[i][j]);
+	glm::mat4 inverse_model = glm::inverse(model);
+	std::vector<sIrradianceLight> local_lights(num_lights);
+	for (int i = 0; i < num_lights; i++) {
+		glm::vec4 local_pos = inverse_model * glm::vec4(lights[i]->model[3][0], lights[i]->model[3][1], lights[i]->model[3][2], 1.0f);
+		glm::vec3 color = glm::vec3(lights[i]->color) * lights[i]->intensity;
+		for (int c = 0; c < 3; c++) {
+			local_lights[i].position[c] = local_pos[c] / local_pos.w;
+			local_lights[i].color[c] = color[c];
+		}
+		light_state.insert(light_state.end(), { local_lights[i].position[0], local_lights[i].position[1], local_lights[i].position[2], color.x, color.y, color.z });
 	}
+	if (light_state != irradiance.light_state) {
+		irradiance.volume.setLights(local_lights, glm::value_ptr(ambient));
+		irradiance.light_state = light_state;
+	}
+
+	if (irradiance.volume.iterations >= IRRADIANCE_MAX_ITERATIONS)
+		return;
+	irradiance.volume.iterate(IRRADIANCE_ITERATIONS_PER_FRAME);
+
+	if (!irradiance.texture) {
+		irradiance.texture = new Texture();
+		irradiance.texture->create3D(IRRADIANCE_VOLUME_SIZE, IRRADIANCE_VOLUME_SIZE, IRRADIANCE_VOLUME_SIZE, GL_RGB, GL_FLOAT, false, (float*)NULL, GL_RGB16F);
+	}
+	irradiance.texture->upload3D(GL_RGB, GL_FLOAT, false, (uint8_t*)irradiance.volume.irradiance.data(), GL_RGB16F);
+
+	// the accumulated frames were rendered with a less converged volume
+	Application::instance->resetAccumulation();
+}
+
+void VolumeMaterial::updateOpacityMaps(const SceneNode* node, const glm::mat4& model)
+{
+	const std::vector<Light*>& lights = Application::instance->light_list;
+	int num_lights = std::min((int)lights.size(), MAX_LIGHTS);
+
+	// the maps see the same volume the marchers sample
+	Texture* volume = this->updateDensityTexture();
+	this->updateTransferFunction();
+	bool use_window = this->raw_volume && this->densityType == eDensityType::VDB_FILE;
+
+	// everything the maps depend on, they are only rendered again when some of it changes
+	std::vector<float> state = { (float)num_lights, (float)this->densityType, this->absorption_coefficient, this->step_length,
+		use_window ? this->window_level : 0.5f, use_window ? this->window_width : 1.0f, (float)this->use_transfer_function, (float)Material::volume_uploads };
+	for (int i = 0; i < 4; i++)
+		for (int j = 0; j < 4; j++)
+			state.push_back(model[i][j]);
+	for (int i = 0; i < num_lights; i++)
+		state.insert(state.end(), { lights[i]->model[3][0], lights[i]->model[3][1], lights[i]->model[3][2] });
+	if (this->use_transfer_function)
+		for (const sTransferPoint& point : this->transfer_function)
+			state.insert(state.end(), { point.density, point.opacity });
+	sOpacityMaps& maps = this->opacity_maps[node];
+	if (state == maps.state)
+		return;
+
+	Shader* shader = Shader::Get("res/shaders/screen.vs", "res/shaders/deep_opacity.fs");
+	if (!shader || (this->densityType != eDensityType::CONSTANT && !volume))
+		return;
+	maps.state = state;
+
+	for (int i = (int)maps.maps.size(); i < num_lights; i++) {
+		FBO* fbo = new FBO();
+		fbo->create(DEEP_OPACITY_MAP_SIZE, DEEP_OPACITY_MAP_SIZE, 1, GL_RGBA, GL_FLOAT, GL_RGBA32F, false);
+		maps.maps.push_back(fbo);
+	}
+	maps.viewprojections.resize(num_lights);
+	maps.lights.resize(num_lights);
+
+	glDisable(GL_DEPTH_TEST);
+	glDisable(GL_CULL_FACE);
+	glDisable(GL_BLEND);
+
+	shader->enable();
+	shader->setUniform("u_step_length", this->step_length);
+	shader->setUniform("u_absorption_coefficient", this->absorption_coefficient);
+	shader->setUniform("u_density_type", (int)this->densityType);
+	shader->setUniform("u_window_level", use_window ? this->window_level : 0.5f);
+	shader->setUniform("u_window_width", use_window ? this->window_width : 1.0f);
+	shader->setUniform("u_use_transfer_function", this->use_transfer_function);
+	shader->setUniform("u_transfer_table", this->transfer_texture, 4);
+	if (volume)
+		shader->setUniform("u_texture", volume, 0);
+
+	glm::mat4 inverse_model = glm::inverse(model);
+	for (int i = 0; i < num_lights; i++) {
+		glm::vec4 local_pos = inverse_model * glm::vec4(lights[i]->model[3][0], lights[i]->model[3][1], lights[i]->model[3][2], 1.0f);
+		glm::vec3 light_pos = glm::vec3(local_pos) / local_pos.w;
+		maps.lights[i] = light_pos;
+
+		// a perspective from the light fitted to the bounding sphere of the cube, with the light inside there is no map
+		float distance = glm::length(light_pos);
+		float radius = sqrtf(3.0f);
+		if (distance <= radius * 1.01f) {
+			maps.viewprojections[i] = glm::mat4(0.f);
+			continue;
+		}
+		glm::vec3 up = fabsf(light_pos.y) > 0.99f * distance ? glm::vec3(1.f, 0.f, 0.f) : glm::vec3(0.f, 1.f, 0.f);
+		glm::mat4 projection = glm::perspective(2.0f * asinf(radius / distance), 1.0f, distance - radius, distance + radius);
+		glm::mat4 viewprojection = projection * glm::lookAt(light_pos, glm::vec3(0.f), up);
+		maps.viewprojections[i] = viewprojection;
+
+		maps.maps[i]->bind();
+		shader->setUniform("u_inverse_viewprojection", glm::inverse(viewprojection));
+		shader->setUniform("u_light_position", light_pos);
+		Mesh::getQuad()->render(GL_TRIANGLES);
+		maps.maps[i]->unbind();
+	}
+
+	shader->disable();
+	glEnable(GL_DEPTH_TEST);
+	glEnable(GL_CULL_FACE);
 }
 
 void VolumeMaterial::render(Mesh* mesh, glm::mat4 model, Camera* camera)
 {
+	this->assignShader();
 	if (mesh && this->shader) {
 
-		glEnable(GL_BLEND); //Since it has alpha lower than 1, but since is the only object renderized it wouldn't be necessary
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA); 
+		// another pass with its own shader and target, it has to go before this one is enabled
+		if (this->use_opacity_maps)
+			this->updateOpacityMaps(this->node, model);
+		if (this->use_irradiance_volume && this->shaderType == eShaderType::EMISSION_SCATTER_ABSORPTION)
+			this->updateIrradianceVolume(this->node, model);
+
+		if (this->use_compute && this->canRenderCompute()) {
+			this->renderCompute(model, camera);
+			return;
+		}
+		if (this->use_half_angle_slicing && this->canRenderSlices() && this->renderSlices(model, camera))
+			return;
+
+		// the shader outputs the premultiplied radiance and 1 - transmittance, what is behind shows through
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
 
 		// enable shader
 		this->shader->enable();
@@ -419,22 +1535,70 @@ void VolumeMaterial::render(Mesh* mesh, glm::mat4 model, Camera* camera)
 
 void VolumeMaterial::renderInMenu()
 {
-	if (ImGui::Combo("Shader Type", (int*)&shaderType, "ABSORPTION\0EMISSION_ABSORPTION\0EMISSION_SCATTER_ABSORPTION\0")) {
-		this->assignShader();
+	ImGui::Combo("Shader Type", (int*)&shaderType, "ABSORPTION\0EMISSION_ABSORPTION\0EMISSION_SCATTER_ABSORPTION\0");
+	ImGui::Checkbox("Specialized shaders", &this->use_shader_variants);
+
+	// the tracking replaces the fixed steps of the emissive shaders
+	bool tracking = this->use_tracking && this->shaderType != eShaderType::ABSORPTION;
+	if (this->shaderType != eShaderType::ABSORPTION) {
+		ImGui::Checkbox("Delta tracking", &this->use_tracking);
+		if (this->use_tracking)
+			ImGui::SliderInt("Tracking samples", &this->tracking_samples, 1, 16);
 	}
 
-	if (!(this->densityType == CONSTANT && this->shaderType == eShaderType::ABSORPTION)) {
+	if (!(this->densityType == CONSTANT && this->shaderType == eShaderType::ABSORPTION) && !tracking) {
 		ImGui::SliderFloat("Step Lenght", (float*)&this->step_length, 0.001f, 0.2f);
 		ImGui::Checkbox("Use jittering filter", &this->use_jittering);
+		ImGui::Checkbox("Adaptive stepping", &this->use_adaptive_stepping);
+		if (this->use_adaptive_stepping) {
+			ImGui::SliderFloat("Step Tolerance", (float*)&this->adaptive_tolerance, 0.005f, 0.2f);
+			ImGui::SliderFloat("Max Step Factor", (float*)&this->adaptive_max_factor, 1.0f, 16.0f);
+		}
+	}
+
+	if (this->densityType != CONSTANT && !tracking) {
+		ImGui::Checkbox("Distance LOD", &this->use_lod);
+		if (this->use_lod)
+			ImGui::SliderFloat("LOD Bias", (float*)&this->lod_bias, -2.0f, 2.0f);
 	}
 
 	ImGui::SliderFloat("Absorbsion Coeficient", (float*)&this->absorption_coefficient, 0.001f, 3.0f);
 
 	if (!(this->shaderType == eShaderType::ABSORPTION)) {
-		ImGui::ColorEdit3("Emitted color", (float*)&this->emitted_color);
+		if (!this->use_transfer_function || tracking)
+			ImGui::ColorEdit3("Emitted color", (float*)&this->emitted_color);
 		ImGui::SliderInt("Emitted intensity", (int*)&this->emitted_intensity, 1, 20);
 	}
 
+	// the scattering reads them instead of marching to the lights, and they shadow the meshes in any mode
+	ImGui::Checkbox("Deep opacity maps", &this->use_opacity_maps);
+
+	// multiple scattering and ambient light, built on the CPU at low resolution
+	if (this->shaderType == eShaderType::EMISSION_SCATTER_ABSORPTION) {
+		ImGui::Checkbox("Irradiance volume", &this->use_irradiance_volume);
+		if (this->use_irradiance_volume) {
+			ImGui::SliderFloat("Irradiance strength", &this->irradiance_strength, 0.0f, 4.0f);
+			if (ImGui::SliderFloat("Ambient scale", &this->irradiance_ambient, 0.0f, 1.0f))
+				Application::instance->resetAccumulation();
+			auto it = this->irradiance_volumes.find(this->node);
+			int iterations = it != this->irradiance_volumes.end() ? it->second.volume.iterations : 0;
+			ImGui::Text("Diffusion iterations: %d / %d", iterations, IRRADIANCE_MAX_ITERATIONS);
+		}
+	}
+
+	if (this->shaderType != eShaderType::EMISSION_SCATTER_ABSORPTION && !tracking)
+		ImGui::Checkbox("Compute renderer (tiles)", &this->use_compute);
+	// O(slices) per pixel instead of a march to the light per sample, only the first light
+	if (this->shaderType == eShaderType::EMISSION_SCATTER_ABSORPTION && !tracking)
+		ImGui::Checkbox("Half-angle slicing", &this->use_half_angle_slicing);
+
+	// the tracking samples the raw density, the majorants do not bound the transfer function
+	if (!tracking) {
+		ImGui::Checkbox("Transfer function", &this->use_transfer_function);
+		if (this->use_transfer_function)
+			this->renderTransferFunctionMenu();
+	}
+
 	if (this->shaderType == eShaderType::EMISSION_SCATTER_ABSORPTION) {
 		ImGui::SliderFloat("Scattering Coeficient", (float*)&this->scaterring_coefficient, 0.001f, 3.0f);
 		ImGui::Checkbox("Use phase function", &this->use_phase_function);
@@ -449,24 +1613,159 @@ void VolumeMaterial::renderInMenu()
 		ImGui::SliderFloat("Noise Scale", (float*)&this->noise_scale, 0.001f, 5.0f);
 		ImGui::SliderFloat("Noise Detail", (float*)&this->noise_detail, 1.0f, 5.0f);
 	}
+
+	if (this->densityType == eDensityType::VDB_FILE) {
+		this->renderVoxelizationMenu();
+		this->renderWindowMenu();
+	}
+}
+
+void VolumeMaterial::renderTransferFunctionMenu()
+{
+	// the table is also the preview: its diagonal is the transfer function sampled at every density
+	if (this->transfer_table.empty())
+		preintegrateTransferFunction(this->transfer_function, this->transfer_table);
+
+	// color strip on top, opacity curve below
+	ImDrawList* draw_list = ImGui::GetWindowDrawList();
+	ImVec2 origin = ImGui::GetCursorScreenPos();
+	float width = std::max(ImGui::CalcItemWidth(), 64.f);
+	float height = 48.f;
+	float strip = 12.f;
+	const int size = TRANSFER_FUNCTION_SIZE;
+	draw_list->AddRectFilled(origin, ImVec2(origin.x + width, origin.y + height), IM_COL32(32, 32, 32, 255));
+	for (int i = 0; i < size; i++) {
+		const float* texel = &this->transfer_table[((size_t)i * size + i) * 4];
+		float opacity = texel[3];
+		ImVec4 color = opacity > 0.f ? ImVec4(texel[0] / opacity, texel[1] / opacity, texel[2] / opacity, 1.f) : ImVec4(0.f, 0.f, 0.f, 1.f);
+		float x0 = origin.x + width * i / size;
+		float x1 = origin.x + width * (i + 1) / size;
+		draw_list->AddRectFilled(ImVec2(x0, origin.y), ImVec2(x1, origin.y + strip), ImGui::ColorConvertFloat4ToU32(color));
+		float y = origin.y + height - (height - strip) * std::clamp(opacity, 0.f, 1.f);
+		draw_list->AddRectFilled(ImVec2(x0, y), ImVec2(x1, origin.y + height), IM_COL32(200, 200, 200, 255));
+	}
+	ImGui::Dummy(ImVec2(width, height));
+
+	bool changed = false;
+	for (size_t i = 0; i < this->transfer_function.size(); i++) {
+		sTransferPoint& point = this->transfer_function[i];
+		ImGui::PushID((int)i);
+		ImGui::Separator();
+		changed |= ImGui::SliderFloat("Density", &point.density, 0.f, 1.f);
+		changed |= ImGui::ColorEdit3("Color", point.color);
+		changed |= ImGui::SliderFloat("Opacity", &point.opacity, 0.f, 1.f);
+		bool remove = this->transfer_function.size() > 1 && ImGui::Button("Remove point");
+		ImGui::PopID();
+		if (remove) {
+			this->transfer_function.erase(this->transfer_function.begin() + i);
+			changed = true;
+			break;
+		}
+	}
+
+	// the new point splits the widest gap between points, with the transfer function value there
+	if (ImGui::Button("Add point")) {
+		std::vector<float> densities = { 0.f, 1.f };
+		for (const sTransferPoint& point : this->transfer_function)
+			densities.push_back(std::clamp(point.density, 0.f, 1.f));
+		std::sort(densities.begin(), densities.end());
+		float density = 0.5f;
+		float gap = -1.f;
+		for (size_t i = 1; i < densities.size(); i++) {
+			if (densities[i] - densities[i - 1] > gap) {
+				gap = densities[i] - densities[i - 1];
+				density = (densities[i] + densities[i - 1]) * 0.5f;
+			}
+		}
+		int i = (int)(density * (size - 1) + 0.5f);
+		const float* texel = &this->transfer_table[((size_t)i * size + i) * 4];
+		float opacity = texel[3];
+		sTransferPoint point = { density, { 1.f, 1.f, 1.f }, opacity };
+		if (opacity > 0.f)
+			for (int c = 0; c < 3; c++)
+				point.color[c] = texel[c] / opacity;
+		this->transfer_function.push_back(point);
+		changed = true;
+	}
+
+	if (changed)
+		preintegrateTransferFunction(this->transfer_function, this->transfer_table);
+	this->transfer_function_changed |= changed;
 }
 
-void VolumeMaterial::assignShader()
+void VolumeMaterial::updateTransferFunction()
 {
-	if (this->shaderType == eShaderType::ABSORPTION) {
-		this->shader = this->absorption_shader;
+	if (!this->transfer_function_changed && this->transfer_texture)
+		return;
+
+	// the menu already pre-integrated the edited points, this only does it when the menu is hidden
+	if (this->transfer_table.empty())
+		preintegrateTransferFunction(this->transfer_function, this->transfer_table);
+
+	// filtered between densities, the shader samples at the texel centers
+	if (!this->transfer_texture) {
+		this->transfer_texture = new Texture();
+		this->transfer_texture->create(TRANSFER_FUNCTION_SIZE, TRANSFER_FUNCTION_SIZE, GL_RGBA, GL_FLOAT, false, NULL, GL_RGBA32F);
 	}
-	else if (this->shaderType == eShaderType::EMISSION_ABSORPTION) {
-		this->shader = this->emissive_absorption_shader;
+	this->transfer_texture->upload(GL_RGBA, GL_FLOAT, false, (uint8_t*)this->transfer_table.data(), GL_RGBA32F);
+	this->transfer_function_changed = false;
+
+	// the accumulated frames were rendered with the previous transfer function
+	Application::instance->resetAccumulation();
+}
+
+void VolumeMaterial::assignShader(bool instanced)
+{
+	static const char* pixel_shaders[] = { "res/shaders/absorption.fs", "res/shaders/emissive_absorption.fs", "res/shaders/emissive_scatter_absorption.fs" };
+	const char* ps = pixel_shaders[this->shaderType];
+	const char* vs = instanced ? "res/shaders/basic_instanced.vs" : "res/shaders/basic.vs";
+
+	if (!this->use_shader_variants) {
+		this->shader = instanced ? Shader::Get(vs, ps, "#define INSTANCED\n") : Shader::Get(vs, ps);
+		return;
 	}
-	else if (this->shaderType == eShaderType::EMISSION_SCATTER_ABSORPTION) {
-		this->shader = this->emissive_scatter_absorption_shader;
+
+	// settings that do not change the result are left out, so they share the variant
+	bool jittering = this->isJittering(this->use_jittering) && !(this->densityType == CONSTANT && this->shaderType == ABSORPTION);
+	bool phase_function = this->use_phase_function && this->shaderType == EMISSION_SCATTER_ABSORPTION;
+	bool adaptive_stepping = this->use_adaptive_stepping && !(this->densityType == CONSTANT && this->shaderType == ABSORPTION);
+	bool tracking = this->use_tracking && this->shaderType != ABSORPTION;
+	int num_lights = this->shaderType == EMISSION_SCATTER_ABSORPTION ? this->qualityLights(std::min((int)Application::instance->light_list.size(), MAX_LIGHTS)) : 0;
+	bool transfer_function = this->use_transfer_function && !tracking;
+	bool opacity_maps = this->use_opacity_maps && this->shaderType == EMISSION_SCATTER_ABSORPTION && !tracking;
+	bool virtual_texture = this->densityType == VDB_FILE && this->virtual_volume;
+	bool irradiance_volume = this->use_irradiance_volume && this->shaderType == EMISSION_SCATTER_ABSORPTION;
+	int key = this->shaderType | (this->densityType << 2) | (jittering << 4) | (phase_function << 5) | (adaptive_stepping << 6) | (tracking << 7) | (num_lights << 8) | (transfer_function << 12) | (opacity_maps << 13) | (instanced << 14) | (virtual_texture << 15) | (irradiance_volume << 16);
+
+	auto it = this->shader_variants.find(key);
+	if (it != this->shader_variants.end()) {
+		this->shader = it->second;
+		return;
 	}
+
+	std::string macros = "#define DENSITY_TYPE " + std::to_string((int)this->densityType) + "\n";
+	macros += std::string("#define USE_JITTERING ") + (jittering ? "true" : "false") + "\n";
+	macros += std::string("#define USE_PHASE_FUNCTION ") + (phase_function ? "true" : "false") + "\n";
+	macros += std::string("#define USE_ADAPTIVE_STEPPING ") + (adaptive_stepping ? "true" : "false") + "\n";
+	macros += std::string("#define USE_TRACKING ") + (tracking ? "true" : "false") + "\n";
+	macros += "#define NUM_LIGHTS " + std::to_string(num_lights) + "\n";
+	macros += std::string("#define USE_TRANSFER_FUNCTION ") + (transfer_function ? "true" : "false") + "\n";
+	macros += std::string("#define USE_OPACITY_MAPS ") + (opacity_maps ? "true" : "false") + "\n";
+	macros += std::string("#define VIRTUAL_TEXTURE ") + (virtual_texture ? "true" : "false") + "\n";
+	macros += std::string("#define USE_IRRADIANCE_VOLUME ") + (irradiance_volume ? "true" : "false") + "\n";
+	if (instanced)
+		macros += "#define INSTANCED\n";
+
+	// a variant that fails to compile falls back to the generic shader
+	Shader* variant = Shader::Get(vs, ps, macros.c_str());
+	if (!variant)
+		variant = instanced ? Shader::Get(vs, ps, "#define INSTANCED\n") : Shader::Get(vs, ps);
+	this->shader_variants[key] = variant;
+	this->shader = variant;
 }
 
-IsosurfaceMaterial::IsosurfaceMaterial(glm::vec4 color_, glm::vec4 background_color_, std::string file_path) {
+IsosurfaceMaterial::IsosurfaceMaterial(glm::vec4 color_, std::string file_path) {
 	this->color = color_;
-	this->background_color = background_color_;
 
 	this->kd = glm::vec3(0.2f, 0.3f, 0.8f);
 	this->ks = glm::vec3(0.2f, 0.3f, 0.2f);
@@ -479,15 +1778,17 @@ IsosurfaceMaterial::IsosurfaceMaterial(glm::vec4 color_, glm::vec4 background_co
 	this->noise_scale = 1.54f;
 
 	this->threshold = 0.1f;
+	this->refinement_steps = 4;
 	this->rate_of_change = 0.005f;
 
 	this->densityType = eDensityType::CONSTANT;
 	this->activate_illumination = false;
-	this->shader = Shader::Get("res/shaders/basic.vs", "res/shaders/isosurface.fs");
 
 	this->use_jittering = false;
 	this->use_local_pos = true;
-	this->loadVDB(file_path);
+	this->supports_virtual_texture = false;
+	this->assignShader();
+	this->loadVolume(file_path);
 }
 
 IsosurfaceMaterial::~IsosurfaceMaterial() { }
@@ -499,26 +1800,31 @@ void IsosurfaceMaterial::setUniforms(Camera* camera, glm::mat4 model)
 	glm::vec3 camera_pos = GetInverseCameraPos(camera, model);
 	this->shader->setUniform("u_camera_position", camera_pos);
 	this->shader->setUniform("u_model", model);
-	this->shader->setUniform("u_background_color", this->background_color);
-	this->shader->setUniform("u_step_length", this->step_length);
-	this->shader->setUniform("u_use_jittering", this->use_jittering);
+	float quality_step_scale = this->densityType == eDensityType::CONSTANT ? exp2f(this->qualityLodBias()) : 1.f;
+	this->setProgressiveUniforms(this->step_length * quality_step_scale);
+	this->setSceneDepthUniforms(camera, model);
+	this->shader->setUniform("u_use_jittering", this->isJittering(this->use_jittering));
 
 	this->shader->setUniform("u_density_type", (int)this->densityType);
 	this->shader->setUniform("u_threshold", (float)this->threshold);
+	this->shader->setUniform("u_refinement_steps", this->refinement_steps);
 	this->shader->setUniform("u_illumination_activated", this->activate_illumination);
+	this->setLodUniforms(camera);
+	this->setWindowUniforms(this->densityType == eDensityType::VDB_FILE);
 
 	if (this->densityType == eDensityType::VDB_FILE) {
+		this->updateVDBTexture();
 		if (this->texture) {
 			this->shader->setUniform("u_texture", this->texture, 0);
 		}
 	}
 	if (this->densityType == eDensityType::NOISE_3D) {
-		this->shader->setUniform("u_noise_scale", this->noise_scale);
-		this->shader->setUniform("u_noise_detail", this->noise_detail);
+		this->updateNoiseTexture(this->noise_scale, this->noise_detail);
+		this->shader->setUniform("u_texture", this->noise_texture, 0);
 	}
 
 	if (this->activate_illumination == true) {
-		Application::instance->light_list[0]->setUniforms(this->shader, model);
+		this->shader->setUniform("u_num_lights", this->qualityLights(Light::uploadLightBlock(Application::instance->light_list, model)));
 		this->shader->setUniform("u_kd", this->kd);          // Diffuse coefficient
 		this->shader->setUniform("u_ks", this->ks);          // Specular coefficient
 		this->shader->setUniform("u_alpha", this->alpha);    // Shininess exponent
@@ -532,10 +1838,12 @@ void IsosurfaceMaterial::setUniforms(Camera* camera, glm::mat4 model)
 
 void IsosurfaceMaterial::render(Mesh* mesh, glm::mat4 model, Camera* camera)
 {
+	this->assignShader();
 	if (mesh && this->shader) {
 
-		glEnable(GL_BLEND); //Since it has alpha lower than 1, but since is the only object renderized it wouldn't be necessary
-		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		// premultiplied like the volumes: the surface is opaque, the missed rays leave what is behind
+		glEnable(GL_BLEND);
+		glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
 
 		// enable shader
 		this->shader->enable();
@@ -567,6 +1875,12 @@ void IsosurfaceMaterial::renderInMenu()
 	ImGui::SliderFloat("Step Lenght", (float*)&this->step_length, 0.001f, 0.2f);
 	ImGui::Checkbox("Use jittering filter", &this->use_jittering);
 
+	if (this->densityType != CONSTANT) {
+		ImGui::Checkbox("Distance LOD", &this->use_lod);
+		if (this->use_lod)
+			ImGui::SliderFloat("LOD Bias", (float*)&this->lod_bias, -2.0f, 2.0f);
+	}
+
 	ImGui::Checkbox("Activate Illumination", &this->activate_illumination);
 
 	ImGui::Combo("Density Type", (int*)&densityType, "CONSTANT\0NOISE 3D\0VDB FILE\0");
@@ -576,5 +1890,41 @@ void IsosurfaceMaterial::renderInMenu()
 		ImGui::SliderFloat("Noise Detail", (float*)&this->noise_detail, 1.0f, 5.0f);
 	}
 
+	if (this->densityType == eDensityType::VDB_FILE) {
+		this->renderVoxelizationMenu();
+		this->renderWindowMenu();
+	}
+
 	ImGui::SliderFloat("Density Threshold", (float*)&this->threshold, 0.001f, 0.5f);
-}
\ No newline at end of file
+	ImGui::SliderInt("Hit refinement steps", &this->refinement_steps, 0, 8);
+	ImGui::Checkbox("Specialized shaders", &this->use_shader_variants);
+}
+
+void IsosurfaceMaterial::assignShader()
+{
+	if (!this->use_shader_variants) {
+		this->shader = Shader::Get("res/shaders/basic.vs", "res/shaders/isosurface.fs");
+		return;
+	}
+
+	bool jittering = this->isJittering(this->use_jittering);
+	int num_lights = this->activate_illumination ? this->qualityLights(std::min((int)Application::instance->light_list.size(), MAX_LIGHTS)) : 0;
+	int key = this->densityType | (jittering << 2) | (this->activate_illumination << 3) | (num_lights << 4);
+
+	auto it = this->shader_variants.find(key);
+	if (it != this->shader_variants.end()) {
+		this->shader = it->second;
+		return;
+	}
+
+	std::string macros = "#define DENSITY_TYPE " + std::to_string((int)this->densityType) + "\n";
+	macros += std::string("#define USE_JITTERING ") + (jittering ? "true" : "false") + "\n";
+	macros += std::string("#define USE_ILLUMINATION ") + (this->activate_illumination ? "true" : "false") + "\n";
+	macros += "#define NUM_LIGHTS " + std::to_string(num_lights) + "\n";
+
+	Shader* variant = Shader::Get("res/shaders/basic.vs", "res/shaders/isosurface.fs", macros.c_str());
+	if (!variant)
+		variant = Shader::Get("res/shaders/basic.vs", "res/shaders/isosurface.fs");
+	this->shader_variants[key] = variant;
+	this->shader = variant;
+}
@@ -3,6 +3,7 @@
 #include <glm/vec3.hpp>
 #include <glm/vec4.hpp>
 #include <glm/matrix.hpp>
+#include <map>
 #include <openvdbReader.h>
 #include <bbox.h>
 
@@ -10,6 +11,20 @@
 #include "mesh.h"
 #include "texture.h"
 #include "shader.h"
+#include "volume.h"
+
+#define DEEP_OPACITY_MAP_SIZE 256 //texels per side of the deep opacity map of each light
+#define SLICE_LIGHT_BUFFER_SIZE 512 //texels per side of the light buffer of the half-angle slicing
+#define IRRADIANCE_ITERATIONS_PER_FRAME 4 //diffusion steps of the irradiance volume per frame, until it converges
+#define IRRADIANCE_MAX_ITERATIONS 128
+#define MAX_SHADOW_VOLUMES 4 //volumes whose opacity maps shadow a mesh, it has to match basic.fs
+#define MAX_MERGED_VOLUMES 4 //overlapping volumes marched in a single pass, it has to match merged_volumes.fs
+#define VIRTUAL_TEXTURE_MIN_VOXELS (512 * 512 * 512) //larger scanned volumes always load as virtual texture
+#define VIRTUAL_FEEDBACK_READBACKS 3 //the feedback of a frame is read a few frames later, without stalling
+#define NUM_QUALITY_LEVELS 4 //per node quality levels picked from the screen footprint, 0 is the full quality
+
+class FBO;
+class SceneNode;
 
 class Material {
 public:
@@ -19,14 +34,106 @@ public:
 	glm::vec4 color;
 	bool use_local_pos = true;
 
+	virtual ~Material();
+
 	glm::vec3 GetInverseCameraPos(Camera* camera, glm::mat4 model);
 
 	virtual void setUniforms(Camera* camera, glm::mat4 model) = 0;
 	virtual void render(Mesh* mesh, glm::mat4 model, Camera* camera) = 0;
 	virtual void renderInMenu() = 0;
 
+	//baked 3D noise, sampled like the VDB texture and re-baked in background when its parameters change
+	Texture* noise_texture = NULL;
+	VolumeBakeTask noise_bake;
+	float baked_noise_scale = -1.f;
+	int baked_noise_octaves = -1;
+
+	//level of detail of the density texture, picked in the shader from the distance and pixel footprint
+	bool use_lod = true;
+	float lod_bias = 0.f;
+
+	//quality level of the node being drawn (see VolumeNode::quality_level), the nodes sharing the material set it
+	//before each draw. Every level adds to the LOD bias (coarser mips and longer steps), the last ones drop the jitter
+	//and march fewer lights
+	int quality_level = 0;
+
+	//node being drawn, NULL for the draws without one. What depends on its model is kept per node (see
+	//VolumeMaterial::opacity_maps), VolumeNode::render sets it before each draw
+	const SceneNode* node = NULL;
+
+	//voxelization of the VDB grids (or splatting of the particles), editable from the menu and re-baked in background
+	//particles is declared before vdb_bake so the worker reading it is joined first
+	easyVDB::OpenVDBReader* vdb_reader = NULL;
+	std::vector<sParticle> particles;
+	VolumeBakeTask vdb_bake;
+	int vdb_resolution = 128;
+	float vdb_radius = 2.0f;
+
+	//specialized shader variants, compiled on first use and cached by the settings packed in the key
+	//the generic shader (use_shader_variants = false) branches on uniforms instead
+	bool use_shader_variants = true;
+	std::map<int, Shader*> shader_variants;
+
+	//scanned volumes (.raw/.nrrd) keep their 8/16 bit values, the shader remaps them with a window/level
+	bool raw_volume = false;
+	float window_level = 0.5f;
+	float window_width = 1.0f;
+
+	//virtual texturing of the scanned volumes too large for the GPU memory (see VirtualVolume): texture keeps a coarse
+	//level, the shaders stamp the bricks they want in the feedback buffer and they are paged in to brick_atlas
+	bool use_virtual_texture = false;
+	bool supports_virtual_texture = true; //false for the materials whose shaders only sample texture (the isosurface)
+	int virtual_atlas_slots = 8; //per side, 8 is an atlas of 272^3 16 bit texels (40 MB)
+	int virtual_max_uploads = 16; //bricks paged in per frame
+	std::string raw_path;
+	VirtualVolume* virtual_volume = NULL;
+	Texture* brick_atlas = NULL;
+	unsigned int page_table_buffer = 0;
+	unsigned int feedback_buffer = 0;
+	uint32_t virtual_frame = 1; //stamp of the draws of this frame, all the nodes that share the material use it
+	unsigned int virtual_update_frame = 0; //Application::frame_count of the last update, once per frame
+
+	//copies of the feedback at the end of every frame, read once their fence has signaled
+	unsigned int feedback_readbacks[VIRTUAL_FEEDBACK_READBACKS] = {};
+	GLsync feedback_fences[VIRTUAL_FEEDBACK_READBACKS] = {};
+	uint32_t feedback_frames[VIRTUAL_FEEDBACK_READBACKS] = {};
+	int feedback_readback_index = 0;
+
+	//upper bound of the density per block of voxels (see buildMajorantGrid) for the delta/ratio tracking
+	Texture* majorant_texture = NULL;
+	Texture* noise_majorant_texture = NULL;
+
+	//counts the volume uploads of every material, what is derived from a volume is rebuilt when it changes
+	static int volume_uploads;
+
+	void loadVolume(std::string file_path);
 	void loadVDB(std::string file_path);
+	void loadParticles(std::string file_path);
+	void loadRawVolume(std::string file_path);
+	void loadVirtualVolume(std::string file_path);
+	void releaseVirtualVolume();
+	void updateVirtualTexture();
+	void setVirtualTextureUniforms(bool sampling_file);
 	void estimate3DTexture(easyVDB::OpenVDBReader* vdbReader);
+	void uploadFileVolume(const VolumeData& volume);
+	void requestVoxelization();
+	void updateVDBTexture();
+	void renderVoxelizationMenu();
+	void renderWindowMenu();
+	void updateNoiseTexture(float noise_scale, float noise_detail);
+	void setLodUniforms(Camera* camera);
+	void setWindowUniforms(bool sampling_file);
+	float getProgressiveStepScale(float& jitter_offset);
+	void setProgressiveUniforms(float step_length);
+	void setSceneDepthUniforms(Camera* camera, const glm::mat4& model);
+	bool isJittering(bool use_jittering); //progressive and temporal rendering always jitter, every frame with a new offset
+	float qualityLodBias();
+	int qualityLights(int num_lights); //lights marched at the quality level
+
+	//uploads the volume with its mip chain, the texture is (re)created if NULL or the size or format changed
+	static Texture* uploadVolumeTexture(Texture* texture, const VolumeData& volume, unsigned int internal_format = GL_R8);
+	static Texture* uploadMajorantTexture(Texture* texture, const VolumeData& majorants);
+	static bool voxelizeVDB(easyVDB::OpenVDBReader* vdbReader, VolumeData& volume, int resolution, float radius, const std::atomic<bool>* cancelled = NULL);
 };
 
 class FlatMaterial : public Material {
@@ -62,6 +169,7 @@ public:
 	~StandardMaterial();
 
 	void setUniforms(Camera* camera, glm::mat4 model);
+	void setShadowUniforms(int light_index);
 	void render(Mesh* mesh, glm::mat4 model, Camera* camera);
 	void renderInMenu();
 };
@@ -78,7 +186,6 @@ public:
 	eShaderType shaderType;
 
 	//Homogenous
-	glm::vec4 background_color;
 	float absorption_coefficient;
 
 	//Heterogeneous
@@ -95,22 +202,98 @@ public:
 	//jittering
 	bool use_jittering;
 
+	//adaptive stepping: the step is scaled between 0.5 and adaptive_max_factor times step_length
+	//keeping the optical depth of each step close to adaptive_tolerance
+	bool use_adaptive_stepping;
+	float adaptive_tolerance;
+	float adaptive_max_factor;
+
 	float density_multiplier;
 	float scaterring_coefficient;
 
-	Shader* absorption_shader;
-	Shader* emissive_absorption_shader;
-	Shader* emissive_scatter_absorption_shader;
-
-	VolumeMaterial(glm::vec4 background_color_);
-	VolumeMaterial(glm::vec4 background_color_, std::string file_path);
+	//delta tracking of the camera rays and ratio tracking of the light rays instead of the fixed steps
+	//unbiased, but noisy with few samples per pixel: meant for the progressive and temporal rendering
+	bool use_tracking;
+	int tracking_samples;
+
+	//transfer function from density to emitted color and opacity, pre-integrated on the CPU whenever it changes
+	//the marchers read the average of each step segment from the table, so it holds with longer steps
+	bool use_transfer_function;
+	std::vector<sTransferPoint> transfer_function;
+	std::vector<float> transfer_table;
+	Texture* transfer_texture;
+	bool transfer_function_changed;
+
+	//deep opacity maps: optical depth from each light through the volume (see deep_opacity.fs), rendered only when
+	//the lights, the node or the volume change. The scattering shader and the shadows on the meshes look them up.
+	//They are in the local space of the node, every node that shares the material has its own
+	struct sOpacityMaps
+	{
+		std::vector<FBO*> maps;
+		std::vector<glm::mat4> viewprojections; //local space to the map clip space, zero if the light is inside
+		std::vector<glm::vec3> lights; //light positions in the local space
+		std::vector<float> state; //what the maps were rendered with
+	};
+	bool use_opacity_maps;
+	std::map<const SceneNode*, sOpacityMaps> opacity_maps;
+
+	//irradiance volume (see IrradianceVolume): multiple scattering and ambient light the scattering shader adds with
+	//one lookup per sample. Rebuilt when the medium changes, after the lights move it only iterates again from the
+	//previous solution, IRRADIANCE_ITERATIONS_PER_FRAME steps per frame. The lights are in the local space of the
+	//node, every node that shares the material has its own volume over the medium read back once
+	struct sIrradiance
+	{
+		IrradianceVolume volume;
+		Texture* texture = NULL;
+		std::vector<float> medium_state; //what the volume was built with
+		std::vector<float> light_state;
+	};
+	bool use_irradiance_volume;
+	float irradiance_strength;
+	float irradiance_ambient; //scale of the ambient light of the scene coming from outside the volume
+	VolumeData irradiance_medium; //density at about IRRADIANCE_VOLUME_SIZE, after the window and transfer function
+	std::vector<float> irradiance_medium_state;
+	std::map<const SceneNode*, sIrradiance> irradiance_volumes;
+
+	//half-angle slicing (see slice.fs) of the scattering shader with the first light: slices step_length apart are
+	//drawn alternately to the eye and the light buffers, instead of marching to the light from every sample
+	bool use_half_angle_slicing;
+	FBO* slice_eye_buffer;
+	FBO* slice_light_buffer;
+
+	//tiled compute marcher (see tiled_volume.cs) of the absorption and emission-absorption shaders, it writes
+	//to compute_target only the tiles inside the projected volume, and the target is blended over the frame
+	bool use_compute;
+	Texture* compute_target;
+
+	VolumeMaterial();
+	VolumeMaterial(std::string file_path);
 	~VolumeMaterial();
 
 	void setUniforms(Camera* camera, glm::mat4 model);
 	void render(Mesh* mesh, glm::mat4 model, Camera* camera);
 	void renderInMenu();
-
-	void assignShader();
+	void renderTransferFunctionMenu();
+	void updateTransferFunction();
+	void updateOpacityMaps(const SceneNode* node, const glm::mat4& model);
+	void setOpacityMapUniforms();
+	void updateIrradianceVolume(const SceneNode* node, const glm::mat4& model);
+	void setIrradianceUniforms();
+	bool canRenderCompute();
+	bool canRenderSlices();
+	bool renderSlices(glm::mat4 model, Camera* camera); //false if it cannot slice (the light inside the volume)
+	void renderCompute(glm::mat4 model, Camera* camera);
+	Texture* updateDensityTexture(); //the texture the marchers sample, NULL for the constant density
+	bool canMerge();
+	bool canInstance();
+
+	//one instanced draw of the nodes that share this material and mesh (see basic_instanced.vs)
+	void renderInstanced(Mesh* mesh, const std::vector<glm::mat4>& models, Camera* camera);
+
+	//marches the overlapping volumes together (see merged_volumes.fs), up to MAX_MERGED_VOLUMES
+	static void renderMerged(const std::vector<VolumeMaterial*>& materials, const std::vector<glm::mat4>& models, Camera* camera);
+
+	void assignShader(bool instanced = false);
 };
 
 class IsosurfaceMaterial : public Material
@@ -122,7 +305,6 @@ public:
 	eDensityType densityType;
 	bool activate_illumination;
 
-	glm::vec4 background_color;
 	float step_length;
 	float noise_scale;
 	float noise_detail;
@@ -140,11 +322,14 @@ public:
 	float rate_of_change;
 
 	float threshold;
+	int refinement_steps; //secant steps on the hit, they allow a coarser step for the same surface
 
-	IsosurfaceMaterial(glm::vec4 color_, glm::vec4 background_color_, std::string file_path);
+	IsosurfaceMaterial(glm::vec4 color_, std::string file_path);
 	~IsosurfaceMaterial();
 
 	void setUniforms(Camera* camera, glm::mat4 model);
 	void render(Mesh* mesh, glm::mat4 model, Camera* camera);
 	void renderInMenu();
+
+	void assignShader();
 };
\ No newline at end of file
@@ -386,6 +386,55 @@ void Mesh::renderInstanced(unsigned int primitive, const glm::mat4* instanced_mo
 	}
 }
 
+//the model and inverse model of every instance are interleaved in the buffer, the shader reads them as
+//attributes mat4 u_model and mat4 u_inverse_model
+void Mesh::renderInstanced(unsigned int primitive, const glm::mat4* instanced_models, const glm::mat4* instanced_inverse_models, int num_instances)
+{
+	if (!num_instances)
+		return;
+
+	Shader* shader = Shader::current;
+	assert(shader && "shader must be enabled");
+
+	std::vector<glm::mat4> matrices(num_instances * 2);
+	for (int i = 0; i < num_instances; ++i)
+	{
+		matrices[i * 2] = instanced_models[i];
+		matrices[i * 2 + 1] = instanced_inverse_models[i];
+	}
+
+	if (instances_buffer_id == 0)
+		glGenBuffersARB(1, &instances_buffer_id);
+	glBindBufferARB(GL_ARRAY_BUFFER_ARB, instances_buffer_id);
+	glBufferDataARB(GL_ARRAY_BUFFER_ARB, matrices.size() * sizeof(glm::mat4), &matrices[0], GL_STREAM_DRAW_ARB);
+
+	int attribLocations[2] = { shader->getAttribLocation("u_model"), shader->getAttribLocation("u_inverse_model") };
+	assert(attribLocations[0] != -1 && attribLocations[1] != -1 && "shader must have attributes mat4 u_model and u_inverse_model");
+	if (attribLocations[0] == -1 || attribLocations[1] == -1)
+		return;
+
+	for (int m = 0; m < 2; ++m)
+		for (int k = 0; k < 4; ++k)
+		{
+			glEnableVertexAttribArray(attribLocations[m] + k);
+			int offset = sizeof(glm::mat4) * m + sizeof(float) * 4 * k;
+			const uint8_t* addr = (uint8_t*)offset;
+			glVertexAttribPointer(attribLocations[m] + k, 4, GL_FLOAT, false, sizeof(glm::mat4) * 2, addr);
+			glVertexAttribDivisor(attribLocations[m] + k, 1);
+		}
+
+	//regular render
+	render(primitive, -1, num_instances);
+
+	//disable instanced attribs
+	for (int m = 0; m < 2; ++m)
+		for (int k = 0; k < 4; ++k)
+		{
+			glDisableVertexAttribArray(attribLocations[m] + k);
+			glVertexAttribDivisor(attribLocations[m] + k, 0);
+		}
+}
+
 void Mesh::renderInstanced(unsigned int primitive, const std::vector<glm::vec3> positions, const char* uniform_name)
 {
 	if (!positions.size())
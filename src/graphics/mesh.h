@@ -120,6 +120,7 @@ public:
 
 	void render(unsigned int primitive, int submesh_id = -1, int num_instances = 0);
 	void renderInstanced(unsigned int primitive, const glm::mat4* instanced_models, int number);
+	void renderInstanced(unsigned int primitive, const glm::mat4* instanced_models, const glm::mat4* instanced_inverse_models, int number);
 	void renderInstanced(unsigned int primitive, const std::vector<glm::vec3> positions, const char* uniform_name);
 	void renderBounding(const glm::mat4& model, bool world_bounding = true);
 	void renderFixedPipeline(int primitive); //sloooooooow
@@ -7,6 +7,7 @@
 #include <functional> 
 #include <cctype>
 #include <locale>
+#include <set>
 
 #include "texture.h"
 
@@ -55,6 +56,7 @@ REGISTER_GLEXT(void, glUniformMatrix4fv, GLint location, GLsizei count, GLboolea
 #endif
 
 std::map<std::string, Shader*> Shader::s_Shaders;
+std::set<std::string> Shader::s_failed_shaders;
 bool Shader::s_ready = false;
 Shader* Shader::current = NULL;
 
@@ -62,6 +64,7 @@ Shader::Shader()
 {
 	if (!Shader::s_ready)
 		Shader::init();
+	vs = fs = cs = program = 0;
 	compiled = false;
 	from_atlas = false;
 }
@@ -77,6 +80,60 @@ void Shader::setFilenames(const std::string& vsf, const std::string& psf)
 	ps_filename = psf;
 }
 
+//replaces the #include "file" lines with the file, relative to the including one, so the helpers the volume shaders
+//share live in one place (res/shaders/include). Every file goes in once, the later includes of it are dropped
+static bool resolveIncludes(std::string& code, const std::string& filename, std::set<std::string>& included)
+{
+	std::string directory = filename.substr(0, filename.find_last_of("/\\") + 1);
+	std::string result;
+	size_t line_start = 0;
+	while (line_start < code.size()) {
+		size_t line_end = code.find('\n', line_start);
+		if (line_end == std::string::npos)
+			line_end = code.size();
+		std::string line = code.substr(line_start, line_end - line_start);
+		line_start = line_end + 1;
+
+		size_t directive = line.find_first_not_of(" \t");
+		if (directive == std::string::npos || line.compare(directive, 8, "#include") != 0) {
+			result += line + "\n";
+			continue;
+		}
+
+		size_t first_quote = line.find('"', directive);
+		size_t last_quote = line.find('"', first_quote + 1);
+		if (first_quote == std::string::npos || last_quote == std::string::npos) {
+			std::cout << "Error: malformed #include in " << filename << ": " << line << std::endl;
+			return false;
+		}
+		std::string include_path = directory + line.substr(first_quote + 1, last_quote - first_quote - 1);
+		if (!included.insert(include_path).second)
+			continue;
+
+		std::string include_code;
+		if (!readFile(include_path, include_code) || !resolveIncludes(include_code, include_path, included)) {
+			std::cout << "Error: cannot include " << include_path << " in " << filename << std::endl;
+			return false;
+		}
+		result += include_code;
+	}
+	code = result;
+	return true;
+}
+
+//macros have to go after the #version line, which must be the first statement of the shader
+static std::string injectMacros(const std::string& code, const std::string& macros)
+{
+	size_t version = code.find("#version");
+	if (version == std::string::npos)
+		return macros + "\n" + code;
+
+	size_t line_end = code.find('\n', version);
+	if (line_end == std::string::npos)
+		return code + "\n" + macros + "\n";
+	return code.substr(0, line_end + 1) + macros + "\n" + code.substr(line_end + 1);
+}
+
 bool Shader::load(const std::string& vsf, const std::string& psf, const char* macros)
 {
 	assert(compiled == false);
@@ -90,15 +147,16 @@ bool Shader::load(const std::string& vsf, const std::string& psf, const char* ma
 
 	std::cout << " + Shader: Vertex: " << vsf << "  Pixel: " << psf << "  " << (macros && printMacros ? macros : "") << std::endl;
 	std::string vsm, psm;
-	if (!readFile(vsf, vsm) || !readFile(psf, psm))
+	std::set<std::string> vs_included, ps_included;
+	if (!readFile(vsf, vsm) || !readFile(psf, psm) || !resolveIncludes(vsm, vsf, vs_included) || !resolveIncludes(psm, psf, ps_included))
 		return false;
 
 	//printf("Vertex shader from memory:\n%s\n", vsm.c_str());
 	//printf("Fragment shader from memory:\n%s\n", psm.c_str());
 	if (macros)
 	{
-		vsm = macros + vsm;
-		psm = macros + psm;
+		vsm = injectMacros(vsm, macros);
+		psm = injectMacros(psm, macros);
 		this->macros = macros;
 	}
 
@@ -110,6 +168,33 @@ bool Shader::load(const std::string& vsf, const std::string& psf, const char* ma
 	return true;
 }
 
+bool Shader::loadCompute(const std::string& csf, const char* macros)
+{
+	assert(compiled == false);
+	assert(glGetError() == GL_NO_ERROR);
+
+	cs_filename = csf;
+
+	std::cout << " + Shader: Compute: " << csf << std::endl;
+	std::string csm;
+	std::set<std::string> included;
+	if (!readFile(csf, csm) || !resolveIncludes(csm, csf, included))
+		return false;
+
+	if (macros)
+	{
+		csm = injectMacros(csm, macros);
+		this->macros = macros;
+	}
+
+	if (!compileComputeFromMemory(csm))
+		return false;
+
+	assert(glGetError() == GL_NO_ERROR);
+
+	return true;
+}
+
 Shader* Shader::Get(const char* vsf, const char* psf, const char* macros)
 {
 	std::string name;
@@ -122,12 +207,34 @@ Shader* Shader::Get(const char* vsf, const char* psf, const char* macros)
 	if (it != s_Shaders.end())
 		return it->second;
 
-	if (!psf)
+	if (!psf || s_failed_shaders.count(name))
+		return NULL;
+
+	Shader* sh = new Shader();
+	if (!sh->load(vsf, psf, macros)) {
+		delete sh;
+		s_failed_shaders.insert(name);
+		return NULL;
+	}
+	s_Shaders[name] = sh;
+	return sh;
+}
+
+Shader* Shader::GetCompute(const char* csf, const char* macros)
+{
+	std::string name = std::string("compute:") + csf + (macros ? macros : "");
+	std::map<std::string, Shader*>::iterator it = s_Shaders.find(name);
+	if (it != s_Shaders.end())
+		return it->second;
+	if (s_failed_shaders.count(name))
 		return NULL;
 
 	Shader* sh = new Shader();
-	if (!sh->load(vsf, psf, macros))
+	if (!sh->loadCompute(csf, macros)) {
+		delete sh;
+		s_failed_shaders.insert(name);
 		return NULL;
+	}
 	s_Shaders[name] = sh;
 	return sh;
 }
@@ -136,6 +243,7 @@ void Shader::ReloadAll()
 {
 	for (std::map<std::string, Shader*>::iterator it = s_Shaders.begin(); it != s_Shaders.end(); it++)
 		it->second->recompile();
+	s_failed_shaders.clear(); //tried again the next time they are requested
 	if (!s_shader_atlas_filename.empty())
 		LoadAtlas(s_shader_atlas_filename.c_str());
 	std::cout << "Shaders recompiled" << std::endl;
@@ -239,8 +347,8 @@ bool Shader::LoadAtlas(const char* filename)
 			continue;
 		}
 
-		vs_code = macros + "\n" + vs_code;
-		fs_code = macros + "\n" + fs_code;
+		vs_code = injectMacros(vs_code, macros);
+		fs_code = injectMacros(fs_code, macros);
 
 		Shader* shader = NULL;
 		auto it = s_Shaders.find(name);
@@ -277,6 +385,11 @@ bool Shader::compile()
 
 bool Shader::recompile()
 {
+	if (!cs_filename.empty())
+	{
+		release();
+		return loadCompute(cs_filename, macros.size() ? macros.c_str() : NULL);
+	}
 	if (from_atlas || !vs_filename.size() || !ps_filename.size()) //shaders compiled from memory cannot be recompiled
 		return false;
 	release(); //remove old shader
@@ -342,6 +455,36 @@ bool Shader::compileFromMemory(const std::string& vsm, const std::string& psm)
 	return true;
 }
 
+bool Shader::compileComputeFromMemory(const std::string& csm)
+{
+	program = glCreateProgram();
+	assert(glGetError() == GL_NO_ERROR);
+
+	if (!createShaderObject(GL_COMPUTE_SHADER, cs, csm))
+	{
+		printf("Compute shader compilation failed\n");
+		return false;
+	}
+
+	glLinkProgram(program);
+	assert(glGetError() == GL_NO_ERROR);
+
+	GLint linked = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	assert(glGetError() == GL_NO_ERROR);
+
+	if (!linked)
+	{
+		saveProgramInfoLog(program);
+		release();
+		return false;
+	}
+
+	compiled = true;
+
+	return true;
+}
+
 bool Shader::validate()
 {
 	glValidateProgram(program);
@@ -425,6 +568,13 @@ void Shader::release()
 		fs = 0;
 	}
 
+	if (cs)
+	{
+		glDeleteShader(cs);
+		assert(glGetError() == GL_NO_ERROR);
+		cs = 0;
+	}
+
 	if (program)
 	{
 		glDeleteProgram(program);
@@ -564,9 +714,11 @@ int Shader::getUniformLocation(const char* varname)
 
 void Shader::setTexture(const char* varname, Texture* tex, int slot)
 {
-	glBindTexture(tex->texture_type, tex->texture_id);
+	//the unit has to be active before binding, otherwise the texture goes to the previous one
 	glActiveTexture(GL_TEXTURE0 + slot);
+	glBindTexture(tex->texture_type, tex->texture_id);
 	setUniform1(varname, slot);
+	glActiveTexture(GL_TEXTURE0);
 }
 
 /*
@@ -8,6 +8,7 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include <cassert>
 
 #include <glm/vec3.hpp>
@@ -40,9 +41,11 @@ public:
 	virtual bool recompile();
 
 	virtual bool load(const std::string& vsf, const std::string& psf, const char* macros);
+	virtual bool loadCompute(const std::string& csf, const char* macros);
 
 	//internal functions
 	virtual bool compileFromMemory(const std::string& vsm, const std::string& psm);
+	virtual bool compileComputeFromMemory(const std::string& csm);
 	virtual void release();
 	virtual void enable();
 	virtual void disable();
@@ -67,6 +70,9 @@ public:
 	//for textures you must specify an slot (a number from 0 to 16) where this texture is stored in the shader
 	void setUniform(const char* varname, Texture* texture, int slot) { assert(current == this); setTexture(varname, texture, slot); }
 
+	//compute shaders only, the shader has to be enabled
+	void dispatch(int groups_x, int groups_y, int groups_z = 1) { assert(current == this && !cs_filename.empty()); glDispatchCompute(groups_x, groups_y, groups_z); }
+
 
 	virtual void setInt(const char* varname, const int& input) { setUniform1(varname, input); }
 	virtual void setFloat(const char* varname, const float& input) { setUniform1(varname, input); }
@@ -112,8 +118,10 @@ public:
 	void setMacros(const char* macros);
 
 	static Shader* Get(const char* vsf, const char* psf = NULL, const char* macros = NULL);
+	static Shader* GetCompute(const char* csf, const char* macros = NULL);
 	static void ReloadAll();
 	static std::map<std::string, Shader*> s_Shaders;
+	static std::set<std::string> s_failed_shaders; //names that did not compile, not tried again until ReloadAll
 
 	//this is a way to load a single file that contains all the shaders 
 	//to know more about the file format, it is based in this https://github.com/jagenjo/rendeer.js/tree/master/guides#the-shaders but with tiny differences
@@ -128,6 +136,7 @@ protected:
 	std::string info_log;
 	std::string vs_filename;
 	std::string ps_filename;
+	std::string cs_filename; //only compute shaders have it, and no vertex or pixel shader
 	std::string macros;
 	bool from_atlas;
 
@@ -141,6 +150,7 @@ protected:
 
 	GLuint vs;
 	GLuint fs;
+	GLuint cs;
 	GLuint program;
 	std::string log;
 
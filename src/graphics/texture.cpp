@@ -181,6 +181,96 @@ void Texture::upload3D(float* data, unsigned int mag_filter, unsigned int min_fi
 	assert(checkGLErrors() && "Error uploading texture");
 }
 
+void Texture::upload3DMipmaps(const std::vector<const float*>& levels) {
+	assert(this->texture_id && "Must create texture before uploading data.");
+	assert(this->texture_type == GL_TEXTURE_3D && "Texture type does not match.");
+	assert(levels.size() && "At least the base level is needed.");
+
+	glBindTexture(this->texture_type, this->texture_id);
+
+	for (int level = 0; level < (int)levels.size(); level++) {
+		int w = std::max((int)this->width >> level, 1);
+		int h = std::max((int)this->height >> level, 1);
+		int d = std::max((int)this->depth >> level, 1);
+		glTexImage3D(this->texture_type, level, this->internal_format, w, h, d, 0, this->format, this->type, levels[level]);
+	}
+
+	// only the uploaded levels are used, so the chain is complete even if it stops before 1x1x1
+	this->mipmaps = levels.size() > 1;
+	glTexParameteri(this->texture_type, GL_TEXTURE_BASE_LEVEL, 0);
+	glTexParameteri(this->texture_type, GL_TEXTURE_MAX_LEVEL, (int)levels.size() - 1);
+	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, this->mipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+	glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+	glBindTexture(this->texture_type, 0);
+	assert(checkGLErrors() && "Error uploading texture");
+}
+
+void Texture::create3DRaw(unsigned int width, unsigned int height, unsigned int depth, unsigned int type, const void* data, bool swap_bytes)
+{
+	assert(width && height && depth && "texture must have a size");
+	assert((type == GL_UNSIGNED_BYTE || type == GL_UNSIGNED_SHORT) && "only 8 and 16 bit voxels");
+
+	if (this->texture_id != 0)
+		clear();
+
+	this->width = (float)width;
+	this->height = (float)height;
+	this->depth = (float)depth;
+	this->format = GL_RED;
+	this->type = type;
+	this->internal_format = type == GL_UNSIGNED_SHORT ? GL_R16 : GL_R8; //normalized, the shader reads [0, 1]
+	this->texture_type = GL_TEXTURE_3D;
+	this->mipmaps = true;
+
+	glGenTextures(1, &this->texture_id);
+	glBindTexture(this->texture_type, this->texture_id);
+
+	// rows of raw files are tightly packed, and big endian data is swapped by the driver while copying
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glPixelStorei(GL_UNPACK_SWAP_BYTES, swap_bytes ? GL_TRUE : GL_FALSE);
+	glTexImage3D(this->texture_type, 0, this->internal_format, width, height, depth, 0, this->format, this->type, data);
+	glPixelStorei(GL_UNPACK_SWAP_BYTES, GL_FALSE);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+	// the mip chain for the distance LOD is built on the GPU, no CPU side copy of the voxels is needed
+	glGenerateMipmap(this->texture_type);
+	glTexParameteri(this->texture_type, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(this->texture_type, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(this->texture_type, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
+
+	glBindTexture(this->texture_type, 0);
+	assert(checkGLErrors() && "Error uploading texture");
+}
+
+void Texture::upload3DRegion(int x, int y, int z, int width, int height, int depth, const float* data)
+{
+	assert(this->texture_id && this->texture_type == GL_TEXTURE_3D && "Must create the 3D texture first.");
+
+	glBindTexture(this->texture_type, this->texture_id);
+	glTexSubImage3D(this->texture_type, 0, x, y, z, width, height, depth, GL_RED, GL_FLOAT, data);
+	glBindTexture(this->texture_type, 0);
+	assert(checkGLErrors() && "Error uploading texture region");
+}
+
+void Texture::download3D(int level, std::vector<float>& data, int& width, int& height, int& depth)
+{
+	assert(this->texture_id && this->texture_type == GL_TEXTURE_3D && "Must create the 3D texture first.");
+
+	glBindTexture(this->texture_type, this->texture_id);
+	glGetTexLevelParameteriv(this->texture_type, level, GL_TEXTURE_WIDTH, &width);
+	glGetTexLevelParameteriv(this->texture_type, level, GL_TEXTURE_HEIGHT, &height);
+	glGetTexLevelParameteriv(this->texture_type, level, GL_TEXTURE_DEPTH, &depth);
+	data.resize((size_t)width * height * depth);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glGetTexImage(this->texture_type, level, GL_RED, GL_FLOAT, data.data());
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glBindTexture(this->texture_type, 0);
+	assert(checkGLErrors() && "Error downloading texture");
+}
+
 void Texture::createCubemap(unsigned int width, unsigned int height, uint8_t** data, unsigned int format, unsigned int type, bool mipmaps, unsigned int internal_format)
 {
 	assert(width && height && "texture must have a size");
@@ -7,6 +7,7 @@
 #include "../framework/includes.h"
 #include <map>
 #include <string>
+#include <vector>
 #include <cassert>
 
 #include <glm/vec4.hpp>
@@ -103,6 +104,10 @@ public:
 	void upload(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, uint8_t* data = NULL, unsigned int internal_format = 0);
 	void upload3D(unsigned int format = GL_RED, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, uint8_t* data = NULL, unsigned int internal_format = 0);
 	void upload3D(float* data = NULL, unsigned int mag_filter = GL_LINEAR, unsigned int min_filter = GL_LINEAR, unsigned int wrap = GL_CLAMP_TO_EDGE);
+	void upload3DMipmaps(const std::vector<const float*>& levels); //levels[0] is the full size, every next level halves it
+	void create3DRaw(unsigned int width, unsigned int height, unsigned int depth, unsigned int type, const void* data, bool swap_bytes = false); //GL_UNSIGNED_BYTE or GL_UNSIGNED_SHORT voxels, no conversion on the CPU
+	void upload3DRegion(int x, int y, int z, int width, int height, int depth, const float* data); //part of a created 3D texture, GL_RED floats
+	void download3D(int level, std::vector<float>& data, int& width, int& height, int& depth); //one mip level of a 3D texture, GL_RED floats
 	void uploadCubemap(unsigned int format = GL_RGB, unsigned int type = GL_UNSIGNED_BYTE, bool mipmaps = true, uint8_t** data = NULL, unsigned int internal_format = 0);
 	void uploadAsArray(unsigned int texture_size, bool mipmaps = true);
 
@@ -0,0 +1,1320 @@
+#include "volume.h"
+
+#include "../framework/utils.h"
+
+#include <cmath>
+#include <cfloat>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+
+#ifdef _WIN32
+	#ifndef NOMINMAX
+		#define NOMINMAX
+	#endif
+	#include <windows.h>
+#else
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+// the AVX2 noise kernel is compiled for AVX2 on its own and picked at runtime, the rest of the
+// program stays baseline x86 and runs on any CPU
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+	#define VOLUME_AVX2
+	#include <immintrin.h>
+	#if defined(_MSC_VER)
+		#include <intrin.h>
+		#define AVX2_TARGET
+	#else
+		#define AVX2_TARGET __attribute__((target("avx2")))
+	#endif
+#endif
+
+void VolumeData::resize(int width, int height, int depth)
+{
+	this->width = width;
+	this->height = height;
+	this->depth = depth;
+	this->data.assign((size_t)width * height * depth, 0.f);
+}
+
+/// Volume Bake Task
+
+VolumeBakeTask::~VolumeBakeTask()
+{
+	cancel();
+	joinRetired(true);
+}
+
+void VolumeBakeTask::start(BakeFunction bake)
+{
+	// only one bake at a time, the old result is useless once new parameters arrive
+	cancel();
+	joinRetired(false);
+
+	this->current = std::make_unique<sJob>();
+	sJob* job = this->current.get();
+	job->worker = std::thread([this, job, bake]() {
+		VolumeData volume;
+		bool finished = bake(volume, job->cancelled);
+		{
+			// cancel() flags the job under the same lock, a cancelled bake never publishes
+			std::lock_guard<std::mutex> lock(this->result_mutex);
+			if (finished && !job->cancelled) {
+				this->result = std::move(volume);
+				this->has_result = true;
+			}
+		}
+		job->finished = true;
+	});
+}
+
+void VolumeBakeTask::cancel()
+{
+	std::lock_guard<std::mutex> lock(this->result_mutex);
+	this->has_result = false;
+	retire();
+}
+
+void VolumeBakeTask::retire()
+{
+	if (this->current) {
+		this->current->cancelled = true;
+		this->retired.push_back(std::move(this->current));
+	}
+}
+
+// the finished workers join immediately, the others only if wait (the destructor)
+void VolumeBakeTask::joinRetired(bool wait)
+{
+	for (auto it = this->retired.begin(); it != this->retired.end();) {
+		if (wait || (*it)->finished) {
+			(*it)->worker.join();
+			it = this->retired.erase(it);
+		}
+		else
+			it++;
+	}
+}
+
+bool VolumeBakeTask::fetch(VolumeData& volume)
+{
+	joinRetired(false);
+
+	std::lock_guard<std::mutex> lock(this->result_mutex);
+	if (!this->has_result)
+		return false;
+
+	volume = std::move(this->result);
+	this->has_result = false;
+	return true;
+}
+
+/// Mipmaps
+
+static void downsample(const VolumeData& src, VolumeData& dst, bool clamp_source)
+{
+	dst.resize(std::max(src.width / 2, 1), std::max(src.height / 2, 1), std::max(src.depth / 2, 1));
+
+	// 2x2x2 average, odd sizes reuse the last texel
+	parallelFor(0, dst.depth, [&](int first, int last, int thread_id) {
+		for (int z = first; z < last; z++) {
+			int z0 = std::min(z * 2, src.depth - 1), z1 = std::min(z * 2 + 1, src.depth - 1);
+			for (int y = 0; y < dst.height; y++) {
+				int y0 = std::min(y * 2, src.height - 1), y1 = std::min(y * 2 + 1, src.height - 1);
+				for (int x = 0; x < dst.width; x++) {
+					int x0 = std::min(x * 2, src.width - 1), x1 = std::min(x * 2 + 1, src.width - 1);
+					int xs[2] = { x0, x1 }, ys[2] = { y0, y1 }, zs[2] = { z0, z1 };
+
+					float sum = 0.f;
+					for (int k = 0; k < 8; k++) {
+						float value = src.data[((size_t)zs[k >> 2] * src.height + ys[(k >> 1) & 1]) * src.width + xs[k & 1]];
+						sum += clamp_source ? std::clamp(value, 0.f, 1.f) : value;
+					}
+					dst.data[((size_t)z * dst.height + y) * dst.width + x] = sum * 0.125f;
+				}
+			}
+		}
+	});
+}
+
+void buildMipChain(const VolumeData& volume, std::vector<VolumeData>& levels)
+{
+	int num_levels = 0;
+	for (int size = std::max({ volume.width, volume.height, volume.depth }); size > 1; size /= 2)
+		num_levels++;
+
+	levels.resize(num_levels);
+	for (int i = 0; i < num_levels; i++)
+		downsample(i == 0 ? volume : levels[i - 1], levels[i], i == 0);
+}
+
+/// Majorant grid
+
+template<typename VoxelFunction>
+static void buildMajorants(int width, int height, int depth, VolumeData& majorants, VoxelFunction voxel)
+{
+	majorants.resize((width + MAJORANT_BLOCK_SIZE - 1) / MAJORANT_BLOCK_SIZE, (height + MAJORANT_BLOCK_SIZE - 1) / MAJORANT_BLOCK_SIZE, (depth + MAJORANT_BLOCK_SIZE - 1) / MAJORANT_BLOCK_SIZE);
+
+	// voxel range of cell c along an axis of size voxels split in cells, one voxel of margin on each side
+	auto range = [](int c, int size, int cells, int& first, int& last) {
+		first = std::max(c * size / cells - 1, 0);
+		last = std::min((c + 1) * size / cells + 2, size);
+	};
+
+	parallelFor(0, majorants.depth, [&](int first, int last, int thread_id) {
+		for (int cz = first; cz < last; cz++) {
+			int z0, z1;
+			range(cz, depth, majorants.depth, z0, z1);
+			for (int cy = 0; cy < majorants.height; cy++) {
+				int y0, y1;
+				range(cy, height, majorants.height, y0, y1);
+				for (int cx = 0; cx < majorants.width; cx++) {
+					int x0, x1;
+					range(cx, width, majorants.width, x0, x1);
+
+					float majorant = 0.f;
+					for (int z = z0; z < z1; z++)
+						for (int y = y0; y < y1; y++)
+							for (int x = x0; x < x1; x++)
+								majorant = std::max(majorant, voxel(((size_t)z * height + y) * width + x));
+					majorants.data[((size_t)cz * majorants.height + cy) * majorants.width + cx] = std::min(majorant, 1.f);
+				}
+			}
+		}
+	});
+}
+
+void buildMajorantGrid(const VolumeData& volume, VolumeData& majorants)
+{
+	buildMajorants(volume.width, volume.height, volume.depth, majorants, [&](size_t i) { return volume.data[i]; });
+}
+
+void buildMajorantGrid(const RawVolumeFile& raw, VolumeData& majorants)
+{
+	if (raw.bytes_per_voxel == 1) {
+		const uint8_t* voxels = (const uint8_t*)raw.voxels();
+		buildMajorants(raw.width, raw.height, raw.depth, majorants, [&](size_t i) { return voxels[i] / 255.f; });
+		return;
+	}
+
+	const uint8_t* bytes = (const uint8_t*)raw.voxels();
+	int high = raw.big_endian ? 0 : 1;
+	buildMajorants(raw.width, raw.height, raw.depth, majorants, [&](size_t i) {
+		return (bytes[i * 2 + high] << 8 | bytes[i * 2 + 1 - high]) / 65535.f;
+	});
+}
+
+/// Transfer function
+
+void preintegrateTransferFunction(const std::vector<sTransferPoint>& points, std::vector<float>& table)
+{
+	const int size = TRANSFER_FUNCTION_SIZE;
+	table.assign((size_t)size * size * 4, 0.f);
+	if (points.empty())
+		return;
+
+	std::vector<sTransferPoint> sorted = points;
+	std::sort(sorted.begin(), sorted.end(), [](const sTransferPoint& a, const sTransferPoint& b) { return a.density < b.density; });
+
+	// color * opacity and opacity at every sampled density, clamped to the end points outside them
+	std::vector<float> samples((size_t)size * 4);
+	for (int i = 0; i < size; i++) {
+		float density = i / (float)(size - 1);
+		size_t next = std::upper_bound(sorted.begin(), sorted.end(), density, [](float d, const sTransferPoint& p) { return d < p.density; }) - sorted.begin();
+		const sTransferPoint& a = sorted[next == 0 ? 0 : next - 1];
+		const sTransferPoint& b = sorted[std::min(next, sorted.size() - 1)];
+		float f = b.density > a.density ? std::clamp((density - a.density) / (b.density - a.density), 0.f, 1.f) : 0.f;
+		float opacity = a.opacity + (b.opacity - a.opacity) * f;
+		for (int c = 0; c < 3; c++)
+			samples[i * 4 + c] = (a.color[c] + (b.color[c] - a.color[c]) * f) * opacity;
+		samples[i * 4 + 3] = opacity;
+	}
+
+	// running integrals (trapezoidal), the average between two densities is a difference of them
+	std::vector<double> integrals((size_t)size * 4, 0.0);
+	for (int i = 1; i < size; i++)
+		for (int c = 0; c < 4; c++)
+			integrals[i * 4 + c] = integrals[(i - 1) * 4 + c] + 0.5 * (samples[(i - 1) * 4 + c] + samples[i * 4 + c]);
+
+	parallelFor(0, size, [&](int first, int last, int thread_id) {
+		for (int back = first; back < last; back++) {
+			for (int front = 0; front < size; front++) {
+				float* texel = &table[((size_t)back * size + front) * 4];
+				for (int c = 0; c < 4; c++)
+					texel[c] = front == back ? samples[front * 4 + c] : (float)((integrals[back * 4 + c] - integrals[front * 4 + c]) / (back - front));
+			}
+		}
+	});
+}
+
+/// Fractal noise
+// Same hash based value noise used in the volume shaders, so baked and procedural densities match
+
+static inline float fract(float x)
+{
+	return x - std::floor(x);
+}
+
+static inline float hash1(float n)
+{
+	return fract(n * 17.0f * fract(n * 0.3183099f));
+}
+
+static float noise(float x, float y, float z)
+{
+	float px = std::floor(x), py = std::floor(y), pz = std::floor(z);
+	float wx = x - px, wy = y - py, wz = z - pz;
+
+	float ux = wx * wx * wx * (wx * (wx * 6.0f - 15.0f) + 10.0f);
+	float uy = wy * wy * wy * (wy * (wy * 6.0f - 15.0f) + 10.0f);
+	float uz = wz * wz * wz * (wz * (wz * 6.0f - 15.0f) + 10.0f);
+
+	float n = px + 317.0f * py + 157.0f * pz;
+
+	float a = hash1(n + 0.0f);
+	float b = hash1(n + 1.0f);
+	float c = hash1(n + 317.0f);
+	float d = hash1(n + 318.0f);
+	float e = hash1(n + 157.0f);
+	float f = hash1(n + 158.0f);
+	float g = hash1(n + 474.0f);
+	float h = hash1(n + 475.0f);
+
+	float k0 = a;
+	float k1 = b - a;
+	float k2 = c - a;
+	float k3 = e - a;
+	float k4 = a - b - c + d;
+	float k5 = a - c - e + g;
+	float k6 = a - b - e + f;
+	float k7 = -a + b + c - d + e - f - g + h;
+
+	return -1.0f + 2.0f * (k0 + k1 * ux + k2 * uy + k3 * uz + k4 * ux * uy + k5 * uy * uz + k6 * uz * ux + k7 * ux * uy * uz);
+}
+
+static float cnoise(float x, float y, float z, float scale, int octaves)
+{
+	x *= scale; y *= scale; z *= scale;
+
+	float fscale = 1.0f;
+	float amp = 1.0f;
+	float sum = 0.0f;
+	for (int i = 0; i <= octaves; i++) {
+		sum += noise(fscale * x, fscale * y, fscale * z) * amp;
+		amp *= 0.5f;
+		fscale *= 2.0f;
+	}
+
+	return std::clamp(sum, 0.0f, 1.0f);
+}
+
+#if defined(VOLUME_AVX2)
+
+// 8 voxels of a row at once, lane by lane identical to the scalar version
+
+AVX2_TARGET static inline __m256 fract8(__m256 x)
+{
+	return _mm256_sub_ps(x, _mm256_floor_ps(x));
+}
+
+AVX2_TARGET static inline __m256 hash8(__m256 n)
+{
+	__m256 f = fract8(_mm256_mul_ps(n, _mm256_set1_ps(0.3183099f)));
+	return fract8(_mm256_mul_ps(_mm256_mul_ps(n, _mm256_set1_ps(17.0f)), f));
+}
+
+AVX2_TARGET static inline __m256 smootherstep8(__m256 w)
+{
+	__m256 inner = _mm256_add_ps(_mm256_mul_ps(w, _mm256_sub_ps(_mm256_mul_ps(w, _mm256_set1_ps(6.0f)), _mm256_set1_ps(15.0f))), _mm256_set1_ps(10.0f));
+	return _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(w, w), w), inner);
+}
+
+AVX2_TARGET static __m256 noise8(__m256 x, __m256 y, __m256 z)
+{
+	__m256 px = _mm256_floor_ps(x), py = _mm256_floor_ps(y), pz = _mm256_floor_ps(z);
+	__m256 ux = smootherstep8(_mm256_sub_ps(x, px));
+	__m256 uy = smootherstep8(_mm256_sub_ps(y, py));
+	__m256 uz = smootherstep8(_mm256_sub_ps(z, pz));
+
+	__m256 n = _mm256_add_ps(_mm256_add_ps(px, _mm256_mul_ps(_mm256_set1_ps(317.0f), py)), _mm256_mul_ps(_mm256_set1_ps(157.0f), pz));
+
+	__m256 a = hash8(n);
+	__m256 b = hash8(_mm256_add_ps(n, _mm256_set1_ps(1.0f)));
+	__m256 c = hash8(_mm256_add_ps(n, _mm256_set1_ps(317.0f)));
+	__m256 d = hash8(_mm256_add_ps(n, _mm256_set1_ps(318.0f)));
+	__m256 e = hash8(_mm256_add_ps(n, _mm256_set1_ps(157.0f)));
+	__m256 f = hash8(_mm256_add_ps(n, _mm256_set1_ps(158.0f)));
+	__m256 g = hash8(_mm256_add_ps(n, _mm256_set1_ps(474.0f)));
+	__m256 h = hash8(_mm256_add_ps(n, _mm256_set1_ps(475.0f)));
+
+	__m256 k1 = _mm256_sub_ps(b, a);
+	__m256 k2 = _mm256_sub_ps(c, a);
+	__m256 k3 = _mm256_sub_ps(e, a);
+	__m256 k4 = _mm256_add_ps(_mm256_sub_ps(_mm256_sub_ps(a, b), c), d);
+	__m256 k5 = _mm256_add_ps(_mm256_sub_ps(_mm256_sub_ps(a, c), e), g);
+	__m256 k6 = _mm256_add_ps(_mm256_sub_ps(_mm256_sub_ps(a, b), e), f);
+	__m256 k7 = _mm256_add_ps(_mm256_sub_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_sub_ps(_mm256_add_ps(_mm256_sub_ps(b, a), c), d), e), f), g), h);
+
+	__m256 uxy = _mm256_mul_ps(ux, uy);
+	__m256 sum = a;
+	sum = _mm256_add_ps(sum, _mm256_mul_ps(k1, ux));
+	sum = _mm256_add_ps(sum, _mm256_mul_ps(k2, uy));
+	sum = _mm256_add_ps(sum, _mm256_mul_ps(k3, uz));
+	sum = _mm256_add_ps(sum, _mm256_mul_ps(k4, uxy));
+	sum = _mm256_add_ps(sum, _mm256_mul_ps(k5, _mm256_mul_ps(uy, uz)));
+	sum = _mm256_add_ps(sum, _mm256_mul_ps(k6, _mm256_mul_ps(uz, ux)));
+	sum = _mm256_add_ps(sum, _mm256_mul_ps(k7, _mm256_mul_ps(uxy, uz)));
+
+	return _mm256_sub_ps(_mm256_mul_ps(_mm256_set1_ps(2.0f), sum), _mm256_set1_ps(1.0f));
+}
+
+AVX2_TARGET static __m256 cnoise8(__m256 x, __m256 y, __m256 z, float scale, int octaves)
+{
+	__m256 s = _mm256_set1_ps(scale);
+	x = _mm256_mul_ps(x, s); y = _mm256_mul_ps(y, s); z = _mm256_mul_ps(z, s);
+
+	float fscale = 1.0f;
+	float amp = 1.0f;
+	__m256 sum = _mm256_setzero_ps();
+	for (int i = 0; i <= octaves; i++) {
+		__m256 fs = _mm256_set1_ps(fscale);
+		__m256 t = noise8(_mm256_mul_ps(fs, x), _mm256_mul_ps(fs, y), _mm256_mul_ps(fs, z));
+		sum = _mm256_add_ps(sum, _mm256_mul_ps(t, _mm256_set1_ps(amp)));
+		amp *= 0.5f;
+		fscale *= 2.0f;
+	}
+
+	return _mm256_min_ps(_mm256_max_ps(sum, _mm256_setzero_ps()), _mm256_set1_ps(1.0f));
+}
+
+// fills row[0, resolution) up to a multiple of 8, returns where the scalar loop goes on
+AVX2_TARGET static int cnoiseRow8(float* row, int resolution, float step, float py, float pz, float scale, int octaves)
+{
+	__m256 lane = _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f);
+	int x = 0;
+	for (; x + 8 <= resolution; x += 8) {
+		__m256 px = _mm256_add_ps(_mm256_set1_ps(-1.0f), _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps((float)x), lane), _mm256_set1_ps(step)));
+		_mm256_storeu_ps(row + x, cnoise8(px, _mm256_set1_ps(py), _mm256_set1_ps(pz), scale, octaves));
+	}
+	return x;
+}
+
+static bool cpuHasAVX2()
+{
+#if defined(_MSC_VER)
+	// AVX2 in leaf 7, and the OS saving the YMM registers (OSXSAVE and XCR0)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+bool bakeFractalNoise(VolumeData& volume, int resolution, float noise_scale, float noise_detail, const std::atomic<bool>* cancelled)
+{
+	volume.resize(resolution, resolution, resolution);
+
+	// the shader truncates the detail to a whole number of octaves
+	int octaves = (int)std::clamp(noise_detail, 0.0f, 16.0f);
+	float step = 2.0f / resolution;
+#if defined(VOLUME_AVX2)
+	static const bool use_avx2 = cpuHasAVX2();
+#endif
+
+	// one slice per iteration, cancellation is checked between rows
+	parallelFor(0, resolution, [&](int first, int last, int thread_id) {
+		for (int z = first; z < last; z++) {
+			float pz = -1.0f + (z + 0.5f) * step;
+			for (int y = 0; y < resolution; y++) {
+				if (cancelled && *cancelled)
+					return;
+
+				float py = -1.0f + (y + 0.5f) * step;
+				float* row = &volume.data[((size_t)z * resolution + y) * resolution];
+				int x = 0;
+#if defined(VOLUME_AVX2)
+				if (use_avx2)
+					x = cnoiseRow8(row, resolution, step, py, pz, noise_scale, octaves);
+#endif
+				for (; x < resolution; x++)
+					row[x] = cnoise(-1.0f + (x + 0.5f) * step, py, pz, noise_scale, octaves);
+			}
+		}
+	});
+
+	return !(cancelled && *cancelled);
+}
+
+/// Particles
+
+enum ePlyType { PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64, PLY_UNKNOWN };
+
+struct sPlyProperty
+{
+	std::string name;
+	ePlyType type;
+	int offset; //in bytes inside a binary vertex
+};
+
+static ePlyType parsePlyType(const std::string& name)
+{
+	if (name == "char" || name == "int8") return PLY_INT8;
+	if (name == "uchar" || name == "uint8") return PLY_UINT8;
+	if (name == "short" || name == "int16") return PLY_INT16;
+	if (name == "ushort" || name == "uint16") return PLY_UINT16;
+	if (name == "int" || name == "int32") return PLY_INT32;
+	if (name == "uint" || name == "uint32") return PLY_UINT32;
+	if (name == "float" || name == "float32") return PLY_FLOAT32;
+	if (name == "double" || name == "float64") return PLY_FLOAT64;
+	return PLY_UNKNOWN;
+}
+
+static int plyTypeSize(ePlyType type)
+{
+	static const int sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8, 0 };
+	return sizes[type];
+}
+
+static float readPlyValue(const char* data, ePlyType type)
+{
+	switch (type) {
+	case PLY_INT8: return (float)*(const int8_t*)data;
+	case PLY_UINT8: return (float)*(const uint8_t*)data;
+	case PLY_INT16: { int16_t v; memcpy(&v, data, 2); return (float)v; }
+	case PLY_UINT16: { uint16_t v; memcpy(&v, data, 2); return (float)v; }
+	case PLY_INT32: { int32_t v; memcpy(&v, data, 4); return (float)v; }
+	case PLY_UINT32: { uint32_t v; memcpy(&v, data, 4); return (float)v; }
+	case PLY_FLOAT32: { float v; memcpy(&v, data, 4); return v; }
+	case PLY_FLOAT64: { double v; memcpy(&v, data, 8); return (float)v; }
+	default: return 0.f;
+	}
+}
+
+static bool loadPLY(const std::string& content, std::vector<sParticle>& particles)
+{
+	size_t pos = 0;
+	bool binary = false;
+	bool in_vertex = false;
+	int num_vertices = -1;
+	int vertex_size = 0;
+	std::vector<sPlyProperty> properties;
+
+	// header
+	while (true) {
+		size_t end = content.find('\n', pos);
+		if (end == std::string::npos) {
+			std::cerr << "[ERROR] PLY header without end_header" << std::endl;
+			return false;
+		}
+		std::string line = content.substr(pos, end - pos);
+		pos = end + 1;
+		if (line.size() && line.back() == '\r')
+			line.pop_back();
+
+		std::vector<std::string> words = tokenize(line, " ");
+		if (words.empty() || words[0] == "comment" || words[0] == "obj_info" || words[0] == "ply")
+			continue;
+		if (words[0] == "end_header")
+			break;
+
+		if (words[0] == "format" && words.size() > 1) {
+			if (words[1] == "binary_little_endian")
+				binary = true;
+			else if (words[1] != "ascii") {
+				std::cerr << "[ERROR] PLY format not supported: " << words[1] << std::endl;
+				return false;
+			}
+		}
+		else if (words[0] == "element" && words.size() > 2) {
+			// only the vertices are read, so they have to come first
+			if (words[1] == "vertex" && num_vertices == -1) {
+				num_vertices = atoi(words[2].c_str());
+				in_vertex = true;
+			}
+			else
+				in_vertex = false;
+		}
+		else if (words[0] == "property" && in_vertex) {
+			ePlyType type = words.size() > 2 ? parsePlyType(words[1]) : PLY_UNKNOWN;
+			if (type == PLY_UNKNOWN) {
+				std::cerr << "[ERROR] PLY vertex property not supported: " << line << std::endl;
+				return false;
+			}
+			properties.push_back({ words[2], type, vertex_size });
+			vertex_size += plyTypeSize(type);
+		}
+	}
+
+	if (num_vertices <= 0) {
+		std::cerr << "[ERROR] PLY without vertices" << std::endl;
+		return false;
+	}
+
+	int index_x = -1, index_y = -1, index_z = -1, index_radius = -1, index_density = -1;
+	for (int i = 0; i < (int)properties.size(); i++) {
+		const std::string& name = properties[i].name;
+		if (name == "x") index_x = i;
+		else if (name == "y") index_y = i;
+		else if (name == "z") index_z = i;
+		else if (name == "radius" || name == "pscale") index_radius = i;
+		else if (name == "density") index_density = i;
+	}
+
+	if (index_x == -1 || index_y == -1 || index_z == -1) {
+		std::cerr << "[ERROR] PLY vertices without x, y, z" << std::endl;
+		return false;
+	}
+
+	particles.resize(num_vertices);
+	std::vector<float> values(properties.size());
+
+	if (binary && content.size() - pos < (size_t)num_vertices * vertex_size) {
+		std::cerr << "[ERROR] PLY file is truncated" << std::endl;
+		return false;
+	}
+
+	const char* data = content.c_str() + pos;
+	for (int i = 0; i < num_vertices; i++) {
+		for (int j = 0; j < (int)properties.size(); j++) {
+			if (binary)
+				values[j] = readPlyValue(data + properties[j].offset, properties[j].type);
+			else {
+				char* next;
+				values[j] = strtof(data, &next);
+				if (next == data) {
+					std::cerr << "[ERROR] PLY file is truncated" << std::endl;
+					return false;
+				}
+				data = next;
+			}
+		}
+		if (binary)
+			data += vertex_size;
+
+		sParticle& particle = particles[i];
+		particle.x = values[index_x];
+		particle.y = values[index_y];
+		particle.z = values[index_z];
+		particle.radius = index_radius != -1 ? values[index_radius] : 0.f;
+		particle.density = index_density != -1 ? values[index_density] : 1.f;
+	}
+
+	return true;
+}
+
+static bool loadPTS(const std::string& content, std::vector<sParticle>& particles)
+{
+	uint32_t count = 0;
+	if (content.size() < 8 || content.compare(0, 4, "PTS1") != 0) {
+		std::cerr << "[ERROR] PTS file without PTS1 header" << std::endl;
+		return false;
+	}
+
+	memcpy(&count, content.c_str() + 4, sizeof(uint32_t));
+	if (content.size() - 8 < (size_t)count * sizeof(sParticle)) {
+		std::cerr << "[ERROR] PTS file is truncated" << std::endl;
+		return false;
+	}
+
+	particles.resize(count);
+	memcpy(particles.data(), content.c_str() + 8, (size_t)count * sizeof(sParticle));
+	return true;
+}
+
+bool loadParticles(const std::string& filename, std::vector<sParticle>& particles)
+{
+	long time = getTime();
+	std::cout << " + Particles loading: " << filename << " ... ";
+
+	std::string content;
+	if (!readFile(filename, content))
+		return false;
+
+	std::string ext = filename.substr(filename.find_last_of(".") + 1);
+	bool loaded = false;
+	if (ext == "ply" || ext == "PLY")
+		loaded = loadPLY(content, particles);
+	else if (ext == "pts" || ext == "PTS")
+		loaded = loadPTS(content, particles);
+	else
+		std::cerr << "[ERROR]: unsupported format" << std::endl;
+
+	if (loaded)
+		std::cout << "[OK] Particles: " << particles.size() << " Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+	return loaded;
+}
+
+bool splatParticles(const std::vector<sParticle>& particles, VolumeData& volume, int resolution, float default_radius, const std::atomic<bool>* cancelled)
+{
+	volume.resize(resolution, resolution, resolution);
+	if (particles.empty())
+		return true;
+
+	// bounding box of the particles, including their radius
+	float bb_min[3] = { FLT_MAX, FLT_MAX, FLT_MAX };
+	float bb_max[3] = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+	for (const sParticle& particle : particles) {
+		float p[3] = { particle.x, particle.y, particle.z };
+		float r = std::max(particle.radius, 0.f);
+		for (int k = 0; k < 3; k++) {
+			bb_min[k] = std::min(bb_min[k], p[k] - r);
+			bb_max[k] = std::max(bb_max[k], p[k] + r);
+		}
+	}
+
+	// one scale for the three axes, the longest one fills the grid and the box is centered in the others, so a
+	// flat or elongated cloud keeps its shape and its splats stay round
+	float max_size = 0.f;
+	for (int k = 0; k < 3; k++)
+		max_size = std::max(max_size, bb_max[k] - bb_min[k]);
+	if (max_size <= 0.f)
+		max_size = 1.f;
+	float to_voxels = resolution / max_size;
+	float margin[3];
+	for (int k = 0; k < 3; k++)
+		margin[k] = (resolution - (bb_max[k] - bb_min[k]) * to_voxels) * 0.5f;
+
+	// every thread splats its share of particles in its own sparse set of tiles, no atomics needed
+	int tiles_per_axis = (resolution + SPLAT_TILE_SIZE - 1) / SPLAT_TILE_SIZE;
+	int num_tiles = tiles_per_axis * tiles_per_axis * tiles_per_axis;
+	const int tile_voxels = SPLAT_TILE_SIZE * SPLAT_TILE_SIZE * SPLAT_TILE_SIZE;
+	std::vector<std::vector<std::vector<float>>> thread_tiles(getNumThreads(), std::vector<std::vector<float>>(num_tiles));
+
+	parallelFor(0, (int)particles.size(), [&](int first, int last, int thread_id) {
+		std::vector<std::vector<float>>& tiles = thread_tiles[thread_id];
+		for (int i = first; i < last; i++) {
+			if ((i & 0xFFFF) == 0 && cancelled && *cancelled)
+				return;
+
+			const sParticle& particle = particles[i];
+			float radius = particle.radius > 0.f ? particle.radius * to_voxels : default_radius;
+			float value = particle.density * 255.f;
+
+			// continuous voxel coordinates, voxel centers are at i + 0.5
+			float c[3] = {
+				margin[0] + (particle.x - bb_min[0]) * to_voxels - 0.5f,
+				margin[1] + (particle.y - bb_min[1]) * to_voxels - 0.5f,
+				margin[2] + (particle.z - bb_min[2]) * to_voxels - 0.5f
+			};
+
+			// same falloff as the VDB bleed: 1 at the center, 0 at radius / 2
+			float support = std::max(radius * 0.5f, 0.5f);
+			int min_v[3], max_v[3];
+			for (int k = 0; k < 3; k++) {
+				min_v[k] = std::max((int)std::floor(c[k] - support), 0);
+				max_v[k] = std::min((int)std::ceil(c[k] + support), resolution - 1);
+			}
+
+			for (int z = min_v[2]; z <= max_v[2]; z++) {
+				for (int y = min_v[1]; y <= max_v[1]; y++) {
+					for (int x = min_v[0]; x <= max_v[0]; x++) {
+						float offset = std::clamp(1.0f - std::hypot(x - c[0], y - c[1], z - c[2]) / support, 0.0f, 1.0f);
+						if (offset <= 0.f)
+							continue;
+
+						int tile = (x / SPLAT_TILE_SIZE) + ((y / SPLAT_TILE_SIZE) + (z / SPLAT_TILE_SIZE) * tiles_per_axis) * tiles_per_axis;
+						std::vector<float>& voxels = tiles[tile];
+						if (voxels.empty())
+							voxels.assign(tile_voxels, 0.f);
+						voxels[(x % SPLAT_TILE_SIZE) + ((y % SPLAT_TILE_SIZE) + (z % SPLAT_TILE_SIZE) * SPLAT_TILE_SIZE) * SPLAT_TILE_SIZE] += offset * value;
+					}
+				}
+			}
+		}
+	});
+
+	if (cancelled && *cancelled)
+		return false;
+
+	// reduction: every tile of the grid sums the tiles of all threads
+	parallelFor(0, num_tiles, [&](int first, int last, int thread_id) {
+		for (int tile = first; tile < last; tile++) {
+			int tx = (tile % tiles_per_axis) * SPLAT_TILE_SIZE;
+			int ty = ((tile / tiles_per_axis) % tiles_per_axis) * SPLAT_TILE_SIZE;
+			int tz = (tile / (tiles_per_axis * tiles_per_axis)) * SPLAT_TILE_SIZE;
+
+			for (auto& tiles : thread_tiles) {
+				const std::vector<float>& voxels = tiles[tile];
+				if (voxels.empty())
+					continue;
+
+				for (int z = 0; z < SPLAT_TILE_SIZE && tz + z < resolution; z++)
+					for (int y = 0; y < SPLAT_TILE_SIZE && ty + y < resolution; y++)
+						for (int x = 0; x < SPLAT_TILE_SIZE && tx + x < resolution; x++)
+							volume.data[((size_t)(tz + z) * resolution + ty + y) * resolution + tx + x] += voxels[x + (y + z * SPLAT_TILE_SIZE) * SPLAT_TILE_SIZE];
+			}
+
+			for (int z = 0; z < SPLAT_TILE_SIZE && tz + z < resolution; z++)
+				for (int y = 0; y < SPLAT_TILE_SIZE && ty + y < resolution; y++)
+					for (int x = 0; x < SPLAT_TILE_SIZE && tx + x < resolution; x++) {
+						float& voxel = volume.data[((size_t)(tz + z) * resolution + ty + y) * resolution + tx + x];
+						voxel = std::min(voxel, 255.f);
+					}
+		}
+	});
+
+	return true;
+}
+
+/// Raw volumes
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+MappedFile::MappedFile(MappedFile&& other) noexcept
+{
+	*this = std::move(other);
+}
+
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept
+{
+	if (this == &other)
+		return *this;
+
+	// the mapping changes owner, the other one is left closed
+	close();
+	std::swap(this->data, other.data);
+	std::swap(this->size, other.size);
+#ifdef _WIN32
+	std::swap(this->file_handle, other.file_handle);
+	std::swap(this->mapping_handle, other.mapping_handle);
+#endif
+	return *this;
+}
+
+bool MappedFile::open(const std::string& filename, bool sequential)
+{
+	close();
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_RANDOM_ACCESS, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER file_size;
+	HANDLE mapping = NULL;
+	if (GetFileSizeEx(file, &file_size) && file_size.QuadPart > 0)
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapping) {
+		CloseHandle(file);
+		return false;
+	}
+
+	this->data = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (!this->data) {
+		CloseHandle(mapping);
+		CloseHandle(file);
+		return false;
+	}
+	this->file_handle = file;
+	this->mapping_handle = mapping;
+	this->size = (size_t)file_size.QuadPart;
+#else
+	int fd = ::open(filename.c_str(), O_RDONLY);
+	if (fd == -1)
+		return false;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size <= 0) {
+		::close(fd);
+		return false;
+	}
+
+	void* mapped = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd); //the mapping keeps its own reference to the file
+	if (mapped == MAP_FAILED)
+		return false;
+
+	// either the whole file is going to be read once, front to back, or only the pages of some bricks
+	if (sequential)
+		madvise(mapped, (size_t)info.st_size, MADV_SEQUENTIAL | MADV_WILLNEED);
+	else
+		madvise(mapped, (size_t)info.st_size, MADV_RANDOM);
+	this->data = (const uint8_t*)mapped;
+	this->size = (size_t)info.st_size;
+#endif
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (!this->data)
+		return;
+
+#ifdef _WIN32
+	UnmapViewOfFile(this->data);
+	CloseHandle(this->mapping_handle);
+	CloseHandle(this->file_handle);
+	this->file_handle = NULL;
+	this->mapping_handle = NULL;
+#else
+	munmap((void*)this->data, this->size);
+#endif
+	this->data = NULL;
+	this->size = 0;
+}
+
+static int rawTypeSize(const std::string& type)
+{
+	if (type == "uchar" || type == "unsigned char" || type == "uint8" || type == "uint8_t")
+		return 1;
+	if (type == "ushort" || type == "unsigned short" || type == "unsigned short int" || type == "uint16" || type == "uint16_t")
+		return 2;
+	return 0;
+}
+
+bool RawVolumeFile::load(const std::string& filename, bool sequential)
+{
+	long time = getTime();
+	std::cout << " + Raw volume loading: " << filename << " ... ";
+
+	std::string ext = filename.substr(filename.find_last_of(".") + 1);
+	std::string data_file;
+
+	if (ext == "nhdr") {
+		// detached header, the voxels live in the data file
+		std::string header;
+		if (!readFile(filename, header) || !parseNRRDHeader(filename, header.c_str(), header.size(), data_file))
+			return false;
+		if (data_file.empty()) {
+			std::cerr << "[ERROR] NRRD header without data file" << std::endl;
+			return false;
+		}
+		if (!this->file.open(data_file, sequential)) {
+			std::cerr << "[ERROR] Cannot map " << data_file << std::endl;
+			return false;
+		}
+	}
+	else {
+		if (!this->file.open(filename, sequential)) {
+			std::cerr << "[ERROR] Cannot map " << filename << std::endl;
+			return false;
+		}
+		if (ext == "nrrd") {
+			if (!parseNRRDHeader(filename, (const char*)this->file.data, this->file.size, data_file))
+				return false;
+		}
+		else if (!parseFilename(filename))
+			return false;
+	}
+
+	size_t voxels_size = (size_t)this->width * this->height * this->depth * this->bytes_per_voxel;
+	if (this->offset + voxels_size > this->file.size) {
+		std::cerr << "[ERROR] Raw volume is truncated" << std::endl;
+		this->file.close();
+		return false;
+	}
+
+	std::cout << "[OK] Size: " << this->width << "x" << this->height << "x" << this->depth << " " << this->bytes_per_voxel * 8 << "bits Time: " << (getTime() - time) * 0.001 << "sec" << std::endl;
+	return true;
+}
+
+bool RawVolumeFile::readSize(const std::string& filename)
+{
+	std::string ext = filename.substr(filename.find_last_of(".") + 1);
+	std::string data_file;
+
+	if (ext == "nhdr") {
+		std::string header;
+		return readFile(filename, header) && parseNRRDHeader(filename, header.c_str(), header.size(), data_file);
+	}
+	if (ext == "nrrd") {
+		// the attached header is a few lines of text before the voxels, its start is enough
+		std::ifstream stream(filename, std::ios::binary);
+		if (!stream.is_open()) {
+			std::cerr << "[ERROR] Cannot open " << filename << std::endl;
+			return false;
+		}
+		std::string header(NRRD_MAX_HEADER_SIZE, '\0');
+		stream.read(&header[0], header.size());
+		return parseNRRDHeader(filename, header.c_str(), (size_t)stream.gcount(), data_file);
+	}
+	// the type of a .raw without it in the name is deduced once it is mapped, the size does not depend on it
+	return parseFilename(filename);
+}
+
+float RawVolumeFile::value(size_t index) const
+{
+	const uint8_t* bytes = (const uint8_t*)this->voxels();
+	if (this->bytes_per_voxel == 1)
+		return bytes[index] / 255.f;
+	int high = this->big_endian ? 0 : 1;
+	return (bytes[index * 2 + high] << 8 | bytes[index * 2 + 1 - high]) / 65535.f;
+}
+
+bool RawVolumeFile::parseNRRDHeader(const std::string& filename, const char* header, size_t size, std::string& data_file)
+{
+	if (size < 8 || strncmp(header, "NRRD000", 7) != 0) {
+		std::cerr << "[ERROR] Not a NRRD file" << std::endl;
+		return false;
+	}
+
+	bool raw_encoding = false;
+	int dimension = 0;
+	long byte_skip = 0;
+	size_t pos = 0;
+
+	// "key: value" lines until an empty line, the attached data starts right after it
+	while (pos < size) {
+		const char* end = (const char*)memchr(header + pos, '\n', size - pos);
+		size_t line_end = end ? end - header : size;
+		std::string line(header + pos, line_end - pos);
+		pos = line_end + 1;
+		if (line.size() && line.back() == '\r')
+			line.pop_back();
+
+		if (line.empty())
+			break;
+		if (line[0] == '#')
+			continue;
+
+		size_t separator = line.find(": ");
+		if (separator == std::string::npos)
+			continue;
+		std::string key = line.substr(0, separator);
+		std::string value = line.substr(separator + 2);
+
+		if (key == "type")
+			this->bytes_per_voxel = rawTypeSize(value);
+		else if (key == "dimension")
+			dimension = atoi(value.c_str());
+		else if (key == "sizes")
+			sscanf(value.c_str(), "%d %d %d", &this->width, &this->height, &this->depth);
+		else if (key == "encoding")
+			raw_encoding = value == "raw";
+		else if (key == "endian")
+			this->big_endian = value == "big";
+		else if (key == "byte skip")
+			byte_skip = atol(value.c_str());
+		else if (key == "data file" || key == "datafile") {
+			// relative to the folder of the header
+			size_t folder = filename.find_last_of("/\\");
+			data_file = folder == std::string::npos ? value : filename.substr(0, folder + 1) + value;
+		}
+	}
+
+	if (this->bytes_per_voxel == 0 || dimension != 3 || !raw_encoding || byte_skip < 0 || this->width <= 0 || this->height <= 0 || this->depth <= 0) {
+		std::cerr << "[ERROR] Only 3D uchar/ushort NRRD volumes with raw encoding are supported" << std::endl;
+		return false;
+	}
+
+	this->offset = (data_file.empty() ? pos : 0) + byte_skip;
+	return true;
+}
+
+bool RawVolumeFile::parseFilename(const std::string& filename)
+{
+	size_t folder = filename.find_last_of("/\\");
+	std::string name = folder == std::string::npos ? filename : filename.substr(folder + 1);
+
+	this->bytes_per_voxel = 0;
+	for (const std::string& token : tokenize(name, "_.")) {
+		int w, h, d;
+		if (sscanf(token.c_str(), "%dx%dx%d", &w, &h, &d) == 3) {
+			this->width = w;
+			this->height = h;
+			this->depth = d;
+		}
+		else if (rawTypeSize(token))
+			this->bytes_per_voxel = rawTypeSize(token);
+	}
+
+	if (this->width <= 0 || this->height <= 0 || this->depth <= 0) {
+		std::cerr << "[ERROR] Raw volume name without size (name_WxHxD_uint8.raw)" << std::endl;
+		return false;
+	}
+
+	// without type in the name it is deduced from the file size
+	size_t num_voxels = (size_t)this->width * this->height * this->depth;
+	if (this->bytes_per_voxel == 0)
+		this->bytes_per_voxel = this->file.size >= num_voxels * 2 ? 2 : 1;
+
+	this->offset = 0;
+	return true;
+}
+
+/// Virtual texturing
+
+bool VirtualVolume::load(const std::string& filename, int slots_per_side)
+{
+	// only some pages are read, when their bricks are requested
+	if (!this->file.load(filename, false))
+		return false;
+
+	this->levels = 0;
+	this->num_bricks = 0;
+	int size[3] = { this->file.width, this->file.height, this->file.depth };
+	while (this->levels < MAX_VIRTUAL_LEVELS) {
+		int level = this->levels++;
+		bool single_brick = true;
+		for (int axis = 0; axis < 3; axis++) {
+			this->level_size[level][axis] = std::max((size[axis] + (1 << level) - 1) >> level, 1);
+			this->level_bricks[level][axis] = (this->level_size[level][axis] + VIRTUAL_BRICK_SIZE - 1) / VIRTUAL_BRICK_SIZE;
+			single_brick &= this->level_bricks[level][axis] == 1;
+		}
+		this->level_offset[level] = this->num_bricks;
+		this->num_bricks += this->level_bricks[level][0] * this->level_bricks[level][1] * this->level_bricks[level][2];
+		if (single_brick)
+			break;
+	}
+
+	int num_slots = slots_per_side * slots_per_side * slots_per_side;
+	this->atlas_slots[0] = this->atlas_slots[1] = this->atlas_slots[2] = slots_per_side;
+	this->page_table.assign(this->num_bricks, 0);
+	this->slot_bricks.assign(num_slots, -1);
+	this->slot_last_used.assign(num_slots, 0);
+	return true;
+}
+
+int VirtualVolume::fallbackLevel() const
+{
+	for (int level = 0; level < this->levels; level++)
+		if (this->level_size[level][0] <= VIRTUAL_FALLBACK_SIZE && this->level_size[level][1] <= VIRTUAL_FALLBACK_SIZE && this->level_size[level][2] <= VIRTUAL_FALLBACK_SIZE)
+			return level;
+	return this->levels - 1;
+}
+
+float VirtualVolume::value(int level, int x, int y, int z) const
+{
+	const RawVolumeFile& raw = this->file;
+	x = std::clamp(x, 0, this->level_size[level][0] - 1);
+	y = std::clamp(y, 0, this->level_size[level][1] - 1);
+	z = std::clamp(z, 0, this->level_size[level][2] - 1);
+	if (level == 0)
+		return raw.value(((size_t)z * raw.height + y) * raw.width + x);
+
+	// the 2x2x2 voxels of level 0 closest to the center of the coarse voxel
+	int half = 1 << (level - 1);
+	int x0 = (x << level) + half - 1, y0 = (y << level) + half - 1, z0 = (z << level) + half - 1;
+	float sum = 0.f;
+	for (int k = 0; k < 2; k++)
+		for (int j = 0; j < 2; j++)
+			for (int i = 0; i < 2; i++) {
+				size_t vx = std::min(x0 + i, raw.width - 1);
+				size_t vy = std::min(y0 + j, raw.height - 1);
+				size_t vz = std::min(z0 + k, raw.depth - 1);
+				sum += raw.value((vz * raw.height + vy) * raw.width + vx);
+			}
+	return sum * 0.125f;
+}
+
+void VirtualVolume::buildBrick(int brick, std::vector<float>& texels) const
+{
+	int level = this->levels - 1;
+	while (level > 0 && brick < this->level_offset[level])
+		level--;
+	int index = brick - this->level_offset[level];
+	const int* bricks = this->level_bricks[level];
+	int origin[3] = { index % bricks[0] * VIRTUAL_BRICK_SIZE, index / bricks[0] % bricks[1] * VIRTUAL_BRICK_SIZE, index / (bricks[0] * bricks[1]) * VIRTUAL_BRICK_SIZE };
+
+	// texel i is the voxel origin + i - 1, the ones out of the level repeat the border like the clamp to edge
+	texels.resize(VIRTUAL_BRICK_TEXELS * VIRTUAL_BRICK_TEXELS * VIRTUAL_BRICK_TEXELS);
+	for (int z = 0; z < VIRTUAL_BRICK_TEXELS; z++)
+		for (int y = 0; y < VIRTUAL_BRICK_TEXELS; y++)
+			for (int x = 0; x < VIRTUAL_BRICK_TEXELS; x++)
+				texels[(z * VIRTUAL_BRICK_TEXELS + y) * VIRTUAL_BRICK_TEXELS + x] = this->value(level, origin[0] + x - 1, origin[1] + y - 1, origin[2] + z - 1);
+}
+
+void VirtualVolume::buildLevel(int level, VolumeData& volume) const
+{
+	volume.resize(this->level_size[level][0], this->level_size[level][1], this->level_size[level][2]);
+	parallelFor(0, volume.depth, [&](int first, int last, int thread_id) {
+		for (int z = first; z < last; z++)
+			for (int y = 0; y < volume.height; y++)
+				for (int x = 0; x < volume.width; x++)
+					volume.data[((size_t)z * volume.height + y) * volume.width + x] = this->value(level, x, y, z);
+	});
+}
+
+void VirtualVolume::update(const uint32_t* feedback, uint32_t frame, int max_uploads, std::vector<int>& uploads)
+{
+	uploads.clear();
+	std::vector<int> missing;
+	for (int brick = 0; brick < this->num_bricks; brick++) {
+		if (feedback[brick] != frame)
+			continue;
+		if (this->page_table[brick])
+			this->slot_last_used[this->page_table[brick] - 1] = frame;
+		else
+			missing.push_back(brick);
+	}
+
+	// the coarse bricks cover more of the view with less data, the fine ones refine it in the next frames
+	std::sort(missing.begin(), missing.end(), [](int a, int b) { return a > b; });
+
+	for (int brick : missing) {
+		if ((int)uploads.size() >= max_uploads)
+			break;
+
+		// an empty slot, or else the least recently used one that was not used this frame
+		int slot = -1;
+		for (int i = 0; i < (int)this->slot_bricks.size(); i++) {
+			if (this->slot_bricks[i] < 0) {
+				slot = i;
+				break;
+			}
+			if (this->slot_last_used[i] != frame && (slot < 0 || this->slot_last_used[i] < this->slot_last_used[slot]))
+				slot = i;
+		}
+		if (slot < 0)
+			break; // everything in the atlas is in use, the shaders keep the coarser levels
+
+		if (this->slot_bricks[slot] >= 0)
+			this->page_table[this->slot_bricks[slot]] = 0;
+		this->slot_bricks[slot] = brick;
+		this->slot_last_used[slot] = frame;
+		this->page_table[brick] = slot + 1;
+		uploads.push_back(brick);
+	}
+}
+
+void IrradianceVolume::setMedium(const VolumeData& density, float absorption_coefficient, float scattering_coefficient, int resolution)
+{
+	size_t cells = (size_t)resolution * resolution * resolution;
+	if (this->resolution != resolution || this->irradiance.size() != cells * 3) {
+		this->resolution = resolution;
+		this->irradiance.assign(cells * 3, 0.0f);
+		for (size_t i = 0; i < cells; i++)
+			for (int c = 0; c < 3; c++)
+				this->irradiance[i * 3 + c] = this->ambient[c];
+	}
+	this->cell_size = 2.0f / resolution;
+	this->optical_depth.resize(cells);
+	this->transfer.resize(cells);
+	this->scattered_fraction.resize(cells);
+	this->source.assign(cells * 3, 0.0f);
+	this->iterations = 0;
+
+	// like the marchers, absorption is the extinction and scattering only adds light
+	float albedo = std::min(scattering_coefficient / std::max(absorption_coefficient, 1e-6f), 0.95f);
+
+	parallelFor(0, resolution, [&](int first, int last, int thread_id) {
+		for (int z = first; z < last; z++) {
+			int z0 = z * density.depth / resolution, z1 = std::max((z + 1) * density.depth / resolution, z0 + 1);
+			for (int y = 0; y < resolution; y++) {
+				int y0 = y * density.height / resolution, y1 = std::max((y + 1) * density.height / resolution, y0 + 1);
+				for (int x = 0; x < resolution; x++) {
+					int x0 = x * density.width / resolution, x1 = std::max((x + 1) * density.width / resolution, x0 + 1);
+
+					// an empty density is the constant medium
+					double sum = 0.0;
+					size_t count = 0;
+					for (int vz = z0; vz < std::min(z1, density.depth); vz++)
+						for (int vy = y0; vy < std::min(y1, density.height); vy++)
+							for (int vx = x0; vx < std::min(x1, density.width); vx++, count++)
+								sum += density.data[((size_t)vz * density.height + vy) * density.width + vx];
+					float value = count ? (float)(sum / count) : 1.0f;
+
+					size_t i = ((size_t)z * resolution + y) * resolution + x;
+					float tau = value * absorption_coefficient * this->cell_size;
+					float transmittance = expf(-tau);
+					this->optical_depth[i] = tau;
+					this->scattered_fraction[i] = albedo * (1.0f - transmittance);
+					this->transfer[i] = transmittance + this->scattered_fraction[i];
+				}
+			}
+		}
+	});
+}
+
+// One cell per step from the center of the cell towards the light, until it leaves the cube
+float IrradianceVolume::transmittanceToLight(int x, int y, int z, const float light[3]) const
+{
+	float pos[3] = { (x + 0.5f) * this->cell_size - 1.0f, (y + 0.5f) * this->cell_size - 1.0f, (z + 0.5f) * this->cell_size - 1.0f };
+	float dir[3] = { light[0] - pos[0], light[1] - pos[1], light[2] - pos[2] };
+	float distance = sqrtf(dir[0] * dir[0] + dir[1] * dir[1] + dir[2] * dir[2]);
+	if (distance < 1e-6f)
+		return 1.0f;
+
+	// half of the own cell, then whole cells
+	float tau = 0.5f * this->optical_depth[((size_t)z * this->resolution + y) * this->resolution + x];
+	for (float t = this->cell_size; t < distance; t += this->cell_size) {
+		int cell[3];
+		for (int c = 0; c < 3; c++)
+			cell[c] = (int)floorf((pos[c] + dir[c] * t / distance + 1.0f) / this->cell_size);
+		if (cell[0] < 0 || cell[1] < 0 || cell[2] < 0 || cell[0] >= this->resolution || cell[1] >= this->resolution || cell[2] >= this->resolution)
+			break;
+		tau += this->optical_depth[((size_t)cell[2] * this->resolution + cell[1]) * this->resolution + cell[0]];
+		if (tau > 7.0f)
+			return 0.0f;
+	}
+	return expf(-tau);
+}
+
+void IrradianceVolume::setLights(const std::vector<sIrradianceLight>& lights, const float ambient[3])
+{
+	for (int c = 0; c < 3; c++)
+		this->ambient[c] = ambient[c];
+	this->iterations = 0;
+
+	int resolution = this->resolution;
+	parallelFor(0, resolution, [&](int first, int last, int thread_id) {
+		for (int z = first; z < last; z++) {
+			for (int y = 0; y < resolution; y++) {
+				for (int x = 0; x < resolution; x++) {
+					size_t i = ((size_t)z * resolution + y) * resolution + x;
+					float direct[3] = { 0.0f, 0.0f, 0.0f };
+					if (this->scattered_fraction[i] > 0.0f) {
+						for (const sIrradianceLight& light : lights) {
+							float transmittance = this->transmittanceToLight(x, y, z, light.position);
+							for (int c = 0; c < 3; c++)
+								direct[c] += transmittance * light.color[c];
+						}
+					}
+					for (int c = 0; c < 3; c++)
+						this->source[i * 3 + c] = this->scattered_fraction[i] * direct[c];
+				}
+			}
+		}
+	});
+}
+
+void IrradianceVolume::iterate(int count)
+{
+	int resolution = this->resolution;
+	std::vector<float> next(this->irradiance.size());
+
+	for (int iteration = 0; iteration < count; iteration++) {
+		parallelFor(0, resolution, [&](int first, int last, int thread_id) {
+			for (int z = first; z < last; z++) {
+				for (int y = 0; y < resolution; y++) {
+					for (int x = 0; x < resolution; x++) {
+						const int neighbors[6][3] = { { x - 1, y, z }, { x + 1, y, z }, { x, y - 1, z }, { x, y + 1, z }, { x, y, z - 1 }, { x, y, z + 1 } };
+						float received[3] = { 0.0f, 0.0f, 0.0f };
+						for (const int* n : neighbors) {
+							if (n[0] < 0 || n[1] < 0 || n[2] < 0 || n[0] >= resolution || n[1] >= resolution || n[2] >= resolution) {
+								for (int c = 0; c < 3; c++)
+									received[c] += this->ambient[c];
+								continue;
+							}
+							size_t j = ((size_t)n[2] * resolution + n[1]) * resolution + n[0];
+							for (int c = 0; c < 3; c++)
+								received[c] += this->transfer[j] * this->irradiance[j * 3 + c] + this->source[j * 3 + c];
+						}
+						size_t i = ((size_t)z * resolution + y) * resolution + x;
+						for (int c = 0; c < 3; c++)
+							next[i * 3 + c] = received[c] / 6.0f;
+					}
+				}
+			}
+		});
+		this->irradiance.swap(next);
+	}
+	this->iterations += count;
+}
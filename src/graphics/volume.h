@@ -0,0 +1,235 @@
+/*  CPU side helpers to build dense volumes (noise, voxelized grids...) before uploading them as 3D textures.
+	Bakes can run on a worker thread, the GL upload always happens on the main thread.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <functional>
+
+#define NOISE_VOLUME_RESOLUTION 128
+#define SPLAT_TILE_SIZE 16 //particles are splatted in per-thread tiles of SPLAT_TILE_SIZE^3 voxels
+#define MAJORANT_BLOCK_SIZE 8 //voxels per side of a cell of the majorant grid
+#define TRANSFER_FUNCTION_SIZE 256 //densities sampled per side of the pre-integrated table
+#define NRRD_MAX_HEADER_SIZE 65536 //bytes read to find the size of an attached .nrrd header without mapping the file
+#define VIRTUAL_BRICK_SIZE 32 //voxels per side of a brick of the virtual texture
+#define VIRTUAL_BRICK_TEXELS (VIRTUAL_BRICK_SIZE + 2) //the brick in the atlas, with one voxel of apron per side
+#define MAX_VIRTUAL_LEVELS 12 //it has to match the volume shaders
+#define VIRTUAL_FALLBACK_SIZE 64 //voxels per side (at most) of the level that always stays resident
+#define IRRADIANCE_VOLUME_SIZE 32 //cells per side of the irradiance volume
+
+//dense scalar grid, x varies fastest
+class VolumeData
+{
+public:
+	int width = 0;
+	int height = 0;
+	int depth = 0;
+	std::vector<float> data;
+
+	void resize(int width, int height, int depth);
+	bool empty() const { return data.empty(); }
+};
+
+//runs one bake at a time in a background thread, starting a new one cancels the one in flight
+class VolumeBakeTask
+{
+public:
+	typedef std::function<bool(VolumeData& volume, const std::atomic<bool>& cancelled)> BakeFunction;
+
+	VolumeBakeTask() {};
+	~VolumeBakeTask();
+
+	//never waits for the running bake: it is cancelled and retired, and joined once it notices
+	void start(BakeFunction bake);
+	void cancel();
+	bool isRunning() const { return current && !current->finished; }
+
+	//main thread only: moves the last finished bake into volume, returns false if there is none
+	bool fetch(VolumeData& volume);
+
+private:
+	struct sJob
+	{
+		std::thread worker;
+		std::atomic<bool> cancelled = false;
+		std::atomic<bool> finished = false;
+	};
+
+	void retire();
+	void joinRetired(bool wait);
+
+	std::unique_ptr<sJob> current;
+	std::vector<std::unique_ptr<sJob>> retired; //cancelled bakes still finishing their row
+
+	std::mutex result_mutex;
+	bool has_result = false;
+	VolumeData result;
+};
+
+//box filters the volume down to 1x1x1, levels[0] is the first level below volume (half its size)
+//values are clamped to [0, 1] first, the range the normalized GPU storage keeps
+void buildMipChain(const VolumeData& volume, std::vector<VolumeData>& levels);
+
+//upper bound of the density in blocks of MAJORANT_BLOCK_SIZE^3 voxels, used by the delta/ratio tracking
+//the cells span the volume uniformly and include the voxel of margin that trilinear filtering reaches
+void buildMajorantGrid(const VolumeData& volume, VolumeData& majorants);
+
+//control point of a transfer function, linearly interpolated between points sorted by density
+struct sTransferPoint
+{
+	float density;
+	float color[3];
+	float opacity; //scales the absorption coefficient of the material
+};
+
+//pre-integrates the transfer function over every pair of densities, table is TRANSFER_FUNCTION_SIZE^2 RGBA
+//floats with the front density varying fastest. Texel (front, back) is the average of color * opacity (rgb)
+//and opacity (a) along a segment whose density goes linearly from front to back, independent of its length
+void preintegrateTransferFunction(const std::vector<sTransferPoint>& points, std::vector<float>& table);
+
+//point of a particle cache, radius <= 0 uses the default splat radius
+struct sParticle
+{
+	float x, y, z;
+	float radius;
+	float density;
+};
+
+//reads .ply files (ascii or binary_little_endian, vertex x/y/z with optional radius or pscale and density)
+//and .pts files: "PTS1", a uint32 count and count records of x, y, z, radius, density floats
+bool loadParticles(const std::string& filename, std::vector<sParticle>& particles);
+
+//rasterizes the particles with the same falloff kernel as the VDB voxelization, the bounding box of the
+//particles is scaled uniformly to fit the grid and centered. default_radius is in voxels, radius in the file is in world units
+bool splatParticles(const std::vector<sParticle>& particles, VolumeData& volume, int resolution, float default_radius, const std::atomic<bool>* cancelled = NULL);
+
+//read-only memory mapping of a whole file, unmapped when closed or destroyed. It owns the mapping, so it can be
+//moved but not copied (and neither can the RawVolumeFile and VirtualVolume holding one)
+class MappedFile
+{
+public:
+	const uint8_t* data = NULL;
+	size_t size = 0;
+
+	MappedFile() {};
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+	MappedFile(MappedFile&& other) noexcept;
+	MappedFile& operator=(MappedFile&& other) noexcept;
+
+	bool open(const std::string& filename, bool sequential = true); //sequential = read once front to back
+	void close();
+
+private:
+#ifdef _WIN32
+	void* file_handle = NULL;
+	void* mapping_handle = NULL;
+#endif
+};
+
+//scalar volume stored as raw 8 or 16 bit voxels, x varies fastest. Supported files:
+//.nrrd with raw encoding (attached data), .nhdr pointing to a raw data file and
+//.raw with the size and type in the name, like bonsai_256x256x256_uint16.raw
+class RawVolumeFile
+{
+public:
+	int width = 0;
+	int height = 0;
+	int depth = 0;
+	int bytes_per_voxel = 1;
+	bool big_endian = false;
+
+	bool load(const std::string& filename, bool sequential = true);
+	bool readSize(const std::string& filename); //parses the header (or the name) only, the file is not mapped
+	const void* voxels() const { return file.data + offset; }
+	float value(size_t index) const; //normalized to [0, 1], like the GPU does
+
+private:
+	MappedFile file;
+	size_t offset = 0;
+
+	bool parseNRRDHeader(const std::string& filename, const char* header, size_t size, std::string& data_file);
+	bool parseFilename(const std::string& filename);
+};
+
+//same for a scanned volume, the values are normalized to [0, 1] like the GPU does (before the window)
+void buildMajorantGrid(const RawVolumeFile& raw, VolumeData& majorants);
+
+//out of core paging of a scanned volume for the virtual texturing, the mapped file is the cache. Level 0 are the
+//voxels of the file and every level halves the previous one, each level is split in bricks of VIRTUAL_BRICK_SIZE^3
+//voxels with their ids level after level (x fastest). A fixed atlas of slots holds the resident bricks, and the least
+//recently used one is evicted when a new brick needs its slot
+class VirtualVolume
+{
+public:
+	RawVolumeFile file;
+	int levels = 0;
+	int level_size[MAX_VIRTUAL_LEVELS][3] = {};
+	int level_bricks[MAX_VIRTUAL_LEVELS][3] = {};
+	int level_offset[MAX_VIRTUAL_LEVELS] = {}; //id of the first brick of the level
+	int num_bricks = 0;
+
+	int atlas_slots[3] = { 0, 0, 0 };
+	std::vector<uint32_t> page_table; //slot + 1 of every brick, 0 while it is not resident
+	std::vector<int> slot_bricks; //brick in every slot, -1 if empty
+	std::vector<uint32_t> slot_last_used;
+
+	bool load(const std::string& filename, int slots_per_side);
+	int fallbackLevel() const; //the first level that fits in VIRTUAL_FALLBACK_SIZE^3
+
+	//coarser levels average 2x2x2 voxels of level 0 around the center, so a brick never reads more than 8 voxels per texel
+	float value(int level, int x, int y, int z) const; //the position is clamped to the level
+	void buildBrick(int brick, std::vector<float>& texels) const; //VIRTUAL_BRICK_TEXELS^3 texels, apron included
+	void buildLevel(int level, VolumeData& volume) const;
+
+	//the bricks stamped with frame in the feedback were used: the resident ones are touched, and the missing ones get
+	//a slot (coarser levels first, at most max_uploads). uploads are the bricks whose data has to go to their slot
+	void update(const uint32_t* feedback, uint32_t frame, int max_uploads, std::vector<int>& uploads);
+};
+
+//light of the irradiance volume, in the local space of the volume ([-1, 1] cube)
+struct sIrradianceLight
+{
+	float position[3];
+	float color[3]; //scaled by the intensity
+};
+
+//low resolution estimate of the light that reaches every point of the medium after scattering more than once, plus
+//the ambient light coming from every side. The shaders add it to the single scattering they march, so it excludes the
+//direct light. Each cell receives the average of what its six neighbors pass on: what they transmit, plus the direct
+//and received light they scatter (albedo). Outside the cube there is only the ambient light. The Jacobi iterations
+//start from the previous solution, so moving a light only takes a few of them to converge again
+class IrradianceVolume
+{
+public:
+	int resolution = 0;
+	int iterations = 0; //since the medium or the lights changed
+	std::vector<float> irradiance; //rgb per cell, x fastest
+
+	//density is resampled (box filter) to resolution^3 cells, the coefficients are those of the material for density 1
+	void setMedium(const VolumeData& density, float absorption_coefficient, float scattering_coefficient, int resolution);
+	void setLights(const std::vector<sIrradianceLight>& lights, const float ambient[3]);
+	void iterate(int count);
+
+private:
+	float cell_size = 0.0f;
+	float ambient[3] = { 0.0f, 0.0f, 0.0f };
+	std::vector<float> optical_depth; //absorption across a cell
+	std::vector<float> transfer; //fraction of the received light a cell passes on, transmitted or scattered
+	std::vector<float> scattered_fraction; //albedo * (1 - transmittance) of a cell
+	std::vector<float> source; //rgb, direct light scattered by every cell
+
+	float transmittanceToLight(int x, int y, int z, const float light[3]) const;
+};
+
+//evaluates the same fractal noise the shaders used (cnoise) at every voxel center of the [-1, 1] cube
+//returns false if it was cancelled before finishing
+bool bakeFractalNoise(VolumeData& volume, int resolution, float noise_scale, float noise_detail, const std::atomic<bool>* cancelled = NULL);
@@ -172,7 +172,7 @@ void mainLoop(GLFWwindow* window)
 	}
 }
 
-int main(void) 
+int main(int argc, char** argv) 
 {
 	/* Glfw (Window API) */
 	if (!glfwInit())
@@ -228,6 +228,11 @@ int main(void)
 	app = new Application();
 	app->init(window);
 
+	// --benchmark runs both benchmarks on the first frame and quits, LIBGL_ALWAYS_SOFTWARE=1 does it on llvmpipe
+	for (int i = 1; i < argc; i++)
+		if (std::string(argv[i]) == "--benchmark")
+			app->benchmark_requested = app->exit_after_benchmark = true;
+
 	// Main loop, application gets inside here till user closes it
 	mainLoop(window);
 
@@ -0,0 +1,159 @@
+/*  Offline generator of the tiled blue noise texture the ray marchers use to jitter the ray start.
+	Void-and-cluster (Ulichney 1993) on a toroidal grid, so the texture tiles without seams.
+	The rank of every pixel is stored in the three channels of an uncompressed 24 bit TGA.
+
+	usage: bluenoise [output.tga] [size] [seed]
+	defaults: res/textures/bluenoise.tga 64 1
+*/
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+#include <random>
+
+#define SIGMA 1.5f //gaussian of the energy filter, in pixels
+
+class VoidAndCluster
+{
+public:
+	int size;
+	std::vector<uint8_t> pattern;
+	std::vector<float> energy;
+	std::vector<float> kernel; //toroidal gaussian indexed by the wrapped offset
+
+	VoidAndCluster(int size) : size(size), pattern(size * size, 0), energy(size * size, 0.f), kernel(size * size)
+	{
+		for (int y = 0; y < size; y++)
+			for (int x = 0; x < size; x++) {
+				float dx = (float)std::min(x, size - x);
+				float dy = (float)std::min(y, size - y);
+				kernel[y * size + x] = expf(-(dx * dx + dy * dy) / (2.f * SIGMA * SIGMA));
+			}
+	}
+
+	void set(int index, bool value)
+	{
+		pattern[index] = value;
+		float sign = value ? 1.f : -1.f;
+		int px = index % size;
+		int py = index / size;
+		for (int y = 0; y < size; y++) {
+			int ky = ((y - py + size) % size) * size;
+			for (int x = 0; x < size; x++)
+				energy[y * size + x] += sign * kernel[ky + (x - px + size) % size];
+		}
+	}
+
+	//highest energy among the set pixels
+	int tightestCluster() const
+	{
+		int best = -1;
+		for (int i = 0; i < size * size; i++)
+			if (pattern[i] && (best < 0 || energy[i] > energy[best]))
+				best = i;
+		return best;
+	}
+
+	//lowest energy among the empty pixels
+	int largestVoid() const
+	{
+		int best = -1;
+		for (int i = 0; i < size * size; i++)
+			if (!pattern[i] && (best < 0 || energy[i] < energy[best]))
+				best = i;
+		return best;
+	}
+};
+
+static bool saveTGA(const char* filename, int size, const std::vector<uint8_t>& values)
+{
+	FILE* file = fopen(filename, "wb");
+	if (!file)
+		return false;
+
+	uint8_t header[18] = { 0 };
+	header[2] = 2; //uncompressed true color
+	header[12] = size & 0xFF;
+	header[13] = (size >> 8) & 0xFF;
+	header[14] = size & 0xFF;
+	header[15] = (size >> 8) & 0xFF;
+	header[16] = 24;
+	fwrite(header, 1, sizeof(header), file);
+
+	std::vector<uint8_t> pixels(values.size() * 3);
+	for (size_t i = 0; i < values.size(); i++)
+		pixels[i * 3 + 0] = pixels[i * 3 + 1] = pixels[i * 3 + 2] = values[i];
+	bool ok = fwrite(pixels.data(), 1, pixels.size(), file) == pixels.size();
+	fclose(file);
+	return ok;
+}
+
+int main(int argc, char** argv)
+{
+	const char* output = argc > 1 ? argv[1] : "res/textures/bluenoise.tga";
+	int size = argc > 2 ? atoi(argv[2]) : 64;
+	unsigned int seed = argc > 3 ? (unsigned int)atoi(argv[3]) : 1;
+	if (size < 4 || size > 256) {
+		fprintf(stderr, "size must be between 4 and 256\n");
+		return 1;
+	}
+
+	int count = size * size;
+	VoidAndCluster vnc(size);
+
+	// initial binary pattern: ~10% random points, relaxed until the tightest cluster is the largest void
+	std::mt19937 rng(seed);
+	int ones = std::max(count / 10, 1);
+	std::vector<int> indices(count);
+	for (int i = 0; i < count; i++)
+		indices[i] = i;
+	std::shuffle(indices.begin(), indices.end(), rng);
+	for (int i = 0; i < ones; i++)
+		vnc.set(indices[i], true);
+
+	for (;;) {
+		int cluster = vnc.tightestCluster();
+		vnc.set(cluster, false);
+		int hole = vnc.largestVoid();
+		if (hole == cluster) {
+			vnc.set(cluster, true);
+			break;
+		}
+		vnc.set(hole, true);
+	}
+	std::vector<uint8_t> initial_pattern = vnc.pattern;
+	std::vector<float> initial_energy = vnc.energy;
+
+	std::vector<int> rank(count, 0);
+
+	// phase 1: the points of the initial pattern are ranked removing the tightest cluster each time
+	for (int r = ones - 1; r >= 0; r--) {
+		int cluster = vnc.tightestCluster();
+		vnc.set(cluster, false);
+		rank[cluster] = r;
+	}
+
+	// phase 2 and 3: the rest is ranked filling the largest void each time
+	vnc.pattern = initial_pattern;
+	vnc.energy = initial_energy;
+	for (int r = ones; r < count; r++) {
+		int hole = vnc.largestVoid();
+		vnc.set(hole, true);
+		rank[hole] = r;
+	}
+
+	// ranks are uniformly spread over [0, 256)
+	std::vector<uint8_t> values(count);
+	for (int i = 0; i < count; i++)
+		values[i] = (uint8_t)((rank[i] * 256) / count);
+
+	if (!saveTGA(output, size, values)) {
+		fprintf(stderr, "could not write %s\n", output);
+		return 1;
+	}
+	printf("blue noise %dx%d written to %s\n", size, size, output);
+	return 0;
+}